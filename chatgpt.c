@@ -18,36 +18,193 @@
 
 #include <cjson/cJSON.h>
 #include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_SIMD 1
+#include <immintrin.h>
+#endif
 
 #define APP_VERSION "0.5.2"
+#define DEFAULT_ENDPOINT "https://api.openai.com/v1/chat/completions"
 
 unsigned int tokens = 0;
 
-struct string
-{
-    char *ptr;
-    size_t len;
-};
-
 typedef enum
 {
     false,
     true
 } bool;
 
-void init_string(struct string *__str)
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_ALIGN 16
+
+/*
+    Region allocator: allocations are bumped out of large blocks and released all at once.
+    `turn_arena` holds everything belonging to a single request/command and is reset before
+    the next one, `session_arena` holds state that lives until the program exits.
+*/
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct arena
+{
+    struct arena_block *head;
+    size_t allocated; /* Bytes handed out since the last reset */
+    size_t peak;      /* Largest `allocated` seen before a reset */
+};
+
+struct arena turn_arena = { NULL, 0, 0 };
+struct arena session_arena = { NULL, 0, 0 };
+
+#define ARENA_HEADER_SIZE ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_block *block = a->head;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (block == NULL || block->size - block->used < size)
+    {
+        size_t block_size = block != NULL ? block->size * 2 : ARENA_BLOCK_SIZE;
+        if (block_size < size)
+            block_size = size;
+        block = malloc(ARENA_HEADER_SIZE + block_size);
+        if (block == NULL)
+        {
+            fprintf(stderr, "malloc() failed\n");
+            exit(EXIT_FAILURE);
+        }
+        block->next = a->head;
+        block->size = block_size;
+        block->used = 0;
+        a->head = block;
+    }
+
+    void *ptr = (char *)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    a->allocated += size;
+    return ptr;
+}
+
+/* Resize the allocation `ptr` of `old_size` bytes, in place when it is the last one of the arena */
+void *arena_realloc(struct arena *a, void *ptr, size_t old_size, size_t new_size)
+{
+    struct arena_block *block = a->head;
+    old_size = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (ptr != NULL && block != NULL && (char *)ptr + old_size == (char *)block + ARENA_HEADER_SIZE + block->used)
+    {
+        size_t grown = ((new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+        if (grown <= old_size || block->used - old_size + grown <= block->size)
+        {
+            if (grown > old_size)
+            {
+                block->used += grown - old_size;
+                a->allocated += grown - old_size;
+            }
+            return ptr;
+        }
+    }
+
+    void *new_ptr = arena_alloc(a, new_size);
+    if (ptr != NULL)
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    return new_ptr;
+}
+
+char *arena_strndup(struct arena *a, const char *s, size_t len)
+{
+    char *d = arena_alloc(a, len + 1);
+    memcpy(d, s, len);
+    d[len] = '\0';
+    return d;
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+    return arena_strndup(a, s, strlen(s));
+}
+
+char *arena_concat(struct arena *a, const char *__str1, const char *__str2)
+{
+    size_t len1 = strlen(__str1), len2 = strlen(__str2);
+    char *result = arena_alloc(a, len1 + len2 + 1);
+
+    memcpy(result, __str1, len1);
+    memcpy(result + len1, __str2, len2 + 1);
+    return result;
+}
+
+/* Release everything allocated from `a`, keeping its newest (largest) block for reuse */
+void arena_reset(struct arena *a)
+{
+    struct arena_block *block = a->head;
+
+    if (a->allocated > a->peak)
+        a->peak = a->allocated;
+    a->allocated = 0;
+    if (block == NULL)
+        return;
+    while (block->next != NULL)
+    {
+        struct arena_block *next = block->next->next;
+        free(block->next);
+        block->next = next;
+    }
+    block->used = 0;
+}
+
+void arena_free(struct arena *a)
+{
+    while (a->head != NULL)
+    {
+        struct arena_block *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->allocated = 0;
+}
+
+/* Growable string, backed by the heap or, when `arena` is set, by that arena */
+struct string
+{
+    char *ptr;
+    size_t len;
+    size_t cap;
+    struct arena *arena;
+};
+
+void init_string_arena(struct string *__str, struct arena *arena)
 {
     __str->len = 0;
-    __str->ptr = malloc(__str->len + 1);
+    __str->cap = 1;
+    __str->arena = arena;
+    __str->ptr = arena != NULL ? arena_alloc(arena, __str->cap) : malloc(__str->cap);
     if (__str->ptr == NULL)
     {
         fprintf(stderr, "malloc() failed\n");
@@ -56,6 +213,19 @@ void init_string(struct string *__str)
     __str->ptr[0] = '\0';
 }
 
+void init_string(struct string *__str)
+{
+    init_string_arena(__str, NULL);
+}
+
+/* Release a heap backed string; arena backed ones go away with their arena */
+void free_string(struct string *__str)
+{
+    if (__str->arena == NULL)
+        free(__str->ptr);
+    __str->ptr = NULL;
+}
+
 char *strdup(const char *s)
 {
     char *d = malloc(strlen(s) + 1);
@@ -65,584 +235,7691 @@ char *strdup(const char *s)
     return d;
 }
 
-char *concat(const char *__str1, const char *__str2)
+void append_string(struct string *s, const char *data, size_t len)
 {
-    char *result = malloc(strlen(__str1) + strlen(__str2) + 1);
-
-    if (result == NULL)
+    size_t new_len = s->len + len;
+    if (new_len + 1 > s->cap)
     {
-        free(result);
-        return "";
+        /* Grow geometrically so that a long stream of small appends stays linear */
+        size_t new_cap = s->cap * 2;
+        if (new_cap < new_len + 1)
+            new_cap = new_len + 1;
+        if (s->arena != NULL)
+            s->ptr = arena_realloc(s->arena, s->ptr, s->cap, new_cap);
+        else
+            s->ptr = realloc(s->ptr, new_cap);
+        if (s->ptr == NULL)
+        {
+            fprintf(stderr, "realloc() failed\n");
+            exit(EXIT_FAILURE);
+        }
+        s->cap = new_cap;
     }
-
-    strcpy(result, __str1);
-    strcat(result, __str2);
-    return result;
+    memcpy(s->ptr + s->len, data, len);
+    s->ptr[new_len] = '\0';
+    s->len = new_len;
 }
 
-size_t writefunc(void *ptr, size_t size, size_t nmemb, struct string *s)
+/* Make room for at least `extra` more bytes without further reallocations */
+void reserve_string(struct string *s, size_t extra)
 {
-    size_t new_len = s->len + size * nmemb;
-    s->ptr = realloc(s->ptr, new_len + 1);
+    size_t needed = s->len + extra + 1;
+    if (needed <= s->cap)
+        return;
+    if (s->arena != NULL)
+        s->ptr = arena_realloc(s->arena, s->ptr, s->cap, needed);
+    else
+        s->ptr = realloc(s->ptr, needed);
     if (s->ptr == NULL)
     {
         fprintf(stderr, "realloc() failed\n");
         exit(EXIT_FAILURE);
     }
-    memcpy(s->ptr + s->len, ptr, size * nmemb);
-    s->ptr[new_len] = '\0';
-    s->len = new_len;
-
-    return size * nmemb;
+    s->cap = needed;
 }
 
-unsigned short contains_str_before_space(const char *full_str, const char *coincidence, char **remaining_data)
+/*
+    JSON string escaping. Text is scanned for the bytes that need attention (quotes, backslashes,
+    control characters and the start of non-ASCII sequences) 16 or 32 bytes at a time with SSE2 or
+    AVX2 when the CPU has them, 8 at a time otherwise; whatever lies between them is copied as is.
+    Every control character is escaped, and bytes that are not valid UTF-8 become \ufffd so that
+    pasted binary garbage still produces valid JSON.
+*/
+
+/* Escape letter of every byte: 0 if it is copied as is, 'u' for \u00XX, 1 for the start of a multibyte sequence */
+const char json_escapes[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
+};
+
+/*
+    Kernels: length of the leading part of `s` with nothing to escape. With `escaping` false they
+    only stop at quotes and backslashes, which is what unescaping a JSON string body needs.
+*/
+size_t json_scan_scalar(const char *s, size_t len, bool escaping)
 {
-    const char *space = strchr(full_str, ' ');
-    const char *found_coinc = strstr(full_str, coincidence);
+    const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+    size_t i = 0;
 
-    if (found_coinc == NULL || (space != NULL && found_coinc + strlen(coincidence) != space))
+    for (; i + 8 <= len; i += 8)
     {
-        return 0;
+        uint64_t w, quote, backslash, found;
+        memcpy(&w, s + i, 8);
+        quote = w ^ (ones * '"');
+        backslash = w ^ (ones * '\\');
+        found = ((quote - ones) & ~quote) | ((backslash - ones) & ~backslash);
+        if (escaping)
+            found |= (w - ones * 0x20) | w;
+        if ((found & highs) != 0)
+            break;
     }
-
-    if (found_coinc < space)
+    for (; i < len; i++)
     {
-        if (remaining_data != NULL)
-        {
-            *remaining_data = space ? (char *)(space + 1) : NULL;
-        }
-        return 1;
+        if (escaping ? json_escapes[(unsigned char)s[i]] != 0 : (s[i] == '"' || s[i] == '\\'))
+            break;
     }
+    return i;
+}
 
-    if (space == NULL)
+#ifdef JSON_SIMD
+size_t json_scan_sse2(const char *s, size_t len, bool escaping)
+{
+    const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), space = _mm_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16)
     {
-        if (strcmp(full_str, coincidence) == 0)
-            return 1;
-        return 0;
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+        int mask;
+        /* Signed comparison: bytes from 0x80 up are negative, so they are caught with the controls */
+        if (escaping)
+            found = _mm_or_si128(found, _mm_cmplt_epi8(v, space));
+        if ((mask = _mm_movemask_epi8(found)) != 0)
+            return i + __builtin_ctz(mask);
     }
-
-    return 0;
+    return i + json_scan_scalar(s + i, len - i, escaping);
 }
 
-char *chatgpt_curl_perform(const char *data, const char *apikey, const char *endpoint)
+__attribute__((target("avx2"))) size_t json_scan_avx2(const char *s, size_t len, bool escaping)
 {
-    CURL *curl;
-    CURLcode res;
-
-    curl_global_init(CURL_GLOBAL_ALL);
-
-    curl = curl_easy_init();
+    const __m256i quote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\'), space = _mm256_set1_epi8(0x20);
+    size_t i = 0;
 
-    if (!curl)
+    for (; i + 32 <= len; i += 32)
     {
-        curl_global_cleanup();
-        fprintf(stderr, "Error: Could not initialize cURL\n");
-        return NULL;
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash));
+        unsigned int mask;
+        if (escaping)
+            found = _mm256_or_si256(found, _mm256_cmpgt_epi8(space, v));
+        if ((mask = _mm256_movemask_epi8(found)) != 0)
+            return i + __builtin_ctz(mask);
     }
+    return i + json_scan_sse2(s + i, len - i, escaping);
+}
+#endif
 
-    struct curl_slist *headers = NULL;
-    char *auth_header = concat("Authorization: Bearer ", apikey);
-    curl_easy_setopt(curl, CURLOPT_URL, endpoint);
+size_t json_scan_resolve(const char *s, size_t len, bool escaping);
 
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, auth_header);
+/* Fastest kernel the CPU supports, picked on first use */
+size_t (*json_scan)(const char *s, size_t len, bool escaping) = json_scan_resolve;
 
-    struct string json_output;
-    init_string(&json_output);
+size_t json_scan_resolve(const char *s, size_t len, bool escaping)
+{
+    json_scan = json_scan_scalar;
+#ifdef JSON_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        json_scan = json_scan_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        json_scan = json_scan_sse2;
+#endif
+    return json_scan(s, len, escaping);
+}
 
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+/* Length of the valid UTF-8 sequence starting at `s` (`len` bytes available), or 0 if there is none */
+size_t utf8_sequence(const unsigned char *s, size_t len)
+{
+    size_t n, i;
+    unsigned char low = 0x80, high = 0xBF;
+
+    if (s[0] >= 0xC2 && s[0] <= 0xDF)
+        n = 2;
+    else if (s[0] >= 0xE0 && s[0] <= 0xEF)
+    {
+        n = 3;
+        if (s[0] == 0xE0)
+            low = 0xA0;
+        else if (s[0] == 0xED)
+            high = 0x9F; /* No UTF-16 surrogates */
+    }
+    else if (s[0] >= 0xF0 && s[0] <= 0xF4)
+    {
+        n = 4;
+        if (s[0] == 0xF0)
+            low = 0x90;
+        else if (s[0] == 0xF4)
+            high = 0x8F; /* Nothing past U+10FFFF */
+    }
+    else
+        return 0;
 
-    size_t i = 1;
+    if (len < n || s[1] < low || s[1] > high)
+        return 0;
+    for (i = 2; i < n; i++)
+    {
+        if (s[i] < 0x80 || s[i] > 0xBF)
+            return 0;
+    }
+    return n;
+}
 
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strlen(data));
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &json_output);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 300L);
+/*
+    Escape as much of `src` as fits in `room` bytes of `dst`; `*consumed` receives the source bytes
+    used. With `dst` NULL nothing is written and the escaped length is just counted.
+*/
+size_t json_escape(char *dst, size_t room, const char *src, size_t len, size_t *consumed)
+{
+    const char *hex = "0123456789abcdef";
+    size_t i = 0, j = 0;
 
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK)
+    while (i < len)
     {
-        fprintf(stderr, "HTTP request failed: %s.", curl_easy_strerror(res));
-        if (strcmp(curl_easy_strerror(res), "Timeout was reached") == 0)
+        unsigned char c = src[i];
+        char escape = json_escapes[c];
+        size_t n;
+
+        if (escape == 0)
         {
-            fprintf(stderr, " This is probably OpenAI's fault. Try again later.");
+            n = json_scan(src + i, len - i, true);
+            if (n > room - j)
+                n = room - j;
+            /* Short runs, the usual case between escapes, are copied with one fixed size move */
+            if (dst != NULL && n <= 16 && room - j >= 16 && len - i >= 16)
+                memcpy(dst + j, src + i, 16);
+            else if (dst != NULL)
+                memcpy(dst + j, src + i, n);
+            i += n;
+            j += n;
+            if (j == room)
+                break;
+            continue;
         }
-        printf("\n");
-        return NULL;
-    }
 
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
-    cJSON *root = cJSON_Parse(json_output.ptr);
-    if (!root)
-    {
-        fprintf(stderr, "Error parsing result. Check your API key, network connection, account credits and model used. API response:\n%s", json_output.ptr);
-        return NULL;
+        if (escape == 1 && (n = utf8_sequence((const unsigned char *)src + i, len - i)) > 0)
+        {
+            if (room - j < n)
+                break;
+            if (dst != NULL)
+                memcpy(dst + j, src + i, n);
+            i += n;
+            j += n;
+            continue;
+        }
+        if (escape == 'u' || escape == 1)
+        {
+            if (room - j < 6)
+                break;
+            if (dst != NULL)
+            {
+                memcpy(dst + j, escape == 1 ? "\\ufffd" : "\\u00", escape == 1 ? 6 : 4);
+                if (escape == 'u')
+                {
+                    dst[j + 4] = hex[c >> 4];
+                    dst[j + 5] = hex[c & 15];
+                }
+            }
+            i++;
+            j += 6;
+            continue;
+        }
+        if (room - j < 2)
+            break;
+        if (dst != NULL)
+        {
+            dst[j] = '\\';
+            dst[j + 1] = escape;
+        }
+        i++;
+        j += 2;
     }
-    cJSON *choices = cJSON_GetObjectItemCaseSensitive(root, "choices");
-    if (!cJSON_IsArray(choices))
+
+    *consumed = i;
+    return j;
+}
+
+/* Length of `str` (`len` bytes) once escaped as a JSON string body */
+size_t escaped_length(const char *str, size_t len)
+{
+    size_t consumed;
+    return json_escape(NULL, (size_t)-1, str, len, &consumed);
+}
+
+/* Write the JSON-escaped form of `str` into `dst` (no terminator), returning the bytes written */
+size_t escape_into(char *dst, const char *str, size_t len)
+{
+    size_t consumed;
+    return json_escape(dst, (size_t)-1, str, len, &consumed);
+}
+
+/* Append the JSON-escaped form of `str` to `s` */
+void append_escaped(struct string *s, const char *str)
+{
+    size_t len = strlen(str);
+
+    reserve_string(s, escaped_length(str, len));
+    s->len += escape_into(s->ptr + s->len, str, len);
+    s->ptr[s->len] = '\0';
+}
+
+#define JSON_MAX_DEPTH 32
+
+/* Object keys the extractor cares about, everything else is JK_OTHER */
+enum json_key
+{
+    JK_OTHER,
+    JK_CHOICES,
+    JK_MESSAGE,
+    JK_DELTA,
+    JK_CONTENT,
+    JK_USAGE,
+    JK_TOTAL_TOKENS,
+    JK_PROMPT_TOKENS,
+    JK_COMPLETION_TOKENS,
+    JK_ERROR
+};
+
+const char *json_key_names[] = { "", "choices", "message", "delta", "content", "usage",
+                                 "total_tokens", "prompt_tokens", "completion_tokens", "error" };
+
+enum json_state
+{
+    JS_VALUE,
+    JS_VALUE_OR_END,
+    JS_KEY,
+    JS_KEY_OR_END,
+    JS_COLON,
+    JS_AFTER_VALUE,
+    JS_STRING,
+    JS_ESCAPE,
+    JS_UNICODE,
+    JS_NUMBER,
+    JS_LITERAL,
+    JS_DONE,
+    JS_INVALID
+};
+
+struct json_level
+{
+    char type; /* '{' or '[' */
+    enum json_key key;
+    int index;
+};
+
+/*
+    Incremental extractor for chat completion responses. It is fed the body in arbitrary
+    pieces and, without building a tree, unescapes choices[0].message.content (or .delta.content
+    for streamed chunks) straight into `content`, error.message into `error` and keeps the usage.
+*/
+struct json_extract
+{
+    struct json_level stack[JSON_MAX_DEPTH];
+    int depth;
+    enum json_state state;
+    bool in_key;
+    char key[24];
+    size_t key_len;
+    struct string *target; /* Destination of the string being read, NULL to skip it */
+    long *number_target;
+    char number[32];
+    size_t number_len;
+    unsigned int codepoint;
+    unsigned int high_surrogate;
+    int hex_digits;
+    struct string *content;
+    struct string *error;
+    bool has_content;
+    bool has_error;
+    long total_tokens;
+    long prompt_tokens;
+    long completion_tokens;
+};
+
+void json_extract_init(struct json_extract *x, struct string *content, struct string *error)
+{
+    x->depth = 0;
+    x->state = JS_VALUE;
+    x->in_key = false;
+    x->key_len = 0;
+    x->target = NULL;
+    x->number_target = NULL;
+    x->number_len = 0;
+    x->high_surrogate = 0;
+    x->content = content;
+    x->error = error;
+    x->has_content = false;
+    x->has_error = false;
+    x->total_tokens = -1;
+    x->prompt_tokens = -1;
+    x->completion_tokens = -1;
+}
+
+void json_put_codepoint(struct string *s, unsigned int c)
+{
+    char utf8[4];
+    size_t n;
+
+    if (c < 0x80)
     {
-        fprintf(stderr, "Error parsing result. Check your API key, network connection, account credits and model used. API response:\n%s", json_output.ptr);
-        return NULL;
+        utf8[0] = c;
+        n = 1;
     }
-    cJSON *choice = cJSON_GetArrayItem(choices, 0);
-    if (!cJSON_IsObject(choice))
+    else if (c < 0x800)
     {
-        fprintf(stderr, "Error parsing result. Check your API key, network connection, account credits and model used. API response:\n%s", json_output.ptr);
-        return NULL;
+        utf8[0] = 0xC0 | (c >> 6);
+        utf8[1] = 0x80 | (c & 0x3F);
+        n = 2;
     }
-    cJSON *message = cJSON_GetObjectItemCaseSensitive(choice, "message");
-    if (!cJSON_IsObject(message))
+    else if (c < 0x10000)
     {
-        fprintf(stderr, "Error parsing result. Check your API key, network connection, account credits and model used. API response:\n%s", json_output.ptr);
-        return NULL;
+        utf8[0] = 0xE0 | (c >> 12);
+        utf8[1] = 0x80 | ((c >> 6) & 0x3F);
+        utf8[2] = 0x80 | (c & 0x3F);
+        n = 3;
     }
-    cJSON *content = cJSON_GetObjectItemCaseSensitive(message, "content");
-    if (!cJSON_IsString(content))
+    else
     {
-        fprintf(stderr, "Error parsing result. Check your API key, network connection, account credits and model used.\n\nAPI response:\n%s", json_output.ptr);
-        return NULL;
+        utf8[0] = 0xF0 | (c >> 18);
+        utf8[1] = 0x80 | ((c >> 12) & 0x3F);
+        utf8[2] = 0x80 | ((c >> 6) & 0x3F);
+        utf8[3] = 0x80 | (c & 0x3F);
+        n = 4;
     }
+    append_string(s, utf8, n);
+}
 
-    for (i = 0; i < 2; i++)
+/* Add bytes to the string being read: an object key or, if wanted, a value */
+void json_emit(struct json_extract *x, const char *data, size_t len)
+{
+    if (x->in_key)
     {
-        if (content->valuestring[0] == '\n')
-            content->valuestring++;
-        else
-            break;
+        if (x->key_len + len < sizeof(x->key))
+            memcpy(x->key + x->key_len, data, len);
+        x->key_len += len;
     }
+    else if (x->target != NULL)
+        append_string(x->target, data, len);
+}
 
-    char *curl_result = malloc(strlen(content->valuestring) + 1);
-    strcpy(curl_result, content->valuestring);
+/* Decide where the value starting now goes, from the keys of the enclosing containers */
+void json_value_start(struct json_extract *x, char c)
+{
+    struct json_level *s = x->stack;
+    int d = x->depth;
 
-    for (; i > 0; i--)
-        content->valuestring--;
+    x->target = NULL;
+    x->number_target = NULL;
+    if (d == 0 || s[0].type != '{')
+        return;
 
-    cJSON *usage = cJSON_GetObjectItemCaseSensitive(root, "usage");
-    if (!cJSON_IsObject(usage))
+    if (d == 1 && s[0].key == JK_ERROR && (c == '{' || c == '"'))
     {
-        fprintf(stderr, "Error parsing result. Token usage is not available, but should be. API response:\n%s", json_output.ptr);
-        return NULL;
+        x->has_error = true;
+        if (c == '"')
+            x->target = x->error;
     }
-
-    cJSON *totalusage = cJSON_GetObjectItemCaseSensitive(usage, "total_tokens");
-    if (!cJSON_IsNumber(totalusage))
+    else if (d == 2 && s[0].key == JK_ERROR && s[1].type == '{' && s[1].key == JK_MESSAGE && c == '"')
+        x->target = x->error;
+    else if (d == 2 && s[0].key == JK_USAGE && s[1].type == '{')
     {
-        fprintf(stderr, "Error parsing result. Total tokens aren't available, but they should. API response:\n%s", json_output.ptr);
-        return NULL;
+        if (s[1].key == JK_TOTAL_TOKENS)
+            x->number_target = &x->total_tokens;
+        else if (s[1].key == JK_PROMPT_TOKENS)
+            x->number_target = &x->prompt_tokens;
+        else if (s[1].key == JK_COMPLETION_TOKENS)
+            x->number_target = &x->completion_tokens;
     }
-
-    if (cJSON_IsNumber(totalusage))
+    else if (d == 4 && s[0].key == JK_CHOICES && s[1].type == '[' && s[1].index == 0 && s[2].type == '{' &&
+             (s[2].key == JK_MESSAGE || s[2].key == JK_DELTA) && s[3].type == '{' && s[3].key == JK_CONTENT && c == '"')
     {
-        tokens += totalusage->valueint;
+        x->target = x->content;
+        x->has_content = true;
     }
-    else
-        fprintf(stderr, "Error parsing result. \"total_tokens\"'s value is not a number. API response:\n%s", json_output.ptr);
-
-    cJSON_Delete(root);
-
-    free(auth_header);
+}
 
-    curl_global_cleanup();
+enum json_key json_lookup_key(const char *key, size_t len)
+{
+    int i;
 
-    return curl_result;
+    if (len >= 24)
+        return JK_OTHER;
+    for (i = 1; i <= JK_ERROR; i++)
+        if (strlen(json_key_names[i]) == len && memcmp(json_key_names[i], key, len) == 0)
+            return (enum json_key)i;
+    return JK_OTHER;
 }
 
-char *escape_string(const char *str)
+/* Character a one letter escape sequence stands for, 0 for \u and invalid ones */
+char json_unescape_char(char c)
 {
-    size_t new_len = strlen(str), i = 0;
-    for (; i < strlen(str); i++)
-        if (str[i] == '\"' || str[i] == '\\' || str[i] == '\n' || str[i] == '\r' || str[i] == '\t')
-            new_len++;
-
-    char *escaped_str = (char *)malloc(new_len + 1);
-    size_t j = 0;
-    for (i = 0; i < strlen(str); i++)
+    switch (c)
     {
-        switch (str[i])
-        {
-        case '\"':
-            escaped_str[j++] = '\\';
-            escaped_str[j++] = '\"';
-            break;
-        case '\\':
-            escaped_str[j++] = '\\';
-            escaped_str[j++] = '\\';
-            break;
-        case '\n':
-            escaped_str[j++] = '\\';
-            escaped_str[j++] = 'n';
-            break;
-        case '\r':
-            escaped_str[j++] = '\\';
-            escaped_str[j++] = 'r';
-            break;
-        case '\t':
-            escaped_str[j++] = '\\';
-            escaped_str[j++] = 't';
-            break;
-        default:
-            escaped_str[j++] = str[i];
-            break;
-        }
+    case 'n':
+        return '\n';
+    case 't':
+        return '\t';
+    case 'r':
+        return '\r';
+    case 'b':
+        return '\b';
+    case 'f':
+        return '\f';
+    case '"':
+    case '\\':
+    case '/':
+        return c;
+    default:
+        return 0;
     }
-    escaped_str[j] = '\0';
-
-    return escaped_str;
 }
 
-char *autocomplete(const char *text, int state)
+/* Replace a high surrogate that was not followed by its low half with U+FFFD */
+void json_flush_surrogate(struct json_extract *x)
 {
-    /* Not the best code at all, but it requires few memory management */
-    if (strlen(text) < 1)
-        return NULL;
-    const char *available_commands[13] = { "/apikey", "/clear", "/endpoint", "/exit", "/export",
-                                         "/help", "/import", "/model", "/reset",
-                                         "/showusage", "/system", "/temperature", "/version" };
-    unsigned short total_commands = 0;
-    size_t text_length = strlen(text);
+    if (x->high_surrogate)
+    {
+        json_put_codepoint(x->target != NULL ? x->target : x->content, 0xFFFD);
+        x->high_surrogate = 0;
+    }
+}
 
-    unsigned short i = 0;
-    for (; i < 13; i++)
+/* Feed the next piece of the document; returns false once it is known to be invalid */
+bool json_extract_feed(struct json_extract *x, const char *data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len)
     {
-        if (strncmp(available_commands[i], text, text_length) == 0)
-            total_commands++;
+        char c = data[i];
+
+        switch (x->state)
+        {
+        case JS_STRING:
+        {
+            /* Copy the longest run that needs no unescaping in one go */
+            size_t run = i + json_scan(data + i, len - i, false);
+            if (run > i)
+            {
+                json_flush_surrogate(x);
+                json_emit(x, data + i, run - i);
+                i = run;
+                continue;
+            }
+            if (c == '\\' && i + 1 < len && json_unescape_char(data[i + 1]) != 0)
+            {
+                /* Both halves of the escape are here, skip the trip through JS_ESCAPE */
+                char out = json_unescape_char(data[i + 1]);
+                json_flush_surrogate(x);
+                json_emit(x, &out, 1);
+                i += 2;
+                continue;
+            }
+            if (c == '\\')
+                x->state = JS_ESCAPE;
+            else if (x->in_key)
+            {
+                x->in_key = false;
+                x->stack[x->depth - 1].key = json_lookup_key(x->key, x->key_len);
+                x->state = JS_COLON;
+            }
+            else
+            {
+                json_flush_surrogate(x);
+                x->target = NULL;
+                x->state = x->depth == 0 ? JS_DONE : JS_AFTER_VALUE;
+            }
+            i++;
+            continue;
+        }
+        case JS_ESCAPE:
+        {
+            char out = json_unescape_char(c);
+            x->state = JS_STRING;
+            if (c == 'u')
+            {
+                x->state = JS_UNICODE;
+                x->codepoint = 0;
+                x->hex_digits = 0;
+            }
+            else if (out == 0)
+            {
+                x->state = JS_INVALID;
+                return false;
+            }
+            else
+            {
+                json_flush_surrogate(x);
+                json_emit(x, &out, 1);
+            }
+            i++;
+            continue;
+        }
+        case JS_UNICODE:
+        {
+            int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+            if (digit < 0)
+            {
+                x->state = JS_INVALID;
+                return false;
+            }
+            x->codepoint = (x->codepoint << 4) | digit;
+            i++;
+            if (++x->hex_digits < 4)
+                continue;
+            x->state = JS_STRING;
+            if (x->in_key || x->target == NULL)
+                continue;
+            if (x->codepoint >= 0xDC00 && x->codepoint < 0xE000 && x->high_surrogate)
+            {
+                json_put_codepoint(x->target, 0x10000 + ((x->high_surrogate - 0xD800) << 10) + (x->codepoint - 0xDC00));
+                x->high_surrogate = 0;
+                continue;
+            }
+            json_flush_surrogate(x);
+            if (x->codepoint >= 0xD800 && x->codepoint < 0xDC00)
+                x->high_surrogate = x->codepoint;
+            else
+                json_put_codepoint(x->target, x->codepoint >= 0xDC00 && x->codepoint < 0xE000 ? 0xFFFD : x->codepoint);
+            continue;
+        }
+        case JS_NUMBER:
+            if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E')
+            {
+                if (x->number_len + 1 < sizeof(x->number))
+                    x->number[x->number_len++] = c;
+                i++;
+                continue;
+            }
+            x->number[x->number_len] = '\0';
+            if (x->number_target != NULL)
+                *x->number_target = strtol(x->number, NULL, 10);
+            x->state = x->depth == 0 ? JS_DONE : JS_AFTER_VALUE;
+            continue; /* `c` belongs to what follows the number */
+        case JS_LITERAL:
+            if (c >= 'a' && c <= 'z')
+            {
+                i++;
+                continue;
+            }
+            x->state = x->depth == 0 ? JS_DONE : JS_AFTER_VALUE;
+            continue;
+        default:
+            break;
+        }
+
+        i++;
+        if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
+            continue;
+
+        switch (x->state)
+        {
+        case JS_VALUE_OR_END:
+            if (c == ']')
+            {
+                x->depth--;
+                x->state = x->depth == 0 ? JS_DONE : JS_AFTER_VALUE;
+                break;
+            }
+            /* Fall through */
+        case JS_VALUE:
+            json_value_start(x, c);
+            if (c == '{' || c == '[')
+            {
+                if (x->depth == JSON_MAX_DEPTH)
+                {
+                    x->state = JS_INVALID;
+                    return false;
+                }
+                x->stack[x->depth].type = c;
+                x->stack[x->depth].key = JK_OTHER;
+                x->stack[x->depth].index = 0;
+                x->depth++;
+                x->state = c == '{' ? JS_KEY_OR_END : JS_VALUE_OR_END;
+            }
+            else if (c == '"')
+                x->state = JS_STRING;
+            else if (c == '-' || (c >= '0' && c <= '9'))
+            {
+                x->number[0] = c;
+                x->number_len = 1;
+                x->state = JS_NUMBER;
+            }
+            else if (c == 't' || c == 'f' || c == 'n')
+                x->state = JS_LITERAL;
+            else
+            {
+                x->state = JS_INVALID;
+                return false;
+            }
+            break;
+        case JS_KEY_OR_END:
+            if (c == '}')
+            {
+                x->depth--;
+                x->state = x->depth == 0 ? JS_DONE : JS_AFTER_VALUE;
+                break;
+            }
+            /* Fall through */
+        case JS_KEY:
+            if (c != '"')
+            {
+                x->state = JS_INVALID;
+                return false;
+            }
+            x->in_key = true;
+            x->key_len = 0;
+            x->state = JS_STRING;
+            break;
+        case JS_COLON:
+            if (c != ':')
+            {
+                x->state = JS_INVALID;
+                return false;
+            }
+            x->state = JS_VALUE;
+            break;
+        case JS_AFTER_VALUE:
+            if (c == ',' && x->stack[x->depth - 1].type == '{')
+                x->state = JS_KEY;
+            else if (c == ',')
+            {
+                x->stack[x->depth - 1].index++;
+                x->state = JS_VALUE;
+            }
+            else if ((c == '}' && x->stack[x->depth - 1].type == '{') || (c == ']' && x->stack[x->depth - 1].type == '['))
+            {
+                x->depth--;
+                x->state = x->depth == 0 ? JS_DONE : JS_AFTER_VALUE;
+            }
+            else
+            {
+                x->state = JS_INVALID;
+                return false;
+            }
+            break;
+        case JS_DONE:
+        case JS_INVALID:
+        default:
+            x->state = JS_INVALID;
+            return false;
+        }
     }
-    if (total_commands == 0)
-        printf("\a");
-    else if (total_commands == 1)
+
+    return true;
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define RESPONSE_RAW_KEEP 65536
+
+/* Everything needed to receive one completion, streamed or not. Buffers live in the turn arena */
+struct response
+{
+    struct arena *arena;
+    CURL *curl;
+    bool stream;
+    bool use_cjson;             /* Parse with cJSON instead of the incremental extractor */
+    bool echo;                  /* Print streamed deltas as they arrive */
+    void (*sink)(struct response *resp, const char *text, size_t len); /* Gets echoed text instead of stdout */
+    void *sink_data;
+    bool quiet;                 /* Leave error reporting to the caller, through `failure` */
+    struct string raw;          /* Whole body for cJSON, its first bytes otherwise (error reports) */
+    struct string pending;      /* Streaming: bytes of a line not terminated yet */
+    struct string content;      /* Reply text, unescaped */
+    struct string delta;        /* Streaming: content of the current event */
+    struct string error;
+    struct json_extract json;   /* Non-streamed bodies, fed across write callbacks */
+    unsigned int frames;
+    unsigned short skipped_newlines;
+    long total_tokens;
+    long prompt_tokens;
+    long completion_tokens;
+    bool done;
+    bool failed;
+    const char *failure;
+    double parse_time;          /* Seconds spent handling the body */
+    double started;
+    double progress_at;         /* When the last body bytes arrived */
+    double first_byte_at;       /* When the body started arriving, 0 before */
+    curl_off_t progress_bytes;
+    const char *timed_out;      /* Which of our deadlines aborted the transfer */
+    struct response **race;     /* Hedged requests: the first one answering successfully wins */
+};
+
+/* Timeouts (in seconds, 0 to disable), retries and hedging applied to every request */
+struct request_policy
+{
+    double connect_timeout;
+    double first_byte_timeout;
+    double stall_timeout;
+    long total_timeout;
+    unsigned int retries;
+    bool hedge;
+};
+
+struct request_policy policy = { 10, 120, 60, 300, 2, false };
+
+/* Set by Ctrl+C in shell mode: the running request is cancelled */
+volatile sig_atomic_t interrupted = 0;
+
+bool cjson_parser = false;
+bool compress_requests = false;
+
+void response_init(struct response *resp, struct arena *arena, CURL *curl, bool stream, bool echo)
+{
+    resp->arena = arena;
+    resp->curl = curl;
+    resp->stream = stream;
+    resp->use_cjson = cjson_parser;
+    resp->echo = echo;
+    resp->sink = NULL;
+    resp->sink_data = NULL;
+    resp->quiet = false;
+    resp->failure = NULL;
+    resp->parse_time = 0;
+    resp->started = now_seconds();
+    resp->progress_at = resp->started;
+    resp->first_byte_at = 0;
+    resp->progress_bytes = 0;
+    resp->timed_out = NULL;
+    resp->race = NULL;
+    init_string_arena(&resp->raw, arena);
+    init_string_arena(&resp->pending, arena);
+    init_string_arena(&resp->content, arena);
+    init_string_arena(&resp->delta, arena);
+    init_string_arena(&resp->error, arena);
+    json_extract_init(&resp->json, &resp->content, &resp->error);
+    resp->frames = 0;
+    resp->skipped_newlines = 0;
+    resp->total_tokens = -1;
+    resp->prompt_tokens = -1;
+    resp->completion_tokens = -1;
+    resp->done = false;
+    resp->failed = false;
+}
+
+/* cJSON fallback for a single streamed event: same outputs as the extractor */
+void response_event_cjson(struct response *resp, const char *payload)
+{
+    cJSON *root = cJSON_Parse(payload);
+    if (!root)
+        return;
+    resp->frames++;
+
+    cJSON *error = cJSON_GetObjectItemCaseSensitive(root, "error");
+    if (cJSON_IsObject(error))
     {
-        for (i = 0; i < 13; i++)
-            if (strncmp(available_commands[i], text, text_length) == 0)
+        cJSON *message = cJSON_GetObjectItemCaseSensitive(error, "message");
+        const char *text = cJSON_IsString(message) ? message->valuestring : payload;
+        append_string(&resp->error, text, strlen(text));
+        resp->failed = true;
+    }
+
+    cJSON *choices = cJSON_GetObjectItemCaseSensitive(root, "choices");
+    cJSON *choice = cJSON_IsArray(choices) ? cJSON_GetArrayItem(choices, 0) : NULL;
+    cJSON *delta = cJSON_IsObject(choice) ? cJSON_GetObjectItemCaseSensitive(choice, "delta") : NULL;
+    cJSON *content = cJSON_IsObject(delta) ? cJSON_GetObjectItemCaseSensitive(delta, "content") : NULL;
+    if (cJSON_IsString(content))
+        append_string(&resp->delta, content->valuestring, strlen(content->valuestring));
+
+    cJSON *usage = cJSON_GetObjectItemCaseSensitive(root, "usage");
+    if (cJSON_IsObject(usage))
+    {
+        cJSON *total = cJSON_GetObjectItemCaseSensitive(usage, "total_tokens");
+        cJSON *prompt = cJSON_GetObjectItemCaseSensitive(usage, "prompt_tokens");
+        cJSON *completion = cJSON_GetObjectItemCaseSensitive(usage, "completion_tokens");
+        if (cJSON_IsNumber(total))
+            resp->total_tokens = total->valueint;
+        if (cJSON_IsNumber(prompt))
+            resp->prompt_tokens = prompt->valueint;
+        if (cJSON_IsNumber(completion))
+            resp->completion_tokens = completion->valueint;
+    }
+
+    cJSON_Delete(root);
+}
+
+/* Handle one complete "data:" payload: print the content delta and keep the usage, if any */
+void response_event(struct response *resp, const char *payload, size_t len)
+{
+    if (strcmp(payload, "[DONE]") == 0)
+    {
+        resp->done = true;
+        return;
+    }
+
+    resp->delta.len = 0;
+    if (resp->use_cjson)
+        response_event_cjson(resp, payload);
+    else
+    {
+        struct json_extract x;
+        json_extract_init(&x, &resp->delta, &resp->error);
+        if (!json_extract_feed(&x, payload, len) || x.state != JS_DONE)
+            return;
+        resp->frames++;
+        if (x.has_error)
+            resp->failed = true;
+        if (x.total_tokens >= 0)
+            resp->total_tokens = x.total_tokens;
+        if (x.prompt_tokens >= 0)
+            resp->prompt_tokens = x.prompt_tokens;
+        if (x.completion_tokens >= 0)
+            resp->completion_tokens = x.completion_tokens;
+    }
+
+    const char *text = resp->delta.ptr;
+    size_t text_len = resp->delta.len;
+    /* Same as the non-streamed path: drop up to two leading newlines of the reply */
+    while (resp->content.len == 0 && resp->skipped_newlines < 2 && text_len > 0 && text[0] == '\n')
+    {
+        text++;
+        text_len--;
+        resp->skipped_newlines++;
+    }
+    if (text_len > 0)
+    {
+        if (resp->echo && resp->sink != NULL)
+            resp->sink(resp, text, text_len);
+        else if (resp->echo)
+        {
+            fwrite(text, 1, text_len, stdout);
+            fflush(stdout);
+        }
+        append_string(&resp->content, text, text_len);
+    }
+}
+
+size_t response_consume(struct response *resp, char *ptr, size_t len)
+{
+    size_t start = 0, i;
+
+    if (!resp->stream)
+    {
+        if (resp->use_cjson)
+        {
+            /* Size the buffer once from Content-Length when the server sends it */
+            curl_off_t expected = -1;
+            if (resp->raw.len == 0 && curl_easy_getinfo(resp->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &expected) == CURLE_OK && expected > 0)
+                reserve_string(&resp->raw, (size_t)expected);
+            append_string(&resp->raw, ptr, len);
+            return len;
+        }
+        if (resp->raw.len < RESPONSE_RAW_KEEP)
+            append_string(&resp->raw, ptr, len);
+        json_extract_feed(&resp->json, ptr, len);
+        return len;
+    }
+
+    if (resp->frames == 0 && resp->raw.len < RESPONSE_RAW_KEEP)
+        append_string(&resp->raw, ptr, len);
+    append_string(&resp->pending, ptr, len);
+
+    for (i = 0; i < resp->pending.len; i++)
+    {
+        if (resp->pending.ptr[i] != '\n')
+            continue;
+        char *line = resp->pending.ptr + start;
+        size_t line_len = i - start;
+        resp->pending.ptr[i] = '\0';
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line[--line_len] = '\0';
+        if (strncmp(line, "data:", 5) == 0)
+        {
+            line += 5;
+            line_len -= 5;
+            if (line[0] == ' ')
             {
-                rl_replace_line("", 0);
-                rl_redisplay();
-                rl_insert_text(available_commands[i]);
+                line++;
+                line_len--;
+            }
+            response_event(resp, line, line_len);
+        }
+        start = i + 1;
+    }
+
+    /* Keep only the unterminated tail for the next call */
+    memmove(resp->pending.ptr, resp->pending.ptr + start, resp->pending.len - start + 1);
+    resp->pending.len -= start;
+
+    return len;
+}
+
+size_t response_write(void *ptr, size_t size, size_t nmemb, struct response *resp)
+{
+    double started = now_seconds();
+    size_t len = size * nmemb;
+
+    if (resp->first_byte_at == 0)
+        resp->first_byte_at = started;
+    if (resp->race != NULL && *resp->race != resp)
+    {
+        long http_code = 0;
+        curl_easy_getinfo(resp->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        /* Another copy of the request already answers: drop this one, its transfer gets cancelled */
+        if (*resp->race != NULL)
+            return len;
+        if (http_code < 300)
+            *resp->race = resp;
+    }
+    response_consume(resp, ptr, len);
+    resp->parse_time += now_seconds() - started;
+    return len;
+}
+
+/* Enforce the first byte and stall deadlines, which cURL has no option for */
+int response_progress(struct response *resp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+    double now = now_seconds();
+
+    if (dlnow != resp->progress_bytes)
+    {
+        resp->progress_bytes = dlnow;
+        resp->progress_at = now;
+        return 0;
+    }
+    if (dlnow == 0 && policy.first_byte_timeout > 0 && now - resp->started > policy.first_byte_timeout)
+        resp->timed_out = "no answer started in time";
+    else if (dlnow > 0 && policy.stall_timeout > 0 && now - resp->progress_at > policy.stall_timeout)
+        resp->timed_out = "the answer stalled";
+    return resp->timed_out != NULL ? 1 : 0;
+}
+
+/* Print why a response is unusable: the API error it streamed, or the body we could not use */
+void response_report(const struct response *resp)
+{
+    if (resp->failed)
+        fprintf(stderr, "%sAPI error: %s\n", resp->content.len > 0 ? "\n" : "", resp->failure);
+    else
+        fprintf(stderr, "%s API response:\n%s\n", resp->failure, resp->raw.ptr);
+}
+
+/* Record why a response is unusable, reporting it unless the caller collects errors itself */
+void response_error(struct response *resp, const char *message)
+{
+    resp->failure = message;
+    if (!resp->quiet)
+        response_report(resp);
+}
+
+/* Original, tree based parsing of a non-streamed body */
+char *response_parse_cjson(struct response *resp)
+{
+    size_t i;
+    cJSON *root = cJSON_Parse(resp->raw.ptr);
+    if (!root)
+    {
+        response_error(resp, "Error parsing result. Check your API key, network connection, account credits and model used.");
+        return NULL;
+    }
+    cJSON *choices = cJSON_GetObjectItemCaseSensitive(root, "choices");
+    if (!cJSON_IsArray(choices))
+    {
+        response_error(resp, "Error parsing result. Check your API key, network connection, account credits and model used.");
+        cJSON_Delete(root);
+        return NULL;
+    }
+    cJSON *choice = cJSON_GetArrayItem(choices, 0);
+    if (!cJSON_IsObject(choice))
+    {
+        response_error(resp, "Error parsing result. Check your API key, network connection, account credits and model used.");
+        cJSON_Delete(root);
+        return NULL;
+    }
+    cJSON *message = cJSON_GetObjectItemCaseSensitive(choice, "message");
+    if (!cJSON_IsObject(message))
+    {
+        response_error(resp, "Error parsing result. Check your API key, network connection, account credits and model used.");
+        cJSON_Delete(root);
+        return NULL;
+    }
+    cJSON *content = cJSON_GetObjectItemCaseSensitive(message, "content");
+    if (!cJSON_IsString(content))
+    {
+        response_error(resp, "Error parsing result. Check your API key, network connection, account credits and model used.");
+        cJSON_Delete(root);
+        return NULL;
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        if (content->valuestring[0] == '\n')
+            content->valuestring++;
+        else
+            break;
+    }
+
+    char *curl_result = arena_strdup(resp->arena, content->valuestring);
+
+    for (; i > 0; i--)
+        content->valuestring--;
+
+    cJSON *usage = cJSON_GetObjectItemCaseSensitive(root, "usage");
+    if (!cJSON_IsObject(usage))
+    {
+        response_error(resp, "Error parsing result. Token usage is not available, but should be.");
+        cJSON_Delete(root);
+        return NULL;
+    }
+
+    cJSON *totalusage = cJSON_GetObjectItemCaseSensitive(usage, "total_tokens");
+    if (!cJSON_IsNumber(totalusage))
+    {
+        response_error(resp, "Error parsing result. Total tokens aren't available, but they should.");
+        cJSON_Delete(root);
+        return NULL;
+    }
+    resp->total_tokens = totalusage->valueint;
+
+    cJSON *prompt = cJSON_GetObjectItemCaseSensitive(usage, "prompt_tokens");
+    cJSON *completion = cJSON_GetObjectItemCaseSensitive(usage, "completion_tokens");
+    if (cJSON_IsNumber(prompt))
+        resp->prompt_tokens = prompt->valueint;
+    if (cJSON_IsNumber(completion))
+        resp->completion_tokens = completion->valueint;
+
+    cJSON_Delete(root);
+
+    return curl_result;
+}
+
+/* Validate a finished transfer and return the reply (in the turn arena), or NULL after reporting why not */
+char *response_result(struct response *resp, long http_code)
+{
+    if (resp->stream)
+    {
+        if (resp->failed)
+        {
+            resp->failure = resp->error.len > 0 ? resp->error.ptr : resp->raw.ptr;
+            if (!resp->quiet)
+                response_report(resp);
+            return NULL;
+        }
+        if (resp->frames == 0 || http_code >= 400)
+        {
+            response_error(resp, "Error parsing result. Check your API key, network connection, account credits and model used.");
+            return NULL;
+        }
+        if (resp->echo && resp->sink != NULL)
+            resp->sink(resp, "\n", 1);
+        else if (resp->echo)
+            printf("\n");
+        if (resp->total_tokens >= 0)
+            tokens += resp->total_tokens;
+        return resp->content.ptr;
+    }
+
+    if (resp->use_cjson)
+    {
+        char *result = response_parse_cjson(resp);
+        if (result != NULL)
+            tokens += resp->total_tokens;
+        return result;
+    }
+
+    if (resp->json.state != JS_DONE || resp->json.has_error || !resp->json.has_content)
+    {
+        response_error(resp, "Error parsing result. Check your API key, network connection, account credits and model used.");
+        return NULL;
+    }
+    if (resp->json.total_tokens < 0)
+    {
+        response_error(resp, "Error parsing result. Total tokens aren't available, but they should.");
+        return NULL;
+    }
+    resp->total_tokens = resp->json.total_tokens;
+    resp->prompt_tokens = resp->json.prompt_tokens;
+    resp->completion_tokens = resp->json.completion_tokens;
+    tokens += resp->total_tokens;
+
+    char *result = resp->content.ptr;
+    unsigned short i;
+    for (i = 0; i < 2 && result[0] == '\n'; i++)
+        result++;
+    return result;
+}
+
+/* Reply text of a finished transfer, or NULL (with `failure` set) if it failed */
+char *response_finish(struct response *resp, long http_code)
+{
+    double started = now_seconds();
+    char *result = response_result(resp, http_code);
+    resp->parse_time += now_seconds() - started;
+    return result;
+}
+
+unsigned short contains_str_before_space(const char *full_str, const char *coincidence, char **remaining_data)
+{
+    const char *space = strchr(full_str, ' ');
+    const char *found_coinc = strstr(full_str, coincidence);
+
+    if (found_coinc == NULL || (space != NULL && found_coinc + strlen(coincidence) != space))
+    {
+        return 0;
+    }
+
+    if (found_coinc < space)
+    {
+        if (remaining_data != NULL)
+        {
+            *remaining_data = space ? (char *)(space + 1) : NULL;
+        }
+        return 1;
+    }
+
+    if (space == NULL)
+    {
+        if (strcmp(full_str, coincidence) == 0)
+            return 1;
+        return 0;
+    }
+
+    return 0;
+}
+
+/*
+    Byte pair encoding tokenizer, used to know the size of a request before sending it. The
+    vocabulary is a cl100k_base-style ".tiktoken" file (one base64 token and its rank per line),
+    loaded on first use. Without it, sizes are approximated from the byte count.
+*/
+#define TOKENIZER_SLOTS (1 << 18)
+#define TOKENIZER_MAX_PIECE 1024
+#define TOKENS_UNKNOWN ((size_t)-1)
+#define TOKENS_PER_MESSAGE 4 /* Chat format overhead of every message, role included */
+#define TOKENS_REPLY_PRIMING 3
+#define RANK_NONE 0xFFFFFFFFU
+
+struct token_slot
+{
+    uint32_t offset;
+    uint32_t len; /* 0 marks an empty slot */
+    uint32_t rank;
+};
+
+struct tokenizer
+{
+    char *path;
+    bool tried;
+    char *bytes; /* Every token, decoded, back to back */
+    struct token_slot *slots;
+    size_t count;
+    size_t *starts; /* Merge scratch, TOKENIZER_MAX_PIECE + 1 entries each */
+    uint32_t *ranks;
+};
+
+struct tokenizer tokenizer = { NULL, false, NULL, NULL, 0, NULL, NULL };
+
+enum char_class
+{
+    CC_END,
+    CC_LETTER,
+    CC_NUMBER,
+    CC_SPACE,
+    CC_NEWLINE,
+    CC_OTHER
+};
+
+uint32_t token_hash(const char *data, size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)data[i]) * 16777619U;
+    return h;
+}
+
+uint32_t token_rank(const char *data, size_t len)
+{
+    size_t i = token_hash(data, len) & (TOKENIZER_SLOTS - 1);
+
+    while (tokenizer.slots[i].len != 0)
+    {
+        if (tokenizer.slots[i].len == len && memcmp(tokenizer.bytes + tokenizer.slots[i].offset, data, len) == 0)
+            return tokenizer.slots[i].rank;
+        i = (i + 1) & (TOKENIZER_SLOTS - 1);
+    }
+    return RANK_NONE;
+}
+
+int base64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+/* Decode `len` base64 characters into `dst`; returns the decoded length, or -1 if malformed */
+long base64_decode(char *dst, const char *src, size_t len)
+{
+    unsigned long bits = 0;
+    int nbits = 0;
+    long out = 0;
+    size_t i;
+
+    for (i = 0; i < len && src[i] != '='; i++)
+    {
+        int v = base64_value(src[i]);
+        if (v < 0)
+            return -1;
+        bits = (bits << 6) | v;
+        nbits += 6;
+        if (nbits >= 8)
+        {
+            nbits -= 8;
+            dst[out++] = (char)((bits >> nbits) & 0xFF);
+        }
+    }
+    return out;
+}
+
+/* Load the vocabulary once; returns 0 when exact counting is available */
+/* Drop a partly loaded vocabulary */
+void tokenizer_free(void)
+{
+    free(tokenizer.bytes);
+    free(tokenizer.slots);
+    free(tokenizer.starts);
+    free(tokenizer.ranks);
+    tokenizer.bytes = NULL;
+    tokenizer.slots = NULL;
+    tokenizer.starts = NULL;
+    tokenizer.ranks = NULL;
+    tokenizer.count = 0;
+}
+
+int tokenizer_load(void)
+{
+    if (tokenizer.tried)
+        return tokenizer.slots != NULL ? 0 : -1;
+    tokenizer.tried = true;
+    if (tokenizer.path == NULL)
+        return -1;
+
+    int fd = open(tokenizer.path, O_RDONLY);
+    struct stat st;
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() failed\n");
+        return -1;
+    }
+
+    tokenizer.bytes = malloc(st.st_size);
+    tokenizer.slots = calloc(TOKENIZER_SLOTS, sizeof(struct token_slot));
+    tokenizer.starts = malloc((TOKENIZER_MAX_PIECE + 1) * sizeof(size_t));
+    tokenizer.ranks = malloc((TOKENIZER_MAX_PIECE + 1) * sizeof(uint32_t));
+    if (tokenizer.bytes == NULL || tokenizer.slots == NULL || tokenizer.starts == NULL || tokenizer.ranks == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        munmap(map, st.st_size);
+        tokenizer_free();
+        return -1;
+    }
+
+    const char *p = map, *end = map + st.st_size;
+    size_t used = 0;
+    while (p < end)
+    {
+        const char *eol = memchr(p, '\n', end - p), *space;
+        uint32_t rank = 0;
+        long len;
+        if (eol == NULL)
+            eol = end;
+        space = memchr(p, ' ', eol - p);
+        if (space == NULL || space + 1 >= eol || tokenizer.count >= TOKENIZER_SLOTS / 2 ||
+            (len = base64_decode(tokenizer.bytes + used, p, space - p)) <= 0)
+        {
+            if (eol == p || (eol == p + 1 && *p == '\r'))
+            {
+                p = eol + 1;
+                continue;
+            }
+            fprintf(stderr, "Invalid tokenizer vocabulary '%s'. Token counts will be approximated.\n", tokenizer.path);
+            munmap(map, st.st_size);
+            tokenizer_free();
+            return -1;
+        }
+        for (space++; space < eol && *space >= '0' && *space <= '9'; space++)
+            rank = rank * 10 + (*space - '0');
+
+        size_t i = token_hash(tokenizer.bytes + used, len) & (TOKENIZER_SLOTS - 1);
+        while (tokenizer.slots[i].len != 0)
+            i = (i + 1) & (TOKENIZER_SLOTS - 1);
+        tokenizer.slots[i].offset = used;
+        tokenizer.slots[i].len = len;
+        tokenizer.slots[i].rank = rank;
+        tokenizer.count++;
+        used += len;
+        p = eol + 1;
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
+
+bool tokenizer_exact(void)
+{
+    return tokenizer_load() == 0 ? true : false;
+}
+
+/* Class of the UTF-8 character at `pos`, as seen by the pre-tokenizer; `*size` receives its length */
+enum char_class char_class_at(const unsigned char *s, size_t len, size_t pos, size_t *size)
+{
+    unsigned int c;
+    size_t n, i;
+
+    *size = 1;
+    if (pos >= len)
+        return CC_END;
+    c = s[pos];
+    if (c < 0x80)
+    {
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+            return CC_LETTER;
+        if (c >= '0' && c <= '9')
+            return CC_NUMBER;
+        if (c == '\r' || c == '\n')
+            return CC_NEWLINE;
+        if (c == ' ' || c == '\t' || c == '\v' || c == '\f')
+            return CC_SPACE;
+        return CC_OTHER;
+    }
+
+    n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    if (n == 1 || pos + n > len)
+        return CC_OTHER;
+    c &= 0x3F >> (n - 1);
+    for (i = 1; i < n; i++)
+    {
+        if ((s[pos + i] & 0xC0) != 0x80)
+            return CC_OTHER;
+        c = (c << 6) | (s[pos + i] & 0x3F);
+    }
+    *size = n;
+
+    if (c == 0x85 || c == 0xA0 || c == 0x1680 || (c >= 0x2000 && c <= 0x200A) || c == 0x2028 || c == 0x2029 ||
+        c == 0x202F || c == 0x205F || c == 0x3000)
+        return CC_SPACE;
+    /* Latin-1 symbols, general punctuation, arrows, math and box drawing, CJK punctuation, emoji */
+    if ((c < 0xC0 && c != 0xAA && c != 0xB5 && c != 0xBA) || c == 0xD7 || c == 0xF7 || (c >= 0x2000 && c <= 0x2BFF) ||
+        (c >= 0x3000 && c <= 0x303F) || (c >= 0xE000 && c <= 0xF8FF) || (c >= 0xFF00 && c <= 0xFF0F) ||
+        (c >= 0xFFF0 && c <= 0xFFFF) || (c >= 0x1F000 && c < 0x20000))
+        return CC_OTHER;
+    return CC_LETTER;
+}
+
+/*
+    Length of the piece starting at `s`, following the cl100k split pattern:
+    's|'t|'re|'ve|'m|'ll|'d | [^\r\n\p{L}\p{N}]?\p{L}+ | \p{N}{1,3} | ?[^\s\p{L}\p{N}]+[\r\n]* |
+    \s*[\r\n]+ | \s+(?!\S) | \s+
+*/
+size_t token_piece(const unsigned char *s, size_t len)
+{
+    size_t n, m, i, last = 0, newline_end = 0;
+    enum char_class cls = char_class_at(s, len, 0, &n);
+
+    if (s[0] == '\'' && len >= 2)
+    {
+        char a = s[1] | 0x20, b = len >= 3 ? s[2] | 0x20 : 0;
+        if ((a == 'r' && b == 'e') || (a == 'v' && b == 'e') || (a == 'l' && b == 'l'))
+            return 3;
+        if (a == 's' || a == 't' || a == 'm' || a == 'd')
+            return 2;
+    }
+
+    if (cls == CC_LETTER || ((cls == CC_SPACE || cls == CC_OTHER) && char_class_at(s, len, n, &m) == CC_LETTER))
+    {
+        for (i = n; char_class_at(s, len, i, &m) == CC_LETTER; i += m)
+            ;
+        return i;
+    }
+
+    if (cls == CC_NUMBER)
+    {
+        for (i = 1; i < 3 && char_class_at(s, len, i, &m) == CC_NUMBER; i++)
+            ;
+        return i;
+    }
+
+    i = s[0] == ' ' && char_class_at(s, len, 1, &m) == CC_OTHER ? 1 : 0;
+    if (char_class_at(s, len, i, &m) == CC_OTHER)
+    {
+        while (char_class_at(s, len, i, &m) == CC_OTHER)
+            i += m;
+        while (i < len && (s[i] == '\r' || s[i] == '\n'))
+            i++;
+        return i;
+    }
+
+    for (i = 0; (cls = char_class_at(s, len, i, &m)) == CC_SPACE || cls == CC_NEWLINE; i += m)
+    {
+        last = i;
+        if (cls == CC_NEWLINE)
+            newline_end = i + m;
+    }
+    if (newline_end > 0)
+        return newline_end;
+    if (i < len && last > 0)
+        return last;
+    return i > 0 ? i : n;
+}
+
+/* Tokens of one piece, merging the lowest ranked adjacent pair until none is in the vocabulary */
+size_t token_merge(const char *piece, size_t len)
+{
+    size_t *starts = tokenizer.starts, n = len + 1, i, best;
+    uint32_t *ranks = tokenizer.ranks, min;
+
+    if (len <= 1 || token_rank(piece, len) != RANK_NONE)
+        return 1;
+
+    for (i = 0; i <= len; i++)
+        starts[i] = i;
+    for (i = 0; i + 1 < len; i++)
+        ranks[i] = token_rank(piece + i, 2);
+
+    while (n > 2)
+    {
+        min = RANK_NONE;
+        best = 0;
+        for (i = 0; i + 2 < n; i++)
+        {
+            if (ranks[i] < min)
+            {
+                min = ranks[i];
+                best = i;
+            }
+        }
+        if (min == RANK_NONE)
+            break;
+
+        memmove(starts + best + 1, starts + best + 2, (n - best - 2) * sizeof(size_t));
+        memmove(ranks + best + 1, ranks + best + 2, (n > best + 4 ? n - best - 4 : 0) * sizeof(uint32_t));
+        n--;
+        ranks[best] = best + 2 < n ? token_rank(piece + starts[best], starts[best + 2] - starts[best]) : RANK_NONE;
+        if (best > 0)
+            ranks[best - 1] = token_rank(piece + starts[best - 1], starts[best + 1] - starts[best - 1]);
+    }
+    return n - 1;
+}
+
+/* Number of tokens of `text`, exact with a vocabulary loaded and approximated otherwise */
+size_t count_tokens(const char *text, size_t len)
+{
+    size_t pos = 0, count = 0;
+
+    if (tokenizer_load() != 0)
+        return (len + 3) / 4;
+
+    while (pos < len)
+    {
+        size_t piece = token_piece((const unsigned char *)text + pos, len - pos), done;
+        /* Pathologically long pieces (minified data, long runs of one symbol) are merged in chunks */
+        for (done = 0; done < piece; done += TOKENIZER_MAX_PIECE)
+            count += token_merge(text + pos + done, piece - done < TOKENIZER_MAX_PIECE ? piece - done : TOKENIZER_MAX_PIECE);
+        pos += piece;
+    }
+    return count;
+}
+
+struct model_limit
+{
+    const char *name;
+    size_t tokens;
+};
+
+/* Context window of known models, matching the name alone or followed by a date ("-0613", "-2024-08-06") */
+const struct model_limit model_limits[] = {
+    { "gpt-5", 400000 },
+    { "gpt-5-mini", 400000 },
+    { "gpt-5-nano", 400000 },
+    { "gpt-5-chat-latest", 128000 },
+    { "gpt-4.1", 1047576 },
+    { "gpt-4.1-mini", 1047576 },
+    { "gpt-4.1-nano", 1047576 },
+    { "gpt-4.5-preview", 128000 },
+    { "o1", 200000 },
+    { "o1-pro", 200000 },
+    { "o1-mini", 128000 },
+    { "o1-preview", 128000 },
+    { "o3", 200000 },
+    { "o3-pro", 200000 },
+    { "o3-mini", 200000 },
+    { "o4-mini", 200000 },
+    { "gpt-4o", 128000 },
+    { "gpt-4o-mini", 128000 },
+    { "chatgpt-4o-latest", 128000 },
+    { "gpt-4-turbo", 128000 },
+    { "gpt-4-turbo-preview", 128000 },
+    { "gpt-4-1106-preview", 128000 },
+    { "gpt-4-0125-preview", 128000 },
+    { "gpt-4-vision-preview", 128000 },
+    { "gpt-4-32k", 32768 },
+    { "gpt-4", 8192 },
+    { "gpt-3.5-turbo-instruct", 4096 },
+    { "gpt-3.5-turbo-0301", 4096 },
+    { "gpt-3.5-turbo-0613", 4096 },
+    { "gpt-3.5-turbo-16k", 16385 },
+    { "gpt-3.5-turbo", 16385 },
+    { NULL, 0 }
+};
+
+/* Context window of `model` in tokens, or 0 if unknown */
+size_t model_context_limit(const char *model)
+{
+    size_t i;
+
+    for (i = 0; model_limits[i].name != NULL; i++)
+    {
+        size_t len = strlen(model_limits[i].name);
+        /* A longer name is another model ("gpt-4" is not "gpt-4.1" nor "gpt-4o"), unless it only adds a date */
+        if (strncmp(model, model_limits[i].name, len) == 0 &&
+            (model[len] == '\0' || (model[len] == '-' && model[len + 1] >= '0' && model[len + 1] <= '9')))
+            return model_limits[i].tokens;
+    }
+    return 0;
+}
+
+/* 128-bit streaming hash (two multiplicative lanes, splitmix64 finalized), used as content address */
+struct hasher
+{
+    uint64_t a;
+    uint64_t b;
+    uint64_t length;
+};
+
+void hasher_init(struct hasher *h)
+{
+    h->a = 0xcbf29ce484222325ULL;
+    h->b = 0x9ae16a3b2f90404fULL;
+    h->length = 0;
+}
+
+void hasher_update(struct hasher *h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t a = h->a, b = h->b;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        a = (a ^ p[i]) * 0x100000001b3ULL;
+        b = (b ^ p[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+    h->a = a;
+    h->b = b;
+    h->length += len;
+}
+
+/* Hash a field with its length in front, so that ("ab", "c") and ("a", "bc") differ */
+void hasher_field(struct hasher *h, const char *data, size_t len)
+{
+    uint64_t n = len;
+    hasher_update(h, &n, sizeof(n));
+    hasher_update(h, data, len);
+}
+
+uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+void hasher_final(const struct hasher *h, uint64_t out[2])
+{
+    out[0] = mix64(h->a ^ h->length);
+    out[1] = mix64(h->b + out[0]);
+}
+
+/*
+    File attachment: the file is mapped and its content sent from the mapping (escaped while the
+    request body is read), so it is never copied to the heap. Sessions keep its path and hash.
+*/
+struct attachment
+{
+    char *path;   /* Absolute */
+    char *header; /* Sent before the content */
+    char *map;
+    size_t size;
+    uint64_t hash[2];
+};
+
+void attachment_free(struct attachment *a)
+{
+    munmap(a->map, a->size);
+    free(a->path);
+    free(a->header);
+    free(a);
+}
+
+/* Map the file at `path`; NULL (with the reason printed) if it cannot be attached */
+struct attachment *attachment_map(const char *path)
+{
+    struct attachment *a;
+    struct hasher h;
+    struct stat st;
+    char *full = realpath(path, NULL), *map;
+    int fd;
+
+    if (full == NULL || (fd = open(full, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "Error: cannot open '%s'.\n", path);
+        free(full);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    {
+        fprintf(stderr, "Error: '%s' is not a file, or it is empty.\n", path);
+        close(fd);
+        free(full);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() failed\n");
+        free(full);
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (memchr(map, '\0', st.st_size) != NULL)
+    {
+        fprintf(stderr, "Error: '%s' is a binary file, only text files can be attached.\n", path);
+        munmap(map, st.st_size);
+        free(full);
+        return NULL;
+    }
+
+    a = malloc(sizeof(struct attachment));
+    if (a == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+    a->path = full;
+    a->map = map;
+    a->size = st.st_size;
+    a->header = malloc(strlen(full) + 32);
+    sprintf(a->header, "Attached file %s:\n\n", full);
+    hasher_init(&h);
+    hasher_update(&h, map, st.st_size);
+    hasher_final(&h, a->hash);
+    return a;
+}
+
+enum message_role
+{
+    ROLE_SYSTEM,
+    ROLE_USER,
+    ROLE_ASSISTANT
+};
+
+const char *role_names[] = { "system", "user", "assistant" };
+
+#define LENGTH_UNKNOWN ((size_t)-1)
+
+/*
+    One chat message; `content` is kept unescaped and owned by the conversation, unless `mapped`,
+    where it points into a loaded session file (or an attached file) and is not NUL-terminated
+*/
+struct message
+{
+    enum message_role role;
+    char *content;
+    size_t len;
+    size_t escaped_len; /* Length of `content` once JSON-escaped, LENGTH_UNKNOWN until needed */
+    size_t tokens;      /* Counted on first need, TOKENS_UNKNOWN until then */
+    bool pinned;        /* Always sent, whatever the context window */
+    bool mapped;
+    struct attachment *attachment; /* The file `content` is mapped from, owned by the message */
+};
+
+/*
+    Append-only message store. Rolling back a failed turn is a truncation to a saved count.
+    Requests carry the system prompt, the pinned messages and every message from `window` on.
+*/
+struct conversation
+{
+    struct message *messages;
+    size_t count;
+    size_t capacity;
+    char *system;
+    size_t system_tokens;
+    size_t window;
+    char *map; /* Session file the mapped messages live in */
+    size_t map_size;
+    unsigned long generation; /* Changed whenever messages are dropped or replaced */
+};
+
+void conversation_init(struct conversation *conv)
+{
+    conv->messages = NULL;
+    conv->count = 0;
+    conv->capacity = 0;
+    conv->system = NULL;
+    conv->system_tokens = TOKENS_UNKNOWN;
+    conv->window = 0;
+    conv->map = NULL;
+    conv->map_size = 0;
+    conv->generation = 0;
+}
+
+/* Add a message record pointing at `content`, which the caller hands over */
+int conversation_push(struct conversation *conv, enum message_role role, char *content, size_t len, bool mapped)
+{
+    if (conv->count == conv->capacity)
+    {
+        size_t new_capacity = conv->capacity ? conv->capacity * 2 : 16;
+        struct message *messages = realloc(conv->messages, new_capacity * sizeof(struct message));
+        if (messages == NULL)
+        {
+            fprintf(stderr, "realloc() failed\n");
+            return -1;
+        }
+        conv->messages = messages;
+        conv->capacity = new_capacity;
+    }
+
+    conv->messages[conv->count].role = role;
+    conv->messages[conv->count].content = content;
+    conv->messages[conv->count].len = len;
+    conv->messages[conv->count].escaped_len = LENGTH_UNKNOWN;
+    conv->messages[conv->count].tokens = TOKENS_UNKNOWN;
+    conv->messages[conv->count].pinned = false;
+    conv->messages[conv->count].mapped = mapped;
+    conv->messages[conv->count].attachment = NULL;
+    conv->count++;
+    return 0;
+}
+
+int conversation_append(struct conversation *conv, enum message_role role, const char *content, size_t len)
+{
+    char *copy = malloc(len + 1);
+    if (copy == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        return -1;
+    }
+    memcpy(copy, content, len);
+    copy[len] = '\0';
+
+    if (conversation_push(conv, role, copy, len, false) != 0)
+    {
+        free(copy);
+        return -1;
+    }
+    conv->messages[conv->count - 1].escaped_len = escaped_length(content, len);
+    return 0;
+}
+
+/* Add the file of `a` as a user message, which takes it over */
+int conversation_attach(struct conversation *conv, struct attachment *a)
+{
+    if (conversation_push(conv, ROLE_USER, a->map, a->size, true) != 0)
+    {
+        attachment_free(a);
+        return -1;
+    }
+    conv->messages[conv->count - 1].attachment = a;
+    return 0;
+}
+
+/* Attach every file of `paths` to `conv`; -1 if one of them cannot be */
+int conversation_attach_files(struct conversation *conv, char **paths, size_t count)
+{
+    struct attachment *a;
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if ((a = attachment_map(paths[i])) == NULL || conversation_attach(conv, a) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+size_t message_escaped_len(struct conversation *conv, size_t i)
+{
+    struct message *msg = &conv->messages[i];
+
+    if (msg->escaped_len == LENGTH_UNKNOWN)
+        msg->escaped_len = escaped_length(msg->content, msg->len);
+    return msg->escaped_len;
+}
+
+/* Drop every message after the first `count` ones */
+void conversation_truncate(struct conversation *conv, size_t count)
+{
+    if (conv->count > count)
+        conv->generation++;
+    while (conv->count > count)
+    {
+        conv->count--;
+        if (conv->messages[conv->count].attachment != NULL)
+            attachment_free(conv->messages[conv->count].attachment);
+        else if (!conv->messages[conv->count].mapped)
+            free(conv->messages[conv->count].content);
+    }
+    if (conv->window > conv->count)
+        conv->window = conv->count;
+}
+
+void conversation_set_system(struct conversation *conv, const char *system)
+{
+    free(conv->system);
+    conv->system = system != NULL ? strdup(system) : NULL;
+    conv->system_tokens = TOKENS_UNKNOWN;
+}
+
+bool message_in_window(const struct conversation *conv, size_t i)
+{
+    return (i >= conv->window || conv->messages[i].pinned) ? true : false;
+}
+
+/* Tokens message `i` takes in a request; every message is tokenized only once */
+size_t message_tokens(struct conversation *conv, size_t i)
+{
+    struct message *msg = &conv->messages[i];
+
+    if (msg->tokens == TOKENS_UNKNOWN)
+    {
+        msg->tokens = count_tokens(msg->content, msg->len);
+        if (msg->attachment != NULL)
+            msg->tokens += count_tokens(msg->attachment->header, strlen(msg->attachment->header));
+    }
+    return msg->tokens + TOKENS_PER_MESSAGE;
+}
+
+size_t system_tokens(struct conversation *conv)
+{
+    if (conv->system == NULL)
+        return 0;
+    if (conv->system_tokens == TOKENS_UNKNOWN)
+        conv->system_tokens = count_tokens(conv->system, strlen(conv->system));
+    return conv->system_tokens + TOKENS_PER_MESSAGE;
+}
+
+/* Tokens the request for `conv` will take */
+size_t conversation_tokens(struct conversation *conv)
+{
+    size_t total = TOKENS_REPLY_PRIMING + system_tokens(conv), i;
+
+    for (i = 0; i < conv->count; i++)
+    {
+        if (message_in_window(conv, i))
+            total += message_tokens(conv, i);
+    }
+    return total;
+}
+
+/* History budget for `model`: its context window minus room for the reply, or 0 if unknown */
+size_t context_budget(const char *model)
+{
+    size_t limit = model_context_limit(model);
+
+    return limit - (limit / 4 < 4096 ? limit / 4 : 4096);
+}
+
+/*
+    Slide the window so the request fits in `budget` tokens, leaving the oldest turns out. The
+    system prompt, pinned messages and the newest message are always sent. 0 sends everything.
+*/
+void conversation_fit(struct conversation *conv, size_t budget)
+{
+    size_t used = TOKENS_REPLY_PRIMING + system_tokens(conv), i;
+
+    conv->window = 0;
+    if (budget == 0 || conv->count == 0)
+        return;
+
+    for (i = 0; i < conv->count; i++)
+    {
+        if (conv->messages[i].pinned)
+            used += message_tokens(conv, i);
+    }
+    for (i = conv->count; i > 0; i--)
+    {
+        if (conv->messages[i - 1].pinned)
+            continue;
+        if (used + message_tokens(conv, i - 1) > budget && i < conv->count)
+            break;
+        used += message_tokens(conv, i - 1);
+    }
+
+    /* Start on a user message, so no turn is sent without its question */
+    while (i + 1 < conv->count && conv->messages[i].role != ROLE_USER)
+        i++;
+    conv->window = i;
+}
+
+/* List what the next request carries: `*` marks pinned messages, `-` the ones left out */
+void conversation_print_context(struct conversation *conv, const char *model, size_t budget)
+{
+    size_t i, sent = 0, pinned = 0;
+
+    for (i = 0; i < conv->count; i++)
+    {
+        sent += message_in_window(conv, i) ? 1 : 0;
+        pinned += conv->messages[i].pinned ? 1 : 0;
+    }
+    printf("-- Context: %lu of %lu messages sent, %lu pinned, %s%lu tokens", (unsigned long)sent, (unsigned long)conv->count,
+           (unsigned long)pinned, tokenizer_exact() ? "" : "~", (unsigned long)conversation_tokens(conv));
+    if (budget != 0)
+        printf(" (budget %lu for %s)", (unsigned long)budget, model);
+    printf(" --\n");
+
+    if (conv->system != NULL)
+        printf("     S %7lu  system     %.60s\n", (unsigned long)system_tokens(conv), conv->system);
+    for (i = 0; i < conv->count; i++)
+    {
+        struct message *msg = &conv->messages[i];
+        char preview[64];
+        size_t n = msg->len < 60 ? msg->len : 60, j;
+        if (msg->attachment != NULL)
+        {
+            printf("%c %4lu %7lu  %-9s  [file %s, %.1f KB]\n", msg->pinned ? '*' : message_in_window(conv, i) ? ' ' : '-', (unsigned long)i + 1,
+                   (unsigned long)message_tokens(conv, i), role_names[msg->role], msg->attachment->path, msg->len / 1024.0);
+            continue;
+        }
+        /* Do not cut a UTF-8 sequence in half */
+        while (n < msg->len && n > 0 && (msg->content[n] & 0xC0) == 0x80)
+            n--;
+        for (j = 0; j < n; j++)
+            preview[j] = (msg->content[j] == '\n' || msg->content[j] == '\r' || msg->content[j] == '\t') ? ' ' : msg->content[j];
+        preview[n] = '\0';
+        printf("%c %4lu %7lu  %-9s  %s%s\n", msg->pinned ? '*' : message_in_window(conv, i) ? ' ' : '-', (unsigned long)i + 1,
+               (unsigned long)message_tokens(conv, i), role_names[msg->role], preview, n < msg->len ? "..." : "");
+    }
+}
+
+/* Returns -1 if the request for `conv` surely overflows the context of `model`, warning if it may */
+int context_check(struct conversation *conv, const char *model, bool warn)
+{
+    size_t used = conversation_tokens(conv), limit = model_context_limit(model);
+
+    if (limit == 0 || used * 10 < limit * 9)
+        return 0;
+    if (used >= limit && tokenizer_exact())
+    {
+        if (warn)
+            fprintf(stderr, "Error: the request takes %lu tokens, more than the %lu token context of %s.\n",
+                    (unsigned long)used, (unsigned long)limit, model);
+        return -1;
+    }
+    if (warn)
+        fprintf(stderr, "Warning: the request takes %s%lu of the %lu tokens of context of %s.\n",
+                tokenizer_exact() ? "" : "about ", (unsigned long)used, (unsigned long)limit, model);
+    return 0;
+}
+
+void conversation_clear(struct conversation *conv)
+{
+    conversation_truncate(conv, 0);
+    conversation_set_system(conv, NULL);
+    conv->generation++;
+    if (conv->map != NULL)
+        munmap(conv->map, conv->map_size);
+    conv->map = NULL;
+    conv->map_size = 0;
+}
+
+/*
+    Request body described as a list of pieces pointing at the message records, streamed to
+    cURL by request_body_read(). Pieces marked `escape` are JSON-escaped while being copied,
+    so the serialized body never exists as a whole in memory.
+*/
+struct body_segment
+{
+    const char *data;
+    size_t len;
+    bool escape;
+};
+
+struct request_body
+{
+    struct arena *arena;
+    struct body_segment *segments;
+    size_t count;
+    size_t capacity;
+    size_t length;  /* Exact serialized size, sent as Content-Length */
+    size_t segment; /* Read position: current piece... */
+    size_t offset;  /* ...and source bytes already consumed from it */
+    char *packed;   /* The serialization compressed with gzip, sent instead if not NULL */
+    size_t packed_len;
+    const char *model;
+};
+
+void body_push(struct request_body *body, const char *data, size_t len, size_t serialized_len, bool escape)
+{
+    if (body->count == body->capacity)
+    {
+        size_t new_capacity = body->capacity ? body->capacity * 2 : 32;
+        body->segments = arena_realloc(body->arena, body->segments, body->capacity * sizeof(struct body_segment),
+                                       new_capacity * sizeof(struct body_segment));
+        body->capacity = new_capacity;
+    }
+    body->segments[body->count].data = data;
+    body->segments[body->count].len = len;
+    body->segments[body->count].escape = escape;
+    body->count++;
+    body->length += serialized_len;
+}
+
+void body_literal(struct request_body *body, const char *str)
+{
+    body_push(body, str, strlen(str), strlen(str), false);
+}
+
+void body_escaped(struct request_body *body, const char *str, size_t len, size_t escaped_len)
+{
+    body_push(body, str, len, escaped_len, true);
+}
+
+void body_message(struct request_body *body, enum message_role role, const char *prefix, const char *content, size_t len,
+                  size_t escaped_len, bool first)
+{
+    body_literal(body, first ? "{\"role\": \"" : ",{\"role\": \"");
+    body_literal(body, role_names[role]);
+    body_literal(body, "\", \"content\": \"");
+    if (prefix != NULL)
+        body_escaped(body, prefix, strlen(prefix), escaped_length(prefix, strlen(prefix)));
+    body_escaped(body, content, len, escaped_len);
+    body_literal(body, "\"}");
+}
+
+/* Describe the chat completion request for `conv`; pieces and scratch live in `arena` */
+void build_request(struct request_body *body, struct arena *arena, const char *model, float temperature, struct conversation *conv, bool stream)
+{
+    size_t i;
+    bool first = conv->system == NULL ? true : false;
+    char *f_temp = arena_alloc(arena, 32);
+
+    body->arena = arena;
+    body->model = model;
+    body->segments = NULL;
+    body->count = 0;
+    body->capacity = 0;
+    body->length = 0;
+    body->segment = 0;
+    body->offset = 0;
+    body->packed = NULL;
+    body->packed_len = 0;
+
+    snprintf(f_temp, 32, "%.1f", temperature);
+    body_literal(body, "{\"model\": \"");
+    body_escaped(body, model, strlen(model), escaped_length(model, strlen(model)));
+    body_literal(body, "\", \"temperature\": ");
+    body_literal(body, f_temp);
+    body_literal(body, ", \"messages\": [");
+    if (conv->system != NULL)
+        body_message(body, ROLE_SYSTEM, NULL, conv->system, strlen(conv->system), escaped_length(conv->system, strlen(conv->system)), true);
+    for (i = 0; i < conv->count; i++)
+    {
+        if (!message_in_window(conv, i))
+            continue;
+        body_message(body, conv->messages[i].role, conv->messages[i].attachment != NULL ? conv->messages[i].attachment->header : NULL,
+                     conv->messages[i].content, conv->messages[i].len, message_escaped_len(conv, i), first);
+        first = false;
+    }
+    body_literal(body, "]");
+    if (stream)
+        body_literal(body, ", \"stream\": true, \"stream_options\": {\"include_usage\": true}");
+    body_literal(body, "}");
+}
+
+size_t request_body_read(char *buffer, size_t size, size_t nitems, struct request_body *body)
+{
+    size_t room = size * nitems, written = 0;
+
+    if (body->packed != NULL)
+    {
+        written = body->packed_len - body->offset < room ? body->packed_len - body->offset : room;
+        memcpy(buffer, body->packed + body->offset, written);
+        body->offset += written;
+        return written;
+    }
+    while (body->segment < body->count && written < room)
+    {
+        struct body_segment *seg = &body->segments[body->segment];
+        size_t consumed;
+
+        if (seg->escape)
+            written += json_escape(buffer + written, room - written, seg->data + body->offset, seg->len - body->offset, &consumed);
+        else
+        {
+            consumed = seg->len - body->offset;
+            if (consumed > room - written)
+                consumed = room - written;
+            memcpy(buffer + written, seg->data + body->offset, consumed);
+            written += consumed;
+        }
+
+        body->offset += consumed;
+        if (body->offset == seg->len)
+        {
+            body->segment++;
+            body->offset = 0;
+        }
+        else if (consumed == 0)
+            break; /* An escape sequence does not fit, continue in the next buffer */
+    }
+
+    return written;
+}
+
+/* cURL rewinds the body when it has to resend it (redirects, some HTTP/2 retries) */
+int request_body_seek(struct request_body *body, curl_off_t offset, int origin)
+{
+    if (origin != SEEK_SET || offset != 0)
+        return CURL_SEEKFUNC_CANTSEEK;
+    body->segment = 0;
+    body->offset = 0;
+    return CURL_SEEKFUNC_OK;
+}
+
+/* Smaller bodies are sent as they are, compressing them would not save a packet */
+#define COMPRESS_MIN 1024
+
+/*
+    Compress the serialization of `body` with gzip into its arena, streaming it through a small
+    buffer as cURL would read it. Returns -1 if it fails or does not get any smaller.
+*/
+int request_body_compress(struct request_body *body)
+{
+    size_t capacity = body->length / 4 + 1024, len = 0, n;
+    char chunk[16384], *packed;
+    int flush;
+    z_stream z;
+
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    packed = arena_alloc(body->arena, capacity);
+    body->packed = NULL;
+    body->segment = 0;
+    body->offset = 0;
+    do
+    {
+        n = request_body_read(chunk, 1, sizeof(chunk), body);
+        flush = body->segment == body->count ? Z_FINISH : Z_NO_FLUSH;
+        z.next_in = (Bytef *)chunk;
+        z.avail_in = n;
+        do
+        {
+            if (len == capacity)
+            {
+                packed = arena_realloc(body->arena, packed, capacity, capacity * 2);
+                capacity *= 2;
+            }
+            z.next_out = (Bytef *)packed + len;
+            z.avail_out = capacity - len;
+            deflate(&z, flush);
+            len = capacity - z.avail_out;
+        } while (z.avail_out == 0);
+    } while (flush != Z_FINISH);
+    deflateEnd(&z);
+
+    body->segment = 0;
+    body->offset = 0;
+    if (len >= body->length)
+        return -1;
+    body->packed = packed;
+    body->packed_len = len;
+    return 0;
+}
+
+/*
+    Session file: SESSION_MAGIC, one record per field or message (a struct session_record followed
+    by `len` bytes of raw content), then an index of every record and a trailer pointing at it.
+    Loading maps the file and reads only the index: message contents stay in the mapping and are
+    paged in when a request first needs them. Integers are stored in host byte order.
+*/
+#define SESSION_MAGIC "CGPTSES1"
+#define SESSION_PINNED 1
+
+struct session_record
+{
+    uint8_t type; /* 'M'odel, 'T'emperature, 'S'ystem, 'U'ser, 'A'ssistant or attached 'F'ile ("<hash> <path>") */
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t len;
+};
+
+struct session_index
+{
+    uint64_t offset; /* Of the record content */
+    struct session_record record;
+};
+
+struct session_trailer
+{
+    uint64_t index_offset;
+    uint64_t count;
+    char magic[8];
+};
+
+int session_write_record(FILE *fp, struct session_index *index, char type, uint8_t flags, const char *data, size_t len)
+{
+    struct session_record record;
+    long offset = ftell(fp);
+
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.flags = flags;
+    record.len = len;
+    if (offset < 0 || fwrite(&record, sizeof(record), 1, fp) != 1 || fwrite(data, 1, len, fp) != len)
+        return -1;
+    index->offset = offset + sizeof(record);
+    index->record = record;
+    return 0;
+}
+
+/* Write `conv` to `path`, through a temporary file so a session mapped from `path` stays valid */
+int session_save(const char *path, const struct conversation *conv, const char *model, float temperature)
+{
+    char *tmp_path = arena_concat(&turn_arena, path, ".tmp"), f_temp[32];
+    struct session_index *index = arena_alloc(&turn_arena, (conv->count + 3) * sizeof(struct session_index));
+    struct session_trailer trailer;
+    size_t count = 0, i;
+    int failed = 0;
+    FILE *fp = fopen(tmp_path, "wb");
+
+    if (fp == NULL)
+        return -1;
+
+    snprintf(f_temp, sizeof(f_temp), "%.1f", temperature);
+    failed |= fwrite(SESSION_MAGIC, 1, 8, fp) != 8;
+    failed |= session_write_record(fp, &index[count++], 'M', 0, model, strlen(model));
+    failed |= session_write_record(fp, &index[count++], 'T', 0, f_temp, strlen(f_temp));
+    if (conv->system != NULL)
+        failed |= session_write_record(fp, &index[count++], 'S', 0, conv->system, strlen(conv->system));
+    for (i = 0; i < conv->count && !failed; i++)
+    {
+        const struct attachment *a = conv->messages[i].attachment;
+        uint8_t flags = conv->messages[i].pinned ? SESSION_PINNED : 0;
+        if (a != NULL)
+        {
+            /* Attached files are saved by reference */
+            char *ref = arena_alloc(&turn_arena, strlen(a->path) + 34);
+            sprintf(ref, "%016llx%016llx %s", (unsigned long long)a->hash[0], (unsigned long long)a->hash[1], a->path);
+            failed |= session_write_record(fp, &index[count++], 'F', flags, ref, strlen(ref));
+        }
+        else
+            failed |= session_write_record(fp, &index[count++], conv->messages[i].role == ROLE_ASSISTANT ? 'A' : 'U', flags,
+                                           conv->messages[i].content, conv->messages[i].len);
+    }
+
+    trailer.index_offset = ftell(fp);
+    trailer.count = count;
+    memcpy(trailer.magic, SESSION_MAGIC, 8);
+    failed |= fwrite(index, sizeof(struct session_index), count, fp) != count;
+    failed |= fwrite(&trailer, sizeof(trailer), 1, fp) != 1;
+    failed |= fclose(fp) != 0;
+    if (failed || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Attach again the file of the reference `ref`, or leave a note in its place if it is gone */
+int session_load_attachment(struct conversation *conv, const char *ref)
+{
+    unsigned long long hash[2];
+    struct attachment *a = NULL;
+    char *note;
+
+    if (strlen(ref) > 33 && sscanf(ref, "%16llx%16llx ", &hash[0], &hash[1]) == 2)
+        a = attachment_map(ref + 33);
+    if (a == NULL)
+    {
+        note = arena_alloc(&turn_arena, strlen(ref) + 64);
+        sprintf(note, "(Attached file %s, no longer available.)", strlen(ref) > 33 ? ref + 33 : ref);
+        return conversation_append(conv, ROLE_USER, note, strlen(note));
+    }
+    if (a->hash[0] != hash[0] || a->hash[1] != hash[1])
+        fprintf(stderr, "Warning: %s has changed since it was attached, its current content is used.\n", a->path);
+    return conversation_attach(conv, a);
+}
+
+/*
+    Replace `conv` with the session saved in `path`. Returns 1 without touching anything if the
+    file is not in this format (older MODEL/TEMP/SYS/CONV exports), -1 if it is damaged.
+*/
+int session_load(const char *path, struct conversation *conv, char **model, float *temperature)
+{
+    struct session_trailer trailer;
+    struct session_index entry;
+    struct stat st;
+    size_t i;
+    char *map;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < 8 + sizeof(trailer))
+    {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "mmap() failed\n");
+        return -1;
+    }
+    if (memcmp(map, SESSION_MAGIC, 8) != 0)
+    {
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    memcpy(&trailer, map + st.st_size - sizeof(trailer), sizeof(trailer));
+    if (memcmp(trailer.magic, SESSION_MAGIC, 8) != 0 || trailer.index_offset < 8 ||
+        trailer.index_offset > st.st_size - sizeof(trailer) ||
+        trailer.count > (st.st_size - sizeof(trailer) - trailer.index_offset) / sizeof(struct session_index))
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    for (i = 0; i < trailer.count; i++)
+    {
+        memcpy(&entry, map + trailer.index_offset + i * sizeof(entry), sizeof(entry));
+        if (entry.offset > trailer.index_offset || entry.record.len > trailer.index_offset - entry.offset)
+        {
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+
+    conversation_clear(conv);
+    conv->generation++;
+    conv->map = map;
+    conv->map_size = st.st_size;
+    for (i = 0; i < trailer.count; i++)
+    {
+        memcpy(&entry, map + trailer.index_offset + i * sizeof(entry), sizeof(entry));
+        char *data = map + entry.offset;
+        switch (entry.record.type)
+        {
+        case 'M':
+            *model = arena_strndup(&session_arena, data, entry.record.len);
+            break;
+        case 'T':
+            *temperature = atof(arena_strndup(&turn_arena, data, entry.record.len));
+            break;
+        case 'S':
+            conversation_set_system(conv, arena_strndup(&turn_arena, data, entry.record.len));
+            break;
+        case 'U':
+        case 'A':
+            if (conversation_push(conv, entry.record.type == 'A' ? ROLE_ASSISTANT : ROLE_USER, data, entry.record.len, true) != 0)
+                return -1;
+            conv->messages[conv->count - 1].pinned = (entry.record.flags & SESSION_PINNED) ? true : false;
+            break;
+        case 'F':
+            if (session_load_attachment(conv, arena_strndup(&turn_arena, data, entry.record.len)) != 0)
+                return -1;
+            conv->messages[conv->count - 1].pinned = (entry.record.flags & SESSION_PINNED) ? true : false;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Parse the comma separated message objects of a SYS or CONV line into the store */
+int conversation_import_messages(struct conversation *conv, const char *fragment, bool system)
+{
+    size_t len = strlen(fragment);
+    char *json = arena_alloc(&turn_arena, len + 3);
+    json[0] = '[';
+    memcpy(json + 1, fragment, len);
+    /* The SYS line carries a trailing comma */
+    while (len > 0 && (json[len] == ',' || json[len] == ' '))
+        len--;
+    json[len + 1] = ']';
+    json[len + 2] = '\0';
+
+    cJSON *root = cJSON_Parse(json);
+    if (!cJSON_IsArray(root))
+    {
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    cJSON *item;
+    cJSON_ArrayForEach(item, root)
+    {
+        cJSON *role = cJSON_GetObjectItemCaseSensitive(item, "role");
+        cJSON *content = cJSON_GetObjectItemCaseSensitive(item, "content");
+        if (!cJSON_IsString(role) || !cJSON_IsString(content))
+            continue;
+        if (system || strcmp(role->valuestring, "system") == 0)
+            conversation_set_system(conv, content->valuestring);
+        else
+            conversation_append(conv, strcmp(role->valuestring, "assistant") == 0 ? ROLE_ASSISTANT : ROLE_USER,
+                                content->valuestring, strlen(content->valuestring));
+    }
+    cJSON_Delete(root);
+    return 0;
+}
+
+/*
+    Endpoint pool: the OpenAI-compatible endpoints requests are spread over, each one with its
+    own API key or the global one. A request goes to the endpoint expected to answer first, the
+    one whose smoothed time to first byte times its requests in flight (plus this one) is lowest;
+    endpoints not measured yet go first. After POOL_FAILURES failures in a row an endpoint is left
+    out for POOL_COOLDOWN seconds (its circuit is open), and then gets a single trial request.
+*/
+#define POOL_MAX 16
+#define POOL_FAILURES 3
+#define POOL_COOLDOWN 30.0
+
+/* Whether an endpoint takes compressed request bodies, probing it after one was refused */
+enum compression
+{
+    COMPRESSION_ACCEPTED,
+    COMPRESSION_PROBING,
+    COMPRESSION_REJECTED
+};
+
+struct endpoint
+{
+    char *url;
+    char *apikey; /* NULL for the global one */
+    double latency; /* Moving average of the time to first byte, 0 until measured */
+    unsigned int in_flight;
+    unsigned int failures; /* In a row */
+    double open_until;     /* Left out until then once `failures` reaches POOL_FAILURES */
+    bool trial;            /* The request testing an endpoint whose cooldown is over is running */
+    unsigned long requests;
+    unsigned long errors;
+    enum compression compression;
+};
+
+struct endpoint_pool
+{
+    struct endpoint endpoints[POOL_MAX];
+    unsigned int count;
+};
+
+struct endpoint_pool pool;
+
+struct endpoint *pool_find(const char *url)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool.count; i++)
+    {
+        if (strcmp(pool.endpoints[i].url, url) == 0)
+            return &pool.endpoints[i];
+    }
+    return NULL;
+}
+
+/* Add `url` (with its own `apikey`, or NULL) to the pool; the strings must outlive it */
+int pool_add(char *url, char *apikey)
+{
+    struct endpoint *e;
+
+    if (pool_find(url) != NULL)
+    {
+        fprintf(stderr, "Error: endpoint '%s' is already in the pool.\n", url);
+        return -1;
+    }
+    if (pool.count == POOL_MAX)
+    {
+        fprintf(stderr, "Error: the endpoint pool is full (%d endpoints).\n", POOL_MAX);
+        return -1;
+    }
+    e = &pool.endpoints[pool.count++];
+    memset(e, 0, sizeof(struct endpoint));
+    e->url = url;
+    e->apikey = apikey;
+    return 0;
+}
+
+int pool_remove(const char *url)
+{
+    struct endpoint *e = pool_find(url);
+
+    if (e == NULL)
+    {
+        fprintf(stderr, "Error: endpoint '%s' is not in the pool.\n", url);
+        return -1;
+    }
+    if (pool.count == 1)
+    {
+        fprintf(stderr, "Error: the pool needs at least one endpoint.\n");
+        return -1;
+    }
+    memmove(e, e + 1, (pool.endpoints + --pool.count - e) * sizeof(struct endpoint));
+    return 0;
+}
+
+/* Parse "<URL> [<API key>]" (modified in place) and add it */
+int pool_add_line(char *line)
+{
+    char *apikey = strchr(line, ' ');
+
+    if (apikey != NULL)
+    {
+        *apikey++ = '\0';
+        while (*apikey == ' ')
+            apikey++;
+        if (*apikey == '\0')
+            apikey = NULL;
+    }
+    return pool_add(line, apikey);
+}
+
+bool endpoint_open(const struct endpoint *e, double now)
+{
+    return e->failures >= POOL_FAILURES && (now < e->open_until || e->trial) ? true : false;
+}
+
+/*
+    Endpoint for the next request, preferably other than `avoid`. If every circuit is open the
+    one closest to its trial is used anyway, failing there beats not trying at all.
+*/
+struct endpoint *pool_pick(const struct endpoint *avoid)
+{
+    struct endpoint *best = NULL, *fallback = NULL;
+    double now = now_seconds(), best_score = 0;
+    unsigned int i;
+
+    for (i = 0; i < pool.count; i++)
+    {
+        struct endpoint *e = &pool.endpoints[i];
+        double score = e->latency * (e->in_flight + 1);
+
+        if (fallback == NULL || e->open_until < fallback->open_until)
+            fallback = e;
+        if (endpoint_open(e, now) || (e == avoid && pool.count > 1))
+            continue;
+        if (best == NULL || score < best_score || (score == best_score && e->in_flight < best->in_flight))
+        {
+            best = e;
+            best_score = score;
+        }
+    }
+    return best != NULL ? best : fallback;
+}
+
+/* A request is sent to `e` */
+void pool_begin(struct endpoint *e)
+{
+    e->in_flight++;
+    e->requests++;
+    if (e->failures >= POOL_FAILURES)
+        e->trial = true;
+}
+
+/* The request sent to `e` is over; `first_byte` is how long the answer took to start, or < 0 if unknown */
+void pool_end(struct endpoint *e, bool failed, double first_byte)
+{
+    e->in_flight--;
+    e->trial = false;
+    if (failed)
+    {
+        e->errors++;
+        if (++e->failures >= POOL_FAILURES)
+            e->open_until = now_seconds() + POOL_COOLDOWN;
+        return;
+    }
+    e->failures = 0;
+    if (first_byte >= 0)
+        e->latency = e->latency > 0 ? 0.8 * e->latency + 0.2 * first_byte : first_byte;
+}
+
+void pool_print(void)
+{
+    double now = now_seconds();
+    unsigned int i;
+
+    for (i = 0; i < pool.count; i++)
+    {
+        const struct endpoint *e = &pool.endpoints[i];
+        printf("  %u. %s (%s key) - %lu requests, %lu failed", i + 1, e->url, e->apikey != NULL ? "own" : "global", e->requests, e->errors);
+        if (e->latency > 0)
+            printf(", first byte in %.0f ms", e->latency * 1000);
+        if (e->failures >= POOL_FAILURES && now < e->open_until)
+            printf(", left out for %.0f s", e->open_until - now);
+        if (compress_requests && e->compression != COMPRESSION_ACCEPTED)
+            printf(", %s compressed requests", e->compression == COMPRESSION_PROBING ? "may not take" : "does not take");
+        printf("\n");
+    }
+}
+
+#define CACHE_MAGIC "CGPTCAC1"
+#define CACHE_SLOTS 4096
+
+/* Index slot of a cached reply, stored in the memory-mapped index file */
+struct cache_entry
+{
+    uint64_t key[2];
+    uint64_t size;
+    int64_t created;
+    int64_t last_used;
+    uint32_t tokens;
+    uint32_t used;
+};
+
+struct cache_header
+{
+    char magic[8];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t total_size;
+    uint32_t slots;
+    uint32_t count;
+};
+
+/*
+    Content-addressed reply cache in ~/.chatgpt-client-cache. Replies are stored one per file,
+    named after the hash of (endpoints, model, temperature, messages); the index is an open
+    addressing table mapped in memory, so a lookup is a single probe sequence.
+*/
+struct cache
+{
+    bool enabled;
+    char *dir;
+    int fd;
+    struct cache_header *header;
+    struct cache_entry *entries;
+    long ttl;             /* Seconds an entry stays valid, 0 for ever */
+    unsigned long max_size; /* Bytes of replies kept before evicting the least recently used */
+};
+
+struct cache cache = { false, NULL, -1, NULL, NULL, 7 * 24 * 3600, 64UL * 1024 * 1024 };
+
+void cache_key(const char *model, float temperature, const struct conversation *conv, uint64_t key[2])
+{
+    struct hasher h;
+    char f_temp[32];
+    size_t i;
+
+    snprintf(f_temp, sizeof(f_temp), "%.1f", temperature);
+    hasher_init(&h);
+    /* Endpoints of a pool are interchangeable, a reply from any of them is good for all */
+    for (i = 0; i < pool.count; i++)
+        hasher_field(&h, pool.endpoints[i].url, strlen(pool.endpoints[i].url));
+    hasher_field(&h, model, strlen(model));
+    hasher_field(&h, f_temp, strlen(f_temp));
+    hasher_field(&h, conv->system != NULL ? conv->system : "", conv->system != NULL ? strlen(conv->system) : 0);
+    for (i = 0; i < conv->count; i++)
+    {
+        if (!message_in_window(conv, i))
+            continue;
+        hasher_field(&h, role_names[conv->messages[i].role], strlen(role_names[conv->messages[i].role]));
+        hasher_field(&h, conv->messages[i].content, conv->messages[i].len);
+    }
+    hasher_final(&h, key);
+}
+
+void cache_close(void)
+{
+    if (cache.header != NULL)
+        munmap(cache.header, sizeof(struct cache_header) + CACHE_SLOTS * sizeof(struct cache_entry));
+    if (cache.fd >= 0)
+        close(cache.fd);
+    cache.header = NULL;
+    cache.entries = NULL;
+    cache.fd = -1;
+}
+
+/* Map the index, creating the cache directory and index file the first time */
+int cache_open(void)
+{
+    size_t map_size = sizeof(struct cache_header) + CACHE_SLOTS * sizeof(struct cache_entry);
+    struct stat st;
+
+    if (cache.header != NULL)
+        return 0;
+    if (cache.dir == NULL)
+        return -1;
+    mkdir(cache.dir, 0700);
+
+    char *index_path = arena_concat(&session_arena, cache.dir, "/index");
+    cache.fd = open(index_path, O_RDWR | O_CREAT, 0600);
+    if (cache.fd < 0 || fstat(cache.fd, &st) != 0)
+    {
+        cache_close();
+        return -1;
+    }
+    flock(cache.fd, LOCK_EX);
+    if ((size_t)st.st_size < map_size && ftruncate(cache.fd, map_size) != 0)
+    {
+        flock(cache.fd, LOCK_UN);
+        cache_close();
+        return -1;
+    }
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache.fd, 0);
+    if (map == MAP_FAILED)
+    {
+        flock(cache.fd, LOCK_UN);
+        cache_close();
+        return -1;
+    }
+    cache.header = map;
+    cache.entries = (struct cache_entry *)(cache.header + 1);
+    if (memcmp(cache.header->magic, CACHE_MAGIC, 8) != 0 || cache.header->slots != CACHE_SLOTS)
+    {
+        memset(map, 0, map_size);
+        memcpy(cache.header->magic, CACHE_MAGIC, 8);
+        cache.header->slots = CACHE_SLOTS;
+    }
+    flock(cache.fd, LOCK_UN);
+    return 0;
+}
+
+char *cache_path(struct arena *a, const uint64_t key[2])
+{
+    char name[40];
+    snprintf(name, sizeof(name), "/%016llx%016llx", (unsigned long long)key[0], (unsigned long long)key[1]);
+    return arena_concat(a, cache.dir, name);
+}
+
+/* Slot holding `key`, or the empty slot where it would go */
+struct cache_entry *cache_probe(const uint64_t key[2])
+{
+    size_t i = key[0] % CACHE_SLOTS, n;
+
+    for (n = 0; n < CACHE_SLOTS; n++, i = (i + 1) % CACHE_SLOTS)
+        if (!cache.entries[i].used || (cache.entries[i].key[0] == key[0] && cache.entries[i].key[1] == key[1]))
+            return &cache.entries[i];
+    return NULL;
+}
+
+/* Remove an entry and its file, shifting back the rest of the probe run so lookups stay correct */
+void cache_remove(struct cache_entry *entry)
+{
+    size_t hole = entry - cache.entries, i = hole;
+
+    unlink(cache_path(&turn_arena, entry->key));
+    cache.header->total_size -= entry->size;
+    cache.header->count--;
+    entry->used = 0;
+    while (true)
+    {
+        i = (i + 1) % CACHE_SLOTS;
+        if (!cache.entries[i].used)
+            break;
+        size_t home = cache.entries[i].key[0] % CACHE_SLOTS;
+        /* Move it into the hole unless its home lies cyclically in (hole, i] */
+        if ((hole < i) ? (home <= hole || home > i) : (home <= hole && home > i))
+        {
+            cache.entries[hole] = cache.entries[i];
+            cache.entries[i].used = 0;
+            hole = i;
+        }
+    }
+}
+
+void cache_evict_lru(void)
+{
+    struct cache_entry *oldest = NULL;
+    size_t i;
+
+    for (i = 0; i < CACHE_SLOTS; i++)
+        if (cache.entries[i].used && (oldest == NULL || cache.entries[i].last_used < oldest->last_used))
+            oldest = &cache.entries[i];
+    if (oldest != NULL)
+        cache_remove(oldest);
+}
+
+/* Cached reply for `key` in arena `a`, or NULL on a miss or if `enabled` is false */
+char *cache_lookup(bool enabled, struct arena *a, const uint64_t key[2], unsigned int *tokens_used)
+{
+    char *result = NULL;
+
+    if (!enabled || cache_open() != 0)
+        return NULL;
+
+    flock(cache.fd, LOCK_EX);
+    struct cache_entry *entry = cache_probe(key);
+    if (entry != NULL && entry->used && cache.ttl > 0 && time(NULL) - entry->created > cache.ttl)
+    {
+        cache_remove(entry);
+        entry = NULL;
+    }
+    if (entry != NULL && entry->used)
+    {
+        int fd = open(cache_path(a, key), O_RDONLY);
+        if (fd >= 0)
+        {
+            result = arena_alloc(a, entry->size + 1);
+            if (read(fd, result, entry->size) == (ssize_t)entry->size)
+            {
+                result[entry->size] = '\0';
+                entry->last_used = time(NULL);
+                if (tokens_used != NULL)
+                    *tokens_used = entry->tokens;
+            }
+            else
+                result = NULL;
+            close(fd);
+        }
+        if (result == NULL)
+            cache_remove(entry);
+    }
+    if (result != NULL)
+        cache.header->hits++;
+    else
+        cache.header->misses++;
+    flock(cache.fd, LOCK_UN);
+
+    return result;
+}
+
+void cache_store(bool enabled, const uint64_t key[2], const char *content, size_t len, unsigned int tokens_used)
+{
+    if (!enabled || len > cache.max_size || cache_open() != 0)
+        return;
+
+    /* Write the reply aside and rename it, readers never see a partial file */
+    char *path = cache_path(&turn_arena, key);
+    char *tmp = arena_concat(&turn_arena, path, ".tmp");
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL)
+        return;
+    if (fwrite(content, 1, len, fp) != len)
+    {
+        fclose(fp);
+        unlink(tmp);
+        return;
+    }
+    fclose(fp);
+
+    flock(cache.fd, LOCK_EX);
+    struct cache_entry *entry = cache_probe(key);
+    if (entry != NULL && entry->used)
+        cache_remove(entry);
+    while (cache.header->count > 0 && (cache.header->count >= CACHE_SLOTS * 3 / 4 || cache.header->total_size + len > cache.max_size))
+        cache_evict_lru();
+    if (rename(tmp, path) == 0 && (entry = cache_probe(key)) != NULL)
+    {
+        entry->key[0] = key[0];
+        entry->key[1] = key[1];
+        entry->size = len;
+        entry->created = time(NULL);
+        entry->last_used = entry->created;
+        entry->tokens = tokens_used;
+        entry->used = 1;
+        cache.header->count++;
+        cache.header->total_size += len;
+    }
+    else
+        unlink(tmp);
+    flock(cache.fd, LOCK_UN);
+}
+
+void cache_print_stats(void)
+{
+    if (cache_open() != 0)
+    {
+        printf("Response cache is not available.\n");
+        return;
+    }
+    printf("Response cache (%s): %s, %u entries, %llu bytes, %llu hits, %llu misses.\n", cache.dir,
+           cache.enabled ? "enabled" : "disabled", cache.header->count, (unsigned long long)cache.header->total_size,
+           (unsigned long long)cache.header->hits, (unsigned long long)cache.header->misses);
+}
+
+void cache_clear(void)
+{
+    size_t i;
+
+    if (cache_open() != 0)
+        return;
+    flock(cache.fd, LOCK_EX);
+    for (i = 0; i < CACHE_SLOTS; i++)
+        if (cache.entries[i].used)
+            unlink(cache_path(&turn_arena, cache.entries[i].key));
+    memset(cache.entries, 0, CACHE_SLOTS * sizeof(struct cache_entry));
+    cache.header->count = 0;
+    cache.header->total_size = 0;
+    flock(cache.fd, LOCK_UN);
+}
+
+/*
+    Full-text search over exported sessions, in ~/.chatgpt-client-index. "terms" is an open
+    addressing table mapped in memory from the hash of every word to the last block of its
+    postings; "data" is append-only and holds the session paths and the posting blocks, each one
+    listing the messages of one session containing the word and linking to the previous block;
+    "docs" has one fixed size record per indexed session. Indexing a session appends its blocks
+    and relinks the words it contains, re-indexing one marks its old record deleted. Hits are
+    messages, ranked with BM25.
+*/
+#define INDEX_MAGIC "CGPTIDX1"
+#define INDEX_SLOTS 65536
+#define INDEX_HITS 10
+
+struct index_header
+{
+    char magic[8];
+    uint64_t slots;
+    uint64_t used;
+    uint64_t messages; /* Indexed messages... */
+    uint64_t length;   /* ...and words in them, for the average message length */
+};
+
+struct index_term
+{
+    uint64_t hash; /* 0 for an empty slot */
+    uint64_t head; /* Offset of the last block in the data file */
+    uint64_t postings;
+};
+
+struct index_block
+{
+    uint64_t next; /* Previous block of the same word, 0 if none */
+    uint32_t doc;
+    uint32_t count; /* struct index_posting that follow */
+};
+
+struct index_posting
+{
+    uint32_t message; /* From 1, as numbered by /context */
+    uint16_t tf;
+    uint16_t length; /* Words in the message */
+};
+
+struct index_doc
+{
+    uint64_t path_hash;
+    uint64_t path_offset;
+    uint32_t path_len;
+    uint32_t messages;
+    int64_t mtime;
+    uint64_t size;
+    uint32_t deleted;
+    uint32_t length; /* Words in its messages */
+};
+
+/* A word of a message being indexed */
+struct index_occurrence
+{
+    uint64_t hash;
+    uint32_t message;
+    uint32_t length;
+};
+
+struct search_index
+{
+    char *dir;
+    int terms_fd;
+    int data_fd;
+    int docs_fd;
+    struct index_header *header;
+    struct index_term *terms;
+    uint64_t slots; /* Mapped */
+};
+
+struct search_index search_index = { NULL, -1, -1, -1, NULL, NULL, 0 };
+
+void index_unmap(void)
+{
+    if (search_index.header != NULL)
+        munmap(search_index.header, sizeof(struct index_header) + search_index.slots * sizeof(struct index_term));
+    search_index.header = NULL;
+    search_index.terms = NULL;
+}
+
+int index_map(size_t slots)
+{
+    void *map = mmap(NULL, sizeof(struct index_header) + slots * sizeof(struct index_term), PROT_READ | PROT_WRITE, MAP_SHARED,
+                     search_index.terms_fd, 0);
+
+    if (map == MAP_FAILED)
+        return -1;
+    search_index.header = map;
+    search_index.terms = (struct index_term *)(search_index.header + 1);
+    search_index.slots = slots;
+    return 0;
+}
+
+/* Let other processes use the index; it stays open and mapped for the next operation */
+void index_close(void)
+{
+    if (search_index.terms_fd >= 0)
+        flock(search_index.terms_fd, LOCK_UN);
+}
+
+/*
+    Lock the index (`lock` is LOCK_SH or LOCK_EX), opening it and creating it the first time.
+    The table is mapped again if another process made it grow.
+*/
+int index_open(int lock)
+{
+    struct index_header header;
+    struct stat st;
+
+    if (search_index.dir == NULL)
+        return -1;
+    if (search_index.terms_fd < 0)
+    {
+        mkdir(search_index.dir, 0700);
+        search_index.terms_fd = open(arena_concat(&session_arena, search_index.dir, "/terms"), O_RDWR | O_CREAT, 0600);
+        search_index.data_fd = open(arena_concat(&session_arena, search_index.dir, "/data"), O_RDWR | O_CREAT, 0600);
+        search_index.docs_fd = open(arena_concat(&session_arena, search_index.dir, "/docs"), O_RDWR | O_CREAT, 0600);
+        if (search_index.terms_fd < 0 || search_index.data_fd < 0 || search_index.docs_fd < 0)
+        {
+            close(search_index.terms_fd);
+            close(search_index.data_fd);
+            close(search_index.docs_fd);
+            search_index.terms_fd = -1;
+            return -1;
+        }
+    }
+    flock(search_index.terms_fd, LOCK_EX);
+    if (fstat(search_index.terms_fd, &st) != 0 || (size_t)st.st_size < sizeof(header) ||
+        pread(search_index.terms_fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, INDEX_MAGIC, 8) != 0)
+    {
+        index_unmap();
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INDEX_MAGIC, 8);
+        header.slots = INDEX_SLOTS;
+        if (ftruncate(search_index.terms_fd, 0) != 0 || ftruncate(search_index.terms_fd, sizeof(header) + INDEX_SLOTS * sizeof(struct index_term)) != 0 ||
+            pwrite(search_index.terms_fd, &header, sizeof(header), 0) != sizeof(header) ||
+            ftruncate(search_index.data_fd, 0) != 0 || pwrite(search_index.data_fd, INDEX_MAGIC, 8, 0) != 8 ||
+            ftruncate(search_index.docs_fd, 0) != 0)
+        {
+            index_close();
+            return -1;
+        }
+    }
+    if (search_index.header != NULL && search_index.slots != header.slots)
+        index_unmap();
+    if (search_index.header == NULL && index_map(header.slots) != 0)
+    {
+        index_close();
+        return -1;
+    }
+    if (lock != LOCK_EX)
+        flock(search_index.terms_fd, lock);
+    return 0;
+}
+
+/* Slot of the word `hash`, or the empty slot where it would go */
+struct index_term *index_probe(uint64_t hash)
+{
+    uint64_t slots = search_index.header->slots, i = hash % slots;
+
+    while (search_index.terms[i].hash != 0 && search_index.terms[i].hash != hash)
+        i = (i + 1) % slots;
+    return &search_index.terms[i];
+}
+
+/* Make room for `more` new words, doubling the table while it would get over half full */
+int index_reserve(uint64_t more)
+{
+    uint64_t slots = search_index.header->slots, i;
+    struct index_term *old;
+
+    if ((search_index.header->used + more) * 2 <= slots)
+        return 0;
+    while ((search_index.header->used + more) * 2 > slots)
+        slots *= 2;
+    old = malloc(search_index.header->slots * sizeof(struct index_term));
+    if (old == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        return -1;
+    }
+    memcpy(old, search_index.terms, search_index.header->slots * sizeof(struct index_term));
+    i = search_index.header->slots;
+    index_unmap();
+    if (ftruncate(search_index.terms_fd, sizeof(struct index_header) + slots * sizeof(struct index_term)) != 0 || index_map(slots) != 0)
+    {
+        free(old);
+        return -1;
+    }
+    memset(search_index.terms, 0, slots * sizeof(struct index_term));
+    search_index.header->slots = slots;
+    while (i-- > 0)
+    {
+        if (old[i].hash != 0)
+            *index_probe(old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+bool index_word_char(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c >= 0x80 ? true : false;
+}
+
+/*
+    Split `text` into words (runs of letters, digits, '_' and non-ASCII bytes, compared without
+    case), storing their hashes in `hashes` (room for len / 2 + 1) and, if `starts` is not NULL,
+    where they start. Returns how many there are.
+*/
+size_t index_words(const char *text, size_t len, uint64_t *hashes, size_t *starts)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    size_t i = 0, count = 0, start;
+
+    while (i < len)
+    {
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        while (i < len && !index_word_char(p[i]))
+            i++;
+        for (start = i; i < len && index_word_char(p[i]); i++)
+            h = (h ^ (p[i] >= 'A' && p[i] <= 'Z' ? p[i] + 32 : p[i])) * 0x100000001b3ULL;
+        /* Single letters and digits are everywhere, not worth an entry */
+        if (i - start > 1 || (i > start && p[start] >= 0x80))
+        {
+            if (starts != NULL)
+                starts[count] = start;
+            hashes[count++] = mix64(h) | 1;
+        }
+    }
+    return count;
+}
+
+int index_occurrence_compare(const void *a, const void *b)
+{
+    const struct index_occurrence *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->message < y->message ? -1 : x->message > y->message ? 1 : 0;
+}
+
+int write_all_at(int fd, const void *data, size_t len, off_t offset)
+{
+    const char *p = data;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Add the session saved in `path` with the contents of `conv` to the index, replacing an older version */
+int index_session(const char *path, const struct conversation *conv)
+{
+    struct index_occurrence *words;
+    struct index_doc doc, *docs;
+    struct hasher h;
+    struct stat st;
+    struct string blocks;
+    uint64_t *hashes, *heads, path_hash[2], distinct = 0, length = 0;
+    size_t count = 0, i, j, n;
+    off_t data_end, docs_end;
+    char *full = realpath(path, NULL), *abs_path;
+
+    if (full == NULL || stat(full, &st) != 0)
+    {
+        free(full);
+        return -1;
+    }
+    abs_path = arena_strdup(&turn_arena, full);
+    free(full);
+    hasher_init(&h);
+    hasher_update(&h, abs_path, strlen(abs_path));
+    hasher_final(&h, path_hash);
+
+    /* Attached files are not part of the conversation text */
+    for (i = 0; i < conv->count; i++)
+        count += conv->messages[i].attachment == NULL ? conv->messages[i].len / 2 + 1 : 0;
+    words = arena_alloc(&turn_arena, count * sizeof(struct index_occurrence));
+    count = 0;
+    for (i = 0; i < conv->count; i++)
+    {
+        if (conv->messages[i].attachment != NULL)
+            continue;
+        hashes = arena_alloc(&turn_arena, (conv->messages[i].len / 2 + 1) * sizeof(uint64_t));
+        n = index_words(conv->messages[i].content, conv->messages[i].len, hashes, NULL);
+        for (j = 0; j < n; j++)
+        {
+            words[count + j].hash = hashes[j];
+            words[count + j].message = i + 1;
+            words[count + j].length = n < 65535 ? n : 65535;
+        }
+        count += n;
+        length += n;
+    }
+    qsort(words, count, sizeof(struct index_occurrence), index_occurrence_compare);
+    for (i = 0; i < count; i++)
+        if (i == 0 || words[i].hash != words[i - 1].hash)
+            distinct++;
+
+    if (index_open(LOCK_EX) != 0)
+        return -1;
+    if (index_reserve(distinct) != 0)
+    {
+        index_close();
+        return -1;
+    }
+
+    /* Older versions of the session are left out of the results */
+    docs_end = lseek(search_index.docs_fd, 0, SEEK_END);
+    docs_end -= docs_end % sizeof(struct index_doc);
+    docs = arena_alloc(&turn_arena, docs_end + 1);
+    if (docs_end < 0 || pread(search_index.docs_fd, docs, docs_end, 0) != docs_end)
+    {
+        index_close();
+        return -1;
+    }
+    for (i = 0; i < docs_end / sizeof(struct index_doc); i++)
+    {
+        if (docs[i].path_hash == path_hash[0] && !docs[i].deleted)
+        {
+            docs[i].deleted = 1;
+            write_all_at(search_index.docs_fd, &docs[i], sizeof(struct index_doc), i * sizeof(struct index_doc));
+            /* Its messages no longer count for the average length and the word frequencies */
+            search_index.header->messages -= docs[i].messages < search_index.header->messages ? docs[i].messages : search_index.header->messages;
+            search_index.header->length -= docs[i].length < search_index.header->length ? docs[i].length : search_index.header->length;
+        }
+    }
+
+    /* The record goes first: if the rest fails, the number is not given to another session */
+    data_end = lseek(search_index.data_fd, 0, SEEK_END);
+    memset(&doc, 0, sizeof(doc));
+    doc.path_hash = path_hash[0];
+    doc.path_offset = data_end;
+    doc.path_len = strlen(abs_path);
+    doc.messages = conv->count;
+    doc.length = length < 0xFFFFFFFFULL ? length : 0xFFFFFFFFULL;
+    doc.mtime = st.st_mtime;
+    doc.size = st.st_size;
+    if (data_end < 8 || write_all_at(search_index.docs_fd, &doc, sizeof(doc), docs_end) != 0)
+    {
+        index_close();
+        return -1;
+    }
+
+    init_string_arena(&blocks, &turn_arena);
+    append_string(&blocks, abs_path, doc.path_len);
+    heads = arena_alloc(&turn_arena, (distinct + 1) * sizeof(uint64_t));
+    for (i = 0, n = 0; i < count; i = j, n++)
+    {
+        struct index_term *term = index_probe(words[i].hash);
+        struct index_block block;
+
+        heads[n] = blocks.len;
+        block.next = term->hash != 0 ? term->head : 0;
+        block.doc = docs_end / sizeof(doc);
+        block.count = 0;
+        append_string(&blocks, (char *)&block, sizeof(block));
+        for (j = i; j < count && words[j].hash == words[i].hash;)
+        {
+            struct index_posting posting;
+            size_t k = j;
+
+            while (j < count && words[j].hash == words[i].hash && words[j].message == words[k].message)
+                j++;
+            posting.message = words[k].message;
+            posting.tf = j - k < 65535 ? j - k : 65535;
+            posting.length = words[k].length;
+            append_string(&blocks, (char *)&posting, sizeof(posting));
+            block.count++;
+        }
+        memcpy(blocks.ptr + heads[n], &block, sizeof(block));
+    }
+    if (write_all_at(search_index.data_fd, blocks.ptr, blocks.len, data_end) != 0)
+    {
+        index_close();
+        return -1;
+    }
+
+    /* Only now that the blocks are written the table points at them */
+    for (i = 0, n = 0; i < count; i = j, n++)
+    {
+        struct index_term *term = index_probe(words[i].hash);
+        struct index_block block;
+
+        memcpy(&block, blocks.ptr + heads[n], sizeof(block));
+        if (term->hash == 0)
+        {
+            term->hash = words[i].hash;
+            search_index.header->used++;
+        }
+        term->head = data_end + heads[n];
+        term->postings += block.count;
+        for (j = i; j < count && words[j].hash == words[i].hash; j++)
+            ;
+    }
+    search_index.header->messages += conv->count;
+    search_index.header->length += length;
+    index_close();
+    return 0;
+}
+
+/* Score of a message for the running search */
+struct index_hit
+{
+    uint64_t key; /* Session number << 32 | message number, 0 for an empty slot */
+    double score;
+    uint32_t matched; /* Words of the query it contains */
+};
+
+struct index_hit *index_hit_find(struct index_hit **hits, size_t *slots, size_t *used, uint64_t key)
+{
+    size_t i;
+
+    if (*used * 2 >= *slots)
+    {
+        struct index_hit *old = *hits, *grown = calloc(*slots * 2, sizeof(struct index_hit));
+        size_t n = *slots;
+        if (grown == NULL)
+            return NULL;
+        *hits = grown;
+        *slots *= 2;
+        while (n-- > 0)
+        {
+            if (old[n].key == 0)
+                continue;
+            for (i = mix64(old[n].key) % *slots; grown[i].key != 0; i = (i + 1) % *slots)
+                ;
+            grown[i] = old[n];
+        }
+        free(old);
+    }
+    for (i = mix64(key) % *slots; (*hits)[i].key != 0 && (*hits)[i].key != key; i = (i + 1) % *slots)
+        ;
+    if ((*hits)[i].key == 0)
+    {
+        (*hits)[i].key = key;
+        (*used)++;
+    }
+    return &(*hits)[i];
+}
+
+int index_hit_compare(const void *a, const void *b)
+{
+    const struct index_hit *x = a, *y = b;
+
+    return x->score < y->score ? 1 : x->score > y->score ? -1 : 0;
+}
+
+/* Message `number` (from 1) of the session saved in `path` and its type ('U' or 'A'), copied into arena `a` */
+char *session_message(struct arena *a, const char *path, uint32_t number, size_t *len, char *type)
+{
+    struct session_trailer trailer;
+    struct session_index entry;
+    struct stat st;
+    char *map, *content = NULL;
+    uint64_t i;
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < 8 + sizeof(trailer) ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    memcpy(&trailer, map + st.st_size - sizeof(trailer), sizeof(trailer));
+    if (memcmp(map, SESSION_MAGIC, 8) == 0 && memcmp(trailer.magic, SESSION_MAGIC, 8) == 0 && trailer.index_offset >= 8 &&
+        trailer.index_offset <= st.st_size - sizeof(trailer) &&
+        trailer.count <= (st.st_size - sizeof(trailer) - trailer.index_offset) / sizeof(struct session_index))
+    {
+        for (i = 0; i < trailer.count; i++)
+        {
+            memcpy(&entry, map + trailer.index_offset + i * sizeof(entry), sizeof(entry));
+            if (entry.record.type != 'U' && entry.record.type != 'A' && entry.record.type != 'F')
+                continue;
+            if (--number > 0)
+                continue;
+            if (entry.offset <= trailer.index_offset && entry.record.len <= trailer.index_offset - entry.offset)
+            {
+                content = arena_strndup(a, map + entry.offset, entry.record.len);
+                *len = entry.record.len;
+                *type = entry.record.type;
+            }
+            break;
+        }
+    }
+    munmap(map, st.st_size);
+    return content;
+}
+
+/* Print the part of `text` around byte `at` on one line */
+void index_print_snippet(const char *text, size_t len, size_t at)
+{
+    size_t start = at > 60 ? at - 60 : 0, end = at + 140 < len ? at + 140 : len, i;
+
+    /* Do not cut UTF-8 sequences */
+    while (start > 0 && ((unsigned char)text[start] & 0xC0) == 0x80)
+        start--;
+    while (end < len && ((unsigned char)text[end] & 0xC0) == 0x80)
+        end++;
+    printf("    %s", start > 0 ? "..." : "");
+    for (i = start; i < end; i++)
+        putchar((unsigned char)text[i] < ' ' ? ' ' : text[i]);
+    printf("%s\n\n", end < len ? "..." : "");
+}
+
+/*
+    Print the messages of the indexed sessions that best match `query`, at most `limit` of them,
+    storing the paths of their sessions in `paths` (to be freed). Returns how many were printed,
+    -1 on error.
+*/
+int index_search(const char *query, unsigned int limit, char **paths)
+{
+    size_t qlen = strlen(query), count, slots = 1024, used = 0, i, j, data_size, docs_count;
+    uint64_t *terms = arena_alloc(&turn_arena, (qlen / 2 + 1) * sizeof(uint64_t));
+    double started = now_seconds(), average;
+    struct index_hit *hits;
+    struct index_doc *docs;
+    struct stat st;
+    char *data;
+    int shown = 0;
+
+    count = index_words(query, qlen, terms, NULL);
+    for (i = 0, j = 0; i < count; i++)
+    {
+        size_t k;
+        for (k = 0; k < j && terms[k] != terms[i]; k++)
+            ;
+        if (k == j)
+            terms[j++] = terms[i];
+    }
+    if ((count = j) == 0)
+    {
+        fprintf(stderr, "Error: no words to search for.\n");
+        return -1;
+    }
+    if (index_open(LOCK_SH) != 0)
+    {
+        fprintf(stderr, "Error: the search index in %s is not available.\n", search_index.dir);
+        return -1;
+    }
+    fstat(search_index.data_fd, &st);
+    data_size = st.st_size;
+    fstat(search_index.docs_fd, &st);
+    docs_count = st.st_size / sizeof(struct index_doc);
+    if (docs_count == 0)
+    {
+        index_close();
+        printf("No sessions indexed yet, /export one or run --index on saved ones.\n");
+        return 0;
+    }
+    data = mmap(NULL, data_size, PROT_READ, MAP_SHARED, search_index.data_fd, 0);
+    docs = mmap(NULL, docs_count * sizeof(struct index_doc), PROT_READ, MAP_SHARED, search_index.docs_fd, 0);
+    hits = calloc(slots, sizeof(struct index_hit));
+    if (data == MAP_FAILED || docs == MAP_FAILED || hits == NULL)
+    {
+        fprintf(stderr, "Error: cannot read the search index.\n");
+        index_close();
+        return -1;
+    }
+
+    /* BM25 with k1 = 1.2 and b = 0.75 */
+    average = search_index.header->messages > 0 ? (double)search_index.header->length / search_index.header->messages : 1;
+    for (i = 0; i < count; i++)
+    {
+        struct index_term *term = index_probe(terms[i]);
+        /* Postings of deleted sessions are still counted in the word, but not in the messages */
+        double n = search_index.header->messages, df = term->postings;
+        double idf = log(1 + ((n > df ? n - df : 0) + 0.5) / (df + 0.5));
+        struct index_block block;
+        uint64_t offset;
+
+        for (offset = term->hash != 0 ? term->head : 0; offset != 0; offset = block.next)
+        {
+            struct index_posting posting;
+            uint32_t k;
+
+            if (offset + sizeof(block) > data_size)
+                break;
+            memcpy(&block, data + offset, sizeof(block));
+            if (block.doc >= docs_count || block.count > (data_size - offset - sizeof(block)) / sizeof(posting))
+                break;
+            if (docs[block.doc].deleted)
+                continue;
+            for (k = 0; k < block.count; k++)
+            {
+                struct index_hit *hit;
+                memcpy(&posting, data + offset + sizeof(block) + k * sizeof(posting), sizeof(posting));
+                hit = index_hit_find(&hits, &slots, &used, (uint64_t)block.doc << 32 | posting.message);
+                if (hit == NULL)
+                    break;
+                hit->score += idf * posting.tf * 2.2 / (posting.tf + 1.2 * (0.25 + 0.75 * posting.length / average));
+                hit->matched++;
+            }
+        }
+    }
+
+    /* Messages with more of the words go first */
+    for (i = 0, j = 0; i < slots; i++)
+    {
+        if (hits[i].key == 0)
+            continue;
+        hits[i].score *= (double)hits[i].matched / count;
+        hits[j++] = hits[i];
+    }
+    qsort(hits, j, sizeof(struct index_hit), index_hit_compare);
+    printf("%lu messages found in %.1f ms.\n\n", (unsigned long)j, (now_seconds() - started) * 1000);
+
+    for (i = 0; i < j && (unsigned int)shown < limit; i++)
+    {
+        const struct index_doc *doc = &docs[hits[i].key >> 32];
+        uint32_t number = hits[i].key & 0xFFFFFFFF;
+        char *path, *content, type = 'U';
+        size_t len = 0, n, k, t, found = 0, *starts;
+        uint64_t *words;
+
+        if (doc->path_offset + doc->path_len > data_size)
+            continue;
+        path = arena_strndup(&turn_arena, data + doc->path_offset, doc->path_len);
+        content = session_message(&turn_arena, path, number, &len, &type);
+        printf("%2d. %s, message %u (%s)%s\n", shown + 1, path, number, type == 'A' ? "assistant" : "user",
+               stat(path, &st) != 0 ? ", no longer there" : st.st_mtime != doc->mtime || (uint64_t)st.st_size != doc->size ? ", changed since indexed" : "");
+        paths[shown++] = strdup(path);
+        if (content == NULL)
+        {
+            printf("\n");
+            continue;
+        }
+        words = arena_alloc(&turn_arena, (len / 2 + 1) * sizeof(uint64_t));
+        starts = arena_alloc(&turn_arena, (len / 2 + 1) * sizeof(size_t));
+        n = index_words(content, len, words, starts);
+        for (k = 0; k < n; k++)
+        {
+            for (t = 0; t < count && words[k] != terms[t]; t++)
+                ;
+            if (t < count)
+            {
+                found = starts[k];
+                break;
+            }
+        }
+        index_print_snippet(content, len, found);
+    }
+
+    free(hits);
+    munmap(data, data_size);
+    munmap(docs, docs_count * sizeof(struct index_doc));
+    index_close();
+    return shown;
+}
+
+#define WARM_IDLE 60
+#define WARM_UPKEEP 15
+#define WARM_LIMIT 600
+
+/* Persistent transport context, shared by every request made by the process */
+struct transport
+{
+    CURL *curl;
+    CURL *hedge; /* Second handle for duplicate requests */
+    CURLM *multi;
+    CURLSH *share;
+    unsigned long requests;
+    unsigned long reused;
+    bool last_reused;
+    size_t last_length;  /* Request body of the last request made... */
+    size_t last_sent;    /* ...and how much of it went over the wire */
+    int input_fd;        /* Read while waiting for transfers (-1 for none)... */
+    void (*input)(void); /* ...calling this when there is something to read */
+    CURL *warm;          /* Pre-warming request, see transport_idle() */
+    bool warming;
+    bool rewarm;         /* The endpoint or the API key changed */
+    double last_used;    /* When the last transfer finished, 0 before the first one */
+    double last_upkeep;
+    double warm_saving;  /* Setup time of the connection the last pre-warming opened, until a request uses it */
+    unsigned long warmups;
+    unsigned long warm_used;
+    double warm_saved;
+};
+
+struct transport transport = { NULL, NULL, NULL, NULL, 0, 0, false, 0, 0, -1, NULL, NULL, false, false, 0, 0, 0, 0, 0, 0 };
+
+void transport_cleanup(void)
+{
+    if (transport.warming)
+        curl_multi_remove_handle(transport.multi, transport.warm);
+    if (transport.warm != NULL)
+        curl_easy_cleanup(transport.warm);
+    if (transport.curl != NULL)
+        curl_easy_cleanup(transport.curl);
+    if (transport.hedge != NULL)
+        curl_easy_cleanup(transport.hedge);
+    if (transport.multi != NULL)
+        curl_multi_cleanup(transport.multi);
+    if (transport.share != NULL)
+        curl_share_cleanup(transport.share);
+    transport.curl = NULL;
+    transport.hedge = NULL;
+    transport.warm = NULL;
+    transport.warming = false;
+    transport.multi = NULL;
+    transport.share = NULL;
+    curl_global_cleanup();
+}
+
+int transport_init(void)
+{
+    if (transport.curl != NULL)
+        return 0;
+
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+    {
+        fprintf(stderr, "Error: Could not initialize cURL\n");
+        return -1;
+    }
+
+    /* DNS, connection and TLS session caches survive between turns */
+    transport.share = curl_share_init();
+    if (transport.share != NULL)
+    {
+        curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(transport.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    transport.curl = curl_easy_init();
+    if (!transport.curl)
+    {
+        transport_cleanup();
+        fprintf(stderr, "Error: Could not initialize cURL\n");
+        return -1;
+    }
+
+    atexit(transport_cleanup);
+    srand(time(NULL) ^ getpid());
+    return 0;
+}
+
+/* Multi handle for concurrent transfers, multiplexed over HTTP/2 when the server allows it */
+CURLM *transport_multi(void)
+{
+    if (transport.multi == NULL && (transport.multi = curl_multi_init()) != NULL)
+        curl_multi_setopt(transport.multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    return transport.multi;
+}
+
+/* Wait up to `timeout` ms for the transfers of `multi`, serving the input of the transport meanwhile */
+void transport_poll(CURLM *multi, int timeout)
+{
+    struct curl_waitfd input;
+
+    input.fd = transport.input_fd;
+    input.events = CURL_WAIT_POLLIN;
+    input.revents = 0;
+    curl_multi_poll(multi, &input, transport.input_fd != -1 ? 1 : 0, timeout, NULL);
+    if (input.revents != 0 && transport.input != NULL)
+        transport.input();
+}
+
+CURL *transport_hedge(void)
+{
+    if (transport.hedge == NULL)
+        transport.hedge = curl_easy_init();
+    return transport.hedge;
+}
+
+/* Options every request handle carries, whether it is the shared one or not */
+void transport_setup_handle(CURL *curl)
+{
+    if (transport.share != NULL)
+        curl_easy_setopt(curl, CURLOPT_SHARE, transport.share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 30L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 15L);
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, 300L);
+    curl_easy_setopt(curl, CURLOPT_UPKEEP_INTERVAL_MS, WARM_UPKEEP * 1000L);
+    /* Wait for a connection still being set up (by pre-warming) if the request can share it */
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+}
+
+/* Record whether the transfer that just finished on `curl` had to open a new connection */
+void transport_account(CURL *curl)
+{
+    long new_connections = 0;
+
+    if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &new_connections) != CURLE_OK)
+        new_connections = 1;
+    transport.requests++;
+    transport.last_reused = new_connections == 0 ? true : false;
+    if (transport.last_reused)
+        transport.reused++;
+    transport.last_used = now_seconds();
+    /* A request that found the pre-warmed connection ready did not pay for setting it up */
+    if (transport.warm_saving > 0 && transport.last_reused)
+    {
+        transport.warm_used++;
+        transport.warm_saved += transport.warm_saving;
+    }
+    transport.warm_saving = 0;
+}
+
+/*
+    Connection pre-warming for the shell: while the prompt waits for input, a HEAD request to
+    the endpoint the next request would go to sets up the connection (DNS, TCP, TLS and HTTP/2
+    handshakes), so the request finds it ready. HTTP/2 pings keep it open, and it is set up
+    again after WARM_IDLE seconds without use, until the prompt has waited for WARM_LIMIT.
+*/
+void transport_warm_start(CURLM *multi)
+{
+    struct endpoint *endpoint = pool_pick(NULL);
+
+    if (transport.warm == NULL && (transport.warm = curl_easy_init()) == NULL)
+        return;
+    curl_easy_reset(transport.warm);
+    transport_setup_handle(transport.warm);
+    curl_easy_setopt(transport.warm, CURLOPT_URL, endpoint->url);
+    curl_easy_setopt(transport.warm, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(transport.warm, CURLOPT_CONNECTTIMEOUT_MS, (long)(policy.connect_timeout * 1000));
+    curl_easy_setopt(transport.warm, CURLOPT_TIMEOUT, 30L);
+    curl_multi_add_handle(multi, transport.warm);
+    transport.warming = true;
+    transport.rewarm = false;
+}
+
+/* Finish the pre-warming request; call it when the multi handle reports it done */
+void transport_warm_done(CURLcode code)
+{
+    curl_off_t setup = 0;
+    long new_connections = 0;
+
+    curl_multi_remove_handle(transport.multi, transport.warm);
+    transport.warming = false;
+    transport.last_used = now_seconds();
+    if (code != CURLE_OK)
+        return;
+    curl_easy_getinfo(transport.warm, CURLINFO_NUM_CONNECTS, &new_connections);
+    if (new_connections == 0)
+        return;
+    transport.warmups++;
+    if (curl_easy_getinfo(transport.warm, CURLINFO_APPCONNECT_TIME_T, &setup) != CURLE_OK || setup == 0)
+        curl_easy_getinfo(transport.warm, CURLINFO_CONNECT_TIME_T, &setup);
+    transport.warm_saving = setup / 1e6;
+}
+
+/*
+    Wait for `fd` to be readable (returns 1) or for Ctrl+C (returns 0), keeping the connection
+    warm meanwhile; `since` is when the prompt appeared. -1 on error.
+*/
+int transport_idle(int fd, double since)
+{
+    struct curl_waitfd input;
+    struct pollfd plain;
+    CURLM *multi;
+    CURLMsg *msg;
+    int running, queued;
+
+    if (transport_init() != 0 || (multi = transport_multi()) == NULL)
+    {
+        plain.fd = fd;
+        plain.events = POLLIN;
+        plain.revents = 0;
+        if (poll(&plain, 1, -1) < 0 && errno != EINTR)
+            return -1;
+        return plain.revents != 0 ? 1 : 0;
+    }
+
+    while (!interrupted)
+    {
+        double now = now_seconds();
+        if (!transport.warming && now - since < WARM_LIMIT &&
+            (transport.rewarm || transport.last_used == 0 || now - transport.last_used >= WARM_IDLE))
+            transport_warm_start(multi);
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL)
+        {
+            if (msg->msg == CURLMSG_DONE && msg->easy_handle == transport.warm)
+                transport_warm_done(msg->data.result);
+        }
+        if (transport.warm != NULL && now - transport.last_upkeep >= WARM_UPKEEP)
+        {
+            curl_easy_upkeep(transport.warm);
+            transport.last_upkeep = now;
+        }
+
+        input.fd = fd;
+        input.events = CURL_WAIT_POLLIN;
+        input.revents = 0;
+        if (curl_multi_poll(multi, &input, 1, transport.warming ? 100 : WARM_UPKEEP * 1000, NULL) != CURLM_OK)
+            return -1;
+        if (input.revents != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+    Request instrumentation. Every phase keeps its last METRICS_WINDOW samples (in microseconds)
+    in a ring, together with a log-scaled histogram of them (4 buckets per power of two, so
+    percentiles are within 12.5%) that percentiles are read from.
+*/
+#define METRICS_WINDOW 1024
+#define METRICS_BUCKETS 124
+
+enum metrics_phase
+{
+    PHASE_DNS,
+    PHASE_CONNECT,
+    PHASE_TLS,
+    PHASE_FIRST_BYTE,
+    PHASE_TOTAL,
+    PHASE_PARSE,
+    PHASE_COUNT
+};
+
+const char *phase_names[] = { "dns", "connect", "tls", "first_byte", "total", "parse" };
+
+struct histogram
+{
+    uint32_t samples[METRICS_WINDOW];
+    size_t next;  /* Ring position of the oldest sample once full */
+    size_t count; /* Samples in the window */
+    uint32_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics
+{
+    struct histogram phases[PHASE_COUNT];
+    unsigned long requests;
+    unsigned long failed;
+    unsigned long connections;
+    unsigned long long bytes_up;
+    unsigned long long bytes_down;
+    unsigned long retries;
+    unsigned long hedges;     /* Duplicate requests sent... */
+    unsigned long hedge_wins; /* ...and how many of them answered first */
+    char *json_path;          /* --metrics-json */
+};
+
+struct metrics metrics;
+
+unsigned int histogram_bucket(uint32_t value)
+{
+    unsigned int e = 0;
+
+    if (value < 4)
+        return value;
+    while ((value >> e) > 1)
+        e++;
+    return (e - 1) * 4 + ((value >> (e - 2)) & 3);
+}
+
+/* Middle of the range bucket `b` covers */
+double histogram_value(unsigned int b)
+{
+    unsigned int e = b / 4 + 1;
+
+    if (b < 4)
+        return b;
+    return (double)((4 + b % 4) << (e - 2)) + (double)(1U << (e - 2)) / 2;
+}
+
+void histogram_add(struct histogram *h, double value)
+{
+    uint32_t v = value < 0 ? 0 : value > 4e9 ? 4000000000U : (uint32_t)value;
+
+    if (h->count == METRICS_WINDOW)
+        h->buckets[histogram_bucket(h->samples[h->next])]--;
+    else
+        h->count++;
+    h->samples[h->next] = v;
+    h->next = (h->next + 1) % METRICS_WINDOW;
+    h->buckets[histogram_bucket(v)]++;
+}
+
+/* Value below which a fraction `p` of the `count` values counted in `buckets` falls */
+double buckets_percentile(const uint32_t *buckets, unsigned long count, double p)
+{
+    unsigned long rank = (unsigned long)(p * count + 0.5), seen = 0;
+    unsigned int b;
+
+    if (count == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < METRICS_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen >= rank)
+            return histogram_value(b);
+    }
+    return histogram_value(METRICS_BUCKETS - 1);
+}
+
+/* Value below which a fraction `p` of the window falls, in microseconds */
+double histogram_percentile(const struct histogram *h, double p)
+{
+    return buckets_percentile(h->buckets, h->count, p);
+}
+
+/*
+    Account the traffic and phase durations of a finished transfer, from cURL's timers plus our
+    own parse time; the losing copy of a hedged request only counts here
+*/
+void metrics_phases(CURL *curl, const struct response *resp)
+{
+    curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0, total = 0, up = 0, down = 0;
+    long connections = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &up);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connections);
+
+    metrics.bytes_up += up;
+    metrics.bytes_down += down;
+    /* A reused connection skips these phases, they only describe new connections */
+    if (connections > 0)
+    {
+        metrics.connections += connections;
+        histogram_add(&metrics.phases[PHASE_DNS], dns);
+        histogram_add(&metrics.phases[PHASE_CONNECT], connect - dns);
+        if (tls > 0)
+            histogram_add(&metrics.phases[PHASE_TLS], tls - connect);
+    }
+    /* With the body sent from a read callback cURL's first byte time is when the upload starts */
+    if (resp != NULL && resp->first_byte_at > 0)
+        first_byte = (resp->first_byte_at - resp->started) * 1e6;
+    if (first_byte > 0)
+        histogram_add(&metrics.phases[PHASE_FIRST_BYTE], first_byte);
+    histogram_add(&metrics.phases[PHASE_TOTAL], total);
+    if (resp != NULL)
+        histogram_add(&metrics.phases[PHASE_PARSE], resp->parse_time * 1e6);
+}
+
+/* Account a finished request */
+void metrics_record(CURL *curl, const struct response *resp, bool ok)
+{
+    metrics.requests++;
+    metrics.failed += ok ? 0 : 1;
+    metrics_phases(curl, resp);
+}
+
+/* Which phase a failed transfer on `curl` stopped in */
+const char *transfer_stage(CURL *curl)
+{
+    curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0;
+    char *scheme = NULL;
+
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_SCHEME, &scheme);
+    if (dns == 0 && connect == 0)
+        return "while resolving the host name";
+    if (connect == 0)
+        return "while connecting";
+    if (tls == 0 && scheme != NULL && strcasecmp(scheme, "https") == 0)
+        return "during the TLS handshake";
+    if (first_byte == 0)
+        return "while waiting for the server to answer";
+    return "while receiving the answer";
+}
+
+void metrics_print(void)
+{
+    unsigned int i;
+
+    printf("-- %lu requests (%lu failed), %lu retries, %lu hedged (%lu won), %lu new connections, %.1f KB sent, %.1f KB received --\n",
+           metrics.requests, metrics.failed, metrics.retries, metrics.hedges, metrics.hedge_wins, metrics.connections,
+           metrics.bytes_up / 1024.0, metrics.bytes_down / 1024.0);
+    printf("  phase         samples       p50       p90       p99\n");
+    for (i = 0; i < PHASE_COUNT; i++)
+    {
+        const struct histogram *h = &metrics.phases[i];
+        printf("  %-12s %8lu %7.1f ms %7.1f ms %7.1f ms\n", phase_names[i], (unsigned long)h->count,
+               histogram_percentile(h, 0.50) / 1000, histogram_percentile(h, 0.90) / 1000, histogram_percentile(h, 0.99) / 1000);
+    }
+    printf("  (dns, connect and tls only count new connections; the last %d samples of every phase are kept)\n", METRICS_WINDOW);
+    if (transport.warmups > 0)
+        printf("  %lu connections pre-warmed while typing, %lu used by a request, saving %.1f ms per turn (%.1f ms in total)\n",
+               transport.warmups, transport.warm_used, transport.warm_used > 0 ? transport.warm_saved * 1000 / transport.warm_used : 0.0,
+               transport.warm_saved * 1000);
+}
+
+/* Write the metrics to the --metrics-json file if one was given; returns `status` for convenience */
+int metrics_finish(int status)
+{
+    unsigned int i;
+    FILE *fp;
+
+    if (metrics.json_path == NULL)
+        return status;
+    if ((fp = fopen(metrics.json_path, "w")) == NULL)
+    {
+        fprintf(stderr, "Error: cannot write metrics to '%s'.\n", metrics.json_path);
+        return status;
+    }
+    fprintf(fp, "{\"requests\": %lu, \"failed\": %lu, \"retries\": %lu, \"hedges\": %lu, \"hedge_wins\": %lu, \"new_connections\": %lu, "
+            "\"bytes_up\": %llu, \"bytes_down\": %llu, \"prewarmed\": %lu, \"prewarmed_used\": %lu, \"prewarm_saved_ms\": %.3f, \"phases\": {",
+            metrics.requests, metrics.failed, metrics.retries, metrics.hedges, metrics.hedge_wins, metrics.connections,
+            metrics.bytes_up, metrics.bytes_down, transport.warmups, transport.warm_used, transport.warm_saved * 1000);
+    for (i = 0; i < PHASE_COUNT; i++)
+    {
+        const struct histogram *h = &metrics.phases[i];
+        fprintf(fp, "%s\"%s\": {\"samples\": %lu, \"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f}", i > 0 ? ", " : "",
+                phase_names[i], (unsigned long)h->count, histogram_percentile(h, 0.50) / 1000,
+                histogram_percentile(h, 0.90) / 1000, histogram_percentile(h, 0.99) / 1000);
+    }
+    fprintf(fp, "}}\n");
+    fclose(fp);
+    return status;
+}
+
+/*
+    Usage ledger: every request is appended to ~/.chatgpt-client-usage as a fixed-size record,
+    with one write() that needs no locking. Model and endpoint names are kept as hashes, whose
+    names are written once to ~/.chatgpt-client-usage-names. Reports map the ledger and scan it.
+*/
+#define USAGE_MAGIC "CGPTUSG1"
+#define USAGE_CACHED 1 /* Answered from the response cache */
+#define USAGE_FAILED 2
+
+struct usage_record
+{
+    int64_t time; /* Unix time */
+    uint64_t model;
+    uint64_t endpoint; /* 0 for cached answers */
+    uint32_t prompt_tokens;
+    uint32_t completion_tokens;
+    uint32_t latency; /* Microseconds */
+    uint32_t flags;
+};
+
+struct usage_ledger
+{
+    char *path;
+    char *names_path;
+    int fd;       /* -1 until opened, -2 if it cannot be */
+    int names_fd;
+    uint64_t *known; /* Hashes found in the names file */
+    size_t known_count;
+    size_t known_capacity;
+    off_t names_read; /* Bytes of the names file already parsed */
+};
+
+struct usage_ledger ledger = { NULL, NULL, -1, -1, NULL, 0, 0, 0 };
+
+uint64_t usage_hash(const char *name)
+{
+    struct hasher h;
+    uint64_t out[2];
+
+    hasher_init(&h);
+    hasher_update(&h, name, strlen(name));
+    hasher_final(&h, out);
+    return out[0] != 0 ? out[0] : 1;
+}
+
+int usage_open(void)
+{
+    struct stat st;
+
+    if (ledger.fd != -1)
+        return ledger.fd >= 0 ? 0 : -1;
+    ledger.fd = -2;
+    if (ledger.path == NULL)
+        return -1;
+    int fd = open(ledger.path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd < 0)
+        return -1;
+    if ((ledger.names_fd = open(ledger.names_path, O_RDWR | O_APPEND | O_CREAT, 0600)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    /* Whoever creates the ledger writes its magic before anyone appends records */
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && write(fd, USAGE_MAGIC, 8) != 8))
+    {
+        flock(fd, LOCK_UN);
+        close(fd);
+        close(ledger.names_fd);
+        return -1;
+    }
+    flock(fd, LOCK_UN);
+    ledger.fd = fd;
+    return 0;
+}
+
+bool usage_known(uint64_t hash)
+{
+    size_t i;
+
+    for (i = 0; i < ledger.known_count; i++)
+    {
+        if (ledger.known[i] == hash)
+            return true;
+    }
+    return false;
+}
+
+/* Hash of `name`, adding it to the names file if it is not there yet */
+uint64_t usage_name(const char *name)
+{
+    uint64_t hash = usage_hash(name);
+    char buffer[4096];
+    ssize_t n;
+
+    if (usage_known(hash))
+        return hash;
+    flock(ledger.names_fd, LOCK_EX);
+    /* Pick up the names other processes added since last time */
+    while ((n = pread(ledger.names_fd, buffer, sizeof(buffer) - 1, ledger.names_read)) > 0)
+    {
+        char *line = buffer, *end;
+        buffer[n] = '\0';
+        while ((end = strchr(line, '\n')) != NULL)
+        {
+            if (ledger.known_count == ledger.known_capacity)
+            {
+                ledger.known_capacity = ledger.known_capacity ? ledger.known_capacity * 2 : 64;
+                ledger.known = realloc(ledger.known, ledger.known_capacity * sizeof(uint64_t));
+            }
+            ledger.known[ledger.known_count++] = strtoull(line, NULL, 16);
+            line = end + 1;
+        }
+        if (line == buffer)
+            break; /* A line longer than the buffer: not ours */
+        ledger.names_read += line - buffer;
+    }
+    if (!usage_known(hash))
+    {
+        char *entry = arena_alloc(&turn_arena, strlen(name) + 19);
+        sprintf(entry, "%016llx %s\n", (unsigned long long)hash, name);
+        if (write(ledger.names_fd, entry, strlen(entry)) > 0)
+            ledger.names_read += strlen(entry);
+        if (ledger.known_count == ledger.known_capacity)
+        {
+            ledger.known_capacity = ledger.known_capacity ? ledger.known_capacity * 2 : 64;
+            ledger.known = realloc(ledger.known, ledger.known_capacity * sizeof(uint64_t));
+        }
+        ledger.known[ledger.known_count++] = hash;
+    }
+    flock(ledger.names_fd, LOCK_UN);
+    return hash;
+}
+
+/* Append a request to the ledger: `resp` gives the tokens (NULL if there are none), `endpoint` is NULL for cached answers */
+void usage_log(const char *model, const struct endpoint *endpoint, const struct response *resp, double latency, uint32_t flags)
+{
+    struct usage_record r;
+
+    if (usage_open() != 0)
+        return;
+    r.time = time(NULL);
+    r.model = usage_name(model);
+    r.endpoint = endpoint != NULL ? usage_name(endpoint->url) : 0;
+    r.prompt_tokens = resp != NULL && resp->prompt_tokens > 0 ? resp->prompt_tokens : 0;
+    r.completion_tokens = resp != NULL && resp->completion_tokens > 0 ? resp->completion_tokens : 0;
+    r.latency = latency <= 0 ? 0 : latency >= 4000 ? 4000000000U : (uint32_t)(latency * 1e6);
+    r.flags = flags;
+    if (write(ledger.fd, &r, sizeof(r)) != sizeof(r))
+        fprintf(stderr, "Warning: could not write to the usage ledger %s.\n", ledger.path);
+}
+
+enum usage_grouping
+{
+    BY_DAY,
+    BY_MODEL,
+    BY_ENDPOINT
+};
+
+struct usage_group
+{
+    uint64_t key; /* YYYYMMDD, or the name hash */
+    unsigned long requests;
+    unsigned long cached;
+    unsigned long failed;
+    unsigned long long prompt_tokens;
+    unsigned long long completion_tokens;
+    unsigned long timed; /* Requests counted in `latency` */
+    uint32_t latency[METRICS_BUCKETS];
+};
+
+struct usage_groups
+{
+    struct usage_group *groups;
+    size_t count;
+    size_t capacity;
+    uint32_t *slots; /* Open addressing over `groups`, index + 1 (0 is empty) */
+    size_t slot_count;
+};
+
+struct usage_group *usage_group_find(struct usage_groups *t, uint64_t key)
+{
+    size_t i;
+
+    if (t->count * 2 >= t->slot_count)
+    {
+        t->slot_count = t->slot_count ? t->slot_count * 2 : 256;
+        free(t->slots);
+        t->slots = calloc(t->slot_count, sizeof(uint32_t));
+        for (i = 0; i < t->count; i++)
+        {
+            size_t s = mix64(t->groups[i].key) & (t->slot_count - 1);
+            while (t->slots[s] != 0)
+                s = (s + 1) & (t->slot_count - 1);
+            t->slots[s] = i + 1;
+        }
+    }
+    for (i = mix64(key) & (t->slot_count - 1); t->slots[i] != 0; i = (i + 1) & (t->slot_count - 1))
+    {
+        if (t->groups[t->slots[i] - 1].key == key)
+            return &t->groups[t->slots[i] - 1];
+    }
+    if (t->count == t->capacity)
+    {
+        t->capacity = t->capacity ? t->capacity * 2 : 64;
+        t->groups = realloc(t->groups, t->capacity * sizeof(struct usage_group));
+    }
+    memset(&t->groups[t->count], 0, sizeof(struct usage_group));
+    t->groups[t->count].key = key;
+    t->slots[i] = ++t->count;
+    return &t->groups[t->count - 1];
+}
+
+int usage_group_compare_key(const void *a, const void *b)
+{
+    const struct usage_group *x = a, *y = b;
+    return x->key < y->key ? -1 : x->key > y->key ? 1 : 0;
+}
+
+int usage_group_compare_tokens(const void *a, const void *b)
+{
+    const struct usage_group *x = a, *y = b;
+    unsigned long long tx = x->prompt_tokens + x->completion_tokens, ty = y->prompt_tokens + y->completion_tokens;
+    if (tx != ty)
+        return tx > ty ? -1 : 1;
+    return x->requests > y->requests ? -1 : x->requests < y->requests ? 1 : 0;
+}
+
+/* Name of the `hash` in the names file contents `names`, or NULL */
+const char *usage_lookup_name(struct arena *a, const char *names, uint64_t hash)
+{
+    char prefix[18];
+    const char *at = names;
+
+    sprintf(prefix, "%016llx ", (unsigned long long)hash);
+    while ((at = strstr(at, prefix)) != NULL)
+    {
+        if (at == names || at[-1] == '\n')
+        {
+            const char *end = strchr(at, '\n');
+            return arena_strndup(a, at + 17, end != NULL ? (size_t)(end - at - 17) : strlen(at + 17));
+        }
+        at++;
+    }
+    return NULL;
+}
+
+void usage_print_group(const char *label, int width, const struct usage_group *g)
+{
+    printf("  %-*s %9lu %8lu %7lu %12llu %11llu %9.1f %9.1f\n", width, label, g->requests, g->cached, g->failed,
+           g->prompt_tokens, g->completion_tokens, buckets_percentile(g->latency, g->timed, 0.50) / 1000,
+           buckets_percentile(g->latency, g->timed, 0.99) / 1000);
+}
+
+/* Print the ledger totals per day, model or endpoint */
+int usage_report(enum usage_grouping grouping)
+{
+    struct usage_groups t = { NULL, 0, 0, NULL, 0 };
+    struct usage_group total, *g = NULL;
+    const struct usage_record *r, *end;
+    struct string names;
+    struct stat st;
+    time_t day_start = 0, day_end = 0;
+    uint64_t day = 0;
+    double started = now_seconds();
+    char buffer[4096], **labels;
+    int fd, width = 10;
+    size_t n, i;
+    void *map;
+    FILE *fp;
+
+    if (ledger.path == NULL || (fd = open(ledger.path, O_RDONLY)) < 0)
+    {
+        printf("No usage has been recorded yet.\n");
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < 8)
+    {
+        close(fd);
+        printf("No usage has been recorded yet.\n");
+        return 0;
+    }
+    if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED || memcmp(map, USAGE_MAGIC, 8) != 0)
+    {
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        close(fd);
+        fprintf(stderr, "Error: %s is not a usage ledger.\n", ledger.path);
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    memset(&total, 0, sizeof(total));
+    r = (const struct usage_record *)((const char *)map + 8);
+    end = r + (st.st_size - 8) / sizeof(struct usage_record);
+    for (; r < end; r++)
+    {
+        uint64_t key = r->model;
+        if (grouping == BY_ENDPOINT)
+            key = r->endpoint;
+        else if (grouping == BY_DAY)
+        {
+            /* Records come mostly in order, localtime() only runs when the day changes */
+            if (r->time < day_start || r->time >= day_end)
+            {
+                time_t t0 = r->time;
+                struct tm tm;
+                localtime_r(&t0, &tm);
+                day = (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+                tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+                tm.tm_isdst = -1;
+                day_start = mktime(&tm);
+                tm.tm_mday++;
+                tm.tm_isdst = -1;
+                day_end = mktime(&tm);
+            }
+            key = day;
+        }
+        if (g == NULL || g->key != key)
+            g = usage_group_find(&t, key);
+        g->requests++;
+        g->prompt_tokens += r->prompt_tokens;
+        g->completion_tokens += r->completion_tokens;
+        if (r->flags & USAGE_CACHED)
+            g->cached++;
+        else if (r->flags & USAGE_FAILED)
+            g->failed++;
+        else
+        {
+            g->timed++;
+            g->latency[histogram_bucket(r->latency)]++;
+        }
+    }
+    munmap(map, st.st_size);
+    close(fd);
+
+    for (i = 0; i < t.count; i++)
+    {
+        unsigned int b;
+        total.requests += t.groups[i].requests;
+        total.cached += t.groups[i].cached;
+        total.failed += t.groups[i].failed;
+        total.prompt_tokens += t.groups[i].prompt_tokens;
+        total.completion_tokens += t.groups[i].completion_tokens;
+        total.timed += t.groups[i].timed;
+        for (b = 0; b < METRICS_BUCKETS; b++)
+            total.latency[b] += t.groups[i].latency[b];
+    }
+    qsort(t.groups, t.count, sizeof(struct usage_group), grouping == BY_DAY ? usage_group_compare_key : usage_group_compare_tokens);
+
+    /* Labels; the names file is only needed when grouping by name */
+    init_string_arena(&names, &turn_arena);
+    if (grouping != BY_DAY && (fp = fopen(ledger.names_path, "r")) != NULL)
+    {
+        while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+            append_string(&names, buffer, n);
+        fclose(fp);
+    }
+    labels = arena_alloc(&turn_arena, (t.count + 1) * sizeof(char *));
+    for (i = 0; i < t.count; i++)
+    {
+        uint64_t key = t.groups[i].key;
+        if (grouping == BY_DAY)
+        {
+            labels[i] = arena_alloc(&turn_arena, 16);
+            sprintf(labels[i], "%04u-%02u-%02u", (unsigned int)(key / 10000), (unsigned int)(key / 100 % 100), (unsigned int)(key % 100));
+        }
+        else if (key == 0)
+            labels[i] = "(cache)";
+        else if ((labels[i] = (char *)usage_lookup_name(&turn_arena, names.ptr, key)) == NULL)
+            labels[i] = "(unknown)";
+        if ((int)strlen(labels[i]) > width)
+            width = strlen(labels[i]);
+    }
+
+    printf("-- Usage by %s: %lu requests, %llu tokens, scanned in %.1f ms --\n",
+           grouping == BY_DAY ? "day" : grouping == BY_MODEL ? "model" : "endpoint", total.requests,
+           total.prompt_tokens + total.completion_tokens, (now_seconds() - started) * 1000);
+    printf("  %-*s %9s %8s %7s %12s %11s %9s %9s\n", width, grouping == BY_DAY ? "day" : grouping == BY_MODEL ? "model" : "endpoint",
+           "requests", "cached", "failed", "prompt", "completion", "p50 ms", "p99 ms");
+    for (i = 0; i < t.count; i++)
+        usage_print_group(labels[i], width, &t.groups[i]);
+    if (t.count > 1)
+        usage_print_group("total", width, &total);
+    free(t.groups);
+    free(t.slots);
+    return 0;
+}
+
+/* Grouping named `name` (day, model or endpoint, day if empty); -1 if it is not one of them */
+int usage_grouping(const char *name)
+{
+    if (name == NULL || name[0] == '\0' || strcmp(name, "day") == 0)
+        return BY_DAY;
+    if (strcmp(name, "model") == 0)
+        return BY_MODEL;
+    if (strcmp(name, "endpoint") == 0)
+        return BY_ENDPOINT;
+    fprintf(stderr, "Error: usage can be grouped by day, model or endpoint.\n");
+    return -1;
+}
+
+/*
+    Prepare `curl` to POST `body` to `endpoint` (with its own API key, else `apikey`) and feed
+    the answer to `resp`. The returned header list must be kept until the transfer is over and
+    then freed with curl_slist_free_all().
+*/
+struct curl_slist *transfer_setup(CURL *curl, struct request_body *body, struct response *resp, const char *apikey, struct endpoint *endpoint)
+{
+    struct curl_slist *headers = NULL;
+    char *auth_header = arena_concat(body->arena, "Authorization: Bearer ", endpoint->apikey != NULL ? endpoint->apikey : apikey);
+    curl_easy_setopt(curl, CURLOPT_URL, endpoint->url);
+
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+    headers = curl_slist_append(headers, auth_header);
+    /* The body comes from a read callback, avoid waiting for a "100 Continue" */
+    headers = curl_slist_append(headers, "Expect:");
+    if (!compress_requests || body->length < COMPRESS_MIN || endpoint->compression != COMPRESSION_ACCEPTED)
+        body->packed = NULL;
+    else if (body->packed == NULL)
+        request_body_compress(body);
+    if (body->packed != NULL)
+        headers = curl_slist_append(headers, "Content-Encoding: gzip");
+
+    transport_setup_handle(curl);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, request_body_read);
+    curl_easy_setopt(curl, CURLOPT_READDATA, body);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, request_body_seek);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)(body->packed != NULL ? body->packed_len : body->length));
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, response_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, response_progress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, resp);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)(policy.connect_timeout * 1000));
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, policy.total_timeout);
+
+    return headers;
+}
+
+/*
+    Servers that do not take compressed bodies answer 415, or 400 as they cannot parse them.
+    Then requests to `endpoint` are sent uncompressed, and if one of them goes through the
+    endpoint is never sent compressed ones again; if it fails the same way, the compression was
+    not the problem. Returns true when the transfer has to be repeated uncompressed.
+*/
+bool compression_refused(CURL *curl, CURLcode code, const struct request_body *body, struct endpoint *endpoint)
+{
+    long http_code = 0;
+
+    if (code != CURLE_OK)
+        return false;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (body->packed == NULL)
+    {
+        if (endpoint->compression == COMPRESSION_PROBING && http_code >= 200 && http_code < 300)
+            endpoint->compression = COMPRESSION_REJECTED;
+        else if (endpoint->compression == COMPRESSION_PROBING && (http_code == 400 || http_code == 415))
+            endpoint->compression = COMPRESSION_ACCEPTED;
+        return false;
+    }
+    if (http_code != 400 && http_code != 415)
+        return false;
+    endpoint->compression = COMPRESSION_PROBING;
+    return true;
+}
+
+/* Whether a failed transfer is worth repeating; `*retry_after` gets the delay the server asked for */
+bool transfer_retryable(CURL *curl, CURLcode code, const struct response *resp, double *retry_after)
+{
+    long http_code = 0;
+    curl_off_t after = 0;
+
+    *retry_after = 0;
+    /* Part of the answer is already on the screen */
+    if (resp->echo && resp->content.len > 0)
+        return false;
+    switch (code)
+    {
+    case CURLE_OK:
+        break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_ABORTED_BY_CALLBACK:
+        return true;
+    default:
+        return false;
+    }
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 408 && http_code != 429 && (http_code < 500 || http_code == 501))
+        return false;
+    /* A 429 for an exhausted quota will not go away by waiting */
+    if (http_code == 429 && resp->raw.ptr != NULL && strstr(resp->raw.ptr, "insufficient_quota") != NULL)
+        return false;
+    if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &after) == CURLE_OK && after > 0)
+        *retry_after = after;
+    return true;
+}
+
+/* Jittered exponential backoff before retry number `attempt` (from 0), at least `retry_after` */
+double backoff_delay(unsigned int attempt, double retry_after)
+{
+    double cap = attempt < 4 ? 0.5 * (1 << attempt) : 8.0;
+    double delay = cap / 2 + cap / 2 * ((double)rand() / RAND_MAX);
+
+    return retry_after > delay ? retry_after : delay;
+}
+
+/* When to send a duplicate: past the usual p95 time to first byte, once there are enough samples */
+double hedge_delay(void)
+{
+    const struct histogram *h = &metrics.phases[PHASE_FIRST_BYTE];
+    double delay;
+
+    if (!policy.hedge || h->count < 20)
+        return 0;
+    delay = histogram_percentile(h, 0.95) / 1e6;
+    return delay < 0.2 ? 0.2 : delay;
+}
+
+/* Describe a failed transfer; `resp` tells whether one of our own deadlines stopped it */
+char *transfer_error(struct arena *a, CURL *curl, CURLcode code, const struct response *resp)
+{
+    long http_code = 0;
+    char *message = arena_alloc(a, 256);
+
+    if (code == CURLE_OK)
+    {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        snprintf(message, 256, "The API answered with HTTP %ld.", http_code);
+    }
+    else
+        snprintf(message, 256, "HTTP request failed %s: %s.", transfer_stage(curl),
+                 code == CURLE_ABORTED_BY_CALLBACK && resp->timed_out != NULL ? resp->timed_out : curl_easy_strerror(code));
+    return message;
+}
+
+/* Whether a finished transfer tells that its endpoint is in trouble, rather than the request */
+bool transfer_failed(CURL *curl, CURLcode code)
+{
+    long http_code = 0;
+
+    if (code != CURLE_OK)
+        return true;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    return http_code == 408 || http_code == 429 || http_code >= 500 ? true : false;
+}
+
+/* Report to the pool how a transfer to `endpoint` went; `done` is false if it was cancelled */
+void endpoint_report(struct endpoint *endpoint, CURL *curl, CURLcode code, const struct response *resp, bool done)
+{
+    if (!done)
+        pool_end(endpoint, false, -1);
+    else
+        pool_end(endpoint, transfer_failed(curl, code), resp->first_byte_at > 0 ? resp->first_byte_at - resp->started : -1);
+}
+
+/* One copy of a request in flight */
+struct transfer_try
+{
+    CURL *curl;
+    struct request_body body; /* Own read position over the shared pieces */
+    struct response resp;
+    struct curl_slist *headers;
+    struct endpoint *endpoint;
+    CURLcode code;
+    bool done;
+};
+
+void transfer_try_start(struct transfer_try *t, CURL *curl, CURLM *multi, const struct request_body *body, const char *apikey,
+                        struct endpoint *endpoint, bool stream, struct response **race)
+{
+    t->curl = curl;
+    t->endpoint = endpoint;
+    t->body = *body;
+    t->body.segment = 0;
+    t->body.offset = 0;
+    response_init(&t->resp, &turn_arena, curl, stream, true);
+    t->resp.quiet = true;
+    t->resp.race = race;
+    t->headers = transfer_setup(curl, &t->body, &t->resp, apikey, endpoint);
+    t->code = CURLE_OK;
+    t->done = false;
+    pool_begin(endpoint);
+    curl_multi_add_handle(multi, curl);
+}
+
+/*
+    Send `body` to the best endpoint of the pool; the returned reply lives in the turn arena.
+    Failures worth it are retried with backoff, and with hedging enabled a request slower than
+    usual to start answering gets a duplicate (on another endpoint if there is one): whichever
+    answers first is used and the other one is cancelled. Ctrl+C in the shell cancels it all.
+*/
+char *chatgpt_curl_perform(struct request_body *body, const char *apikey, bool stream)
+{
+    struct endpoint *failed = NULL;
+    unsigned int attempt;
+    double retry_at;
+    bool refused = false; /* Compressed body refused: sent again uncompressed, not a retry */
+    CURLM *multi;
+
+    if (transport_init() != 0 || (multi = transport_multi()) == NULL)
+        return NULL;
+
+    interrupted = 0;
+    for (attempt = 0;; attempt += refused ? 0 : 1)
+    {
+        struct transfer_try tries[2], *t;
+        struct response *winner = NULL;
+        double hedge_after = hedge_delay(), retry_after;
+        unsigned int started = 1, finished = 0, i;
+        long http_code = 0;
+        char *result = NULL;
+        int running;
+
+        transfer_try_start(&tries[0], transport.curl, multi, body, apikey, pool_pick(failed), stream, &winner);
+        while (finished < started)
+        {
+            CURLMsg *msg;
+            int queued, timeout = 1000;
+
+            curl_multi_perform(multi, &running);
+            while ((msg = curl_multi_info_read(multi, &queued)) != NULL)
+            {
+                if (msg->msg != CURLMSG_DONE)
+                    continue;
+                if (msg->easy_handle == transport.warm)
+                {
+                    transport_warm_done(msg->data.result);
+                    continue;
+                }
+                t = msg->easy_handle == tries[0].curl ? &tries[0] : &tries[1];
+                t->code = msg->data.result;
+                t->done = true;
+                curl_multi_remove_handle(multi, t->curl);
+                finished++;
+            }
+            if (interrupted || (winner != NULL && (winner == &tries[0].resp ? tries[0].done : tries[1].done)))
+                break;
+
+            if (started == 1 && hedge_after > 0 && winner == NULL && !tries[0].done && transport_hedge() != NULL)
+            {
+                double wait = hedge_after - (now_seconds() - tries[0].resp.started);
+                if (wait <= 0)
+                {
+                    transfer_try_start(&tries[1], transport.hedge, multi, body, apikey, pool_pick(tries[0].endpoint), stream, &winner);
+                    started = 2;
+                    metrics.hedges++;
+                }
+                else if (wait * 1000 < timeout)
+                    timeout = wait * 1000 + 1;
+            }
+            if (finished < started)
+                transport_poll(multi, timeout);
+        }
+
+        /* The copy that answered, else one that completed, else the original */
+        t = &tries[0];
+        if (winner != NULL)
+            t = winner == &tries[0].resp ? &tries[0] : &tries[1];
+        else if (started == 2 && tries[0].code != CURLE_OK && tries[1].done && tries[1].code == CURLE_OK)
+            t = &tries[1];
+        if (t == &tries[1] && winner != NULL)
+            metrics.hedge_wins++;
+
+        for (i = 0; i < started; i++)
+        {
+            if (!tries[i].done)
+                curl_multi_remove_handle(multi, tries[i].curl);
+            endpoint_report(tries[i].endpoint, tries[i].curl, tries[i].code, &tries[i].resp, tries[i].done);
+            curl_easy_setopt(tries[i].curl, CURLOPT_HTTPHEADER, NULL);
+            curl_slist_free_all(tries[i].headers);
+            if (&tries[i] != t && tries[i].done)
+                metrics_phases(tries[i].curl, tries[i].code == CURLE_OK ? &tries[i].resp : NULL);
+        }
+        if (interrupted)
+            break;
+
+        if (t->code == CURLE_OK)
+        {
+            transport_account(t->curl);
+            curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &http_code);
+            result = response_finish(&t->resp, http_code);
+        }
+        /* The refused copy only probed the endpoint, it is not a failed request */
+        if ((refused = compression_refused(t->curl, t->code, &t->body, t->endpoint)))
+        {
+            metrics_phases(t->curl, t->code == CURLE_OK ? &t->resp : NULL);
+            continue;
+        }
+        metrics_record(t->curl, t->code == CURLE_OK ? &t->resp : NULL, result != NULL ? true : false);
+        usage_log(body->model, t->endpoint, t->code == CURLE_OK ? &t->resp : NULL, now_seconds() - t->resp.started,
+                  result != NULL ? 0 : USAGE_FAILED);
+        if (result != NULL)
+        {
+            transport.last_length = t->body.length;
+            transport.last_sent = t->body.packed != NULL ? t->body.packed_len : t->body.length;
+            return result;
+        }
+
+        if (attempt >= policy.retries || !transfer_retryable(t->curl, t->code, &t->resp, &retry_after) || retry_after > 60)
+        {
+            if (t->code == CURLE_OK)
+                response_report(&t->resp);
+            else
+                fprintf(stderr, "%s\n", transfer_error(&turn_arena, t->curl, t->code, &t->resp));
+            return NULL;
+        }
+        retry_after = backoff_delay(attempt, retry_after);
+        fprintf(stderr, "%s Retrying in %.1f s...\n", transfer_error(&turn_arena, t->curl, t->code, &t->resp), retry_after);
+        metrics.retries++;
+        failed = t->endpoint;
+        retry_at = now_seconds() + retry_after;
+        while (!interrupted && now_seconds() < retry_at)
+            transport_poll(multi, (retry_at - now_seconds()) * 1000 + 1);
+        if (interrupted)
+            break;
+    }
+
+    interrupted = 0;
+    fprintf(stderr, "%sRequest cancelled.\n", stream ? "\n" : "");
+    return NULL;
+}
+
+/*
+    Model comparison: the same conversation sent to several models at once over the multi
+    handle, with every answer printed as soon as it arrives together with its latency and the
+    tokens it used. Answers are not streamed, they would be mixed up on the screen.
+*/
+#define COMPARE_MAX 8
+
+struct compare_slot
+{
+    const char *model;
+    CURL *curl;
+    struct request_body body;
+    struct response resp;
+    struct curl_slist *headers;
+    struct endpoint *endpoint;
+    uint64_t key[2];
+    double started;
+    char *content; /* The answer, NULL until it arrives or if the request failed */
+};
+
+/* Split the comma separated `list` (modified in place) into `models`; returns how many there are, 0 on error */
+unsigned int compare_models(char *list, const char **models)
+{
+    unsigned int count = 0;
+    char *ptr, *model = strtok_r(list, ",", &ptr);
+
+    while (model != NULL)
+    {
+        if (count == COMPARE_MAX)
+        {
+            fprintf(stderr, "Error: at most %d models can be compared at once.\n", COMPARE_MAX);
+            return 0;
+        }
+        models[count++] = model;
+        model = strtok_r(NULL, ",", &ptr);
+    }
+    if (count == 0)
+        fprintf(stderr, "Error: no models to compare.\n");
+    return count;
+}
+
+void compare_print(unsigned int n, const struct compare_slot *slot, double elapsed, long tokens_used, bool cached)
+{
+    if (cached)
+        printf("[%u] %s - answered from cache\n", n + 1, slot->model);
+    else if (tokens_used > 0)
+        printf("[%u] %s - %.2f s, %ld tokens\n", n + 1, slot->model, elapsed, tokens_used);
+    else
+        printf("[%u] %s - %.2f s\n", n + 1, slot->model, elapsed);
+    if (slot->content != NULL)
+        printf("%s\n\n", slot->content);
+    fflush(stdout);
+}
+
+/*
+    Send `conv` to the models of `slots` (all but `model` and `content` is filled in here) and
+    print the answers as they finish, numbered in the order of `slots`. Returns how many failed.
+*/
+unsigned int compare_perform(struct compare_slot *slots, unsigned int count, struct conversation *conv, float temperature, const char *apikey)
+{
+    unsigned int i, active = 0, failed = 0;
+    CURLM *multi;
+    int running;
+
+    if (transport_init() != 0 || (multi = transport_multi()) == NULL)
+        return count;
+
+    interrupted = 0;
+    for (i = 0; i < count; i++)
+    {
+        struct compare_slot *slot = &slots[i];
+
+        slot->content = NULL;
+        slot->curl = NULL;
+        slot->headers = NULL;
+        slot->started = now_seconds();
+        if (context_check(conv, slot->model, false) != 0)
+        {
+            printf("[%u] %s - the request does not fit in the context of the model\n\n", i + 1, slot->model);
+            failed++;
+            continue;
+        }
+        cache_key(slot->model, temperature, conv, slot->key);
+        if ((slot->content = cache_lookup(cache.enabled, &turn_arena, slot->key, NULL)) != NULL)
+        {
+            usage_log(slot->model, NULL, NULL, 0, USAGE_CACHED);
+            compare_print(i, slot, 0, 0, true);
+            continue;
+        }
+
+        build_request(&slot->body, &turn_arena, slot->model, temperature, conv, false);
+        slot->curl = curl_easy_init();
+        response_init(&slot->resp, &turn_arena, slot->curl, false, false);
+        slot->resp.quiet = true;
+        slot->endpoint = pool_pick(NULL);
+        pool_begin(slot->endpoint);
+        slot->headers = transfer_setup(slot->curl, &slot->body, &slot->resp, apikey, slot->endpoint);
+        curl_easy_setopt(slot->curl, CURLOPT_PRIVATE, slot);
+        curl_multi_add_handle(multi, slot->curl);
+        active++;
+    }
+
+    while (active > 0)
+    {
+        CURLMsg *msg;
+        int queued;
+
+        curl_multi_perform(multi, &running);
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL)
+        {
+            struct compare_slot *slot;
+            long http_code = 0;
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            if (msg->easy_handle == transport.warm)
+            {
+                transport_warm_done(msg->data.result);
+                continue;
+            }
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+            curl_multi_remove_handle(multi, slot->curl);
+            curl_slist_free_all(slot->headers);
+            slot->headers = NULL;
+            active--;
+
+            transport_account(slot->curl);
+            endpoint_report(slot->endpoint, slot->curl, msg->data.result, &slot->resp, true);
+            curl_easy_getinfo(slot->curl, CURLINFO_RESPONSE_CODE, &http_code);
+            if (msg->data.result == CURLE_OK)
+                slot->content = response_finish(&slot->resp, http_code);
+            compression_refused(slot->curl, msg->data.result, &slot->body, slot->endpoint);
+            metrics_record(slot->curl, msg->data.result == CURLE_OK ? &slot->resp : NULL, slot->content != NULL ? true : false);
+            usage_log(slot->model, slot->endpoint, msg->data.result == CURLE_OK ? &slot->resp : NULL, now_seconds() - slot->started,
+                      slot->content != NULL ? 0 : USAGE_FAILED);
+
+            compare_print(slot - slots, slot, now_seconds() - slot->started, slot->resp.total_tokens, false);
+            if (slot->content != NULL)
+                cache_store(cache.enabled, slot->key, slot->content, strlen(slot->content), slot->resp.total_tokens > 0 ? slot->resp.total_tokens : 0);
+            else
+            {
+                if (msg->data.result != CURLE_OK)
+                    fprintf(stderr, "%s\n\n", transfer_error(&turn_arena, slot->curl, msg->data.result, &slot->resp));
+                else
+                    response_report(&slot->resp);
+                failed++;
+            }
+        }
+        if (active > 0 && interrupted)
+        {
+            for (i = 0; i < count; i++)
+            {
+                if (slots[i].headers == NULL)
+                    continue;
+                curl_multi_remove_handle(multi, slots[i].curl);
+                curl_slist_free_all(slots[i].headers);
+                pool_end(slots[i].endpoint, false, -1);
+                failed++;
+            }
+            interrupted = 0;
+            fprintf(stderr, "Request cancelled.\n");
+            break;
+        }
+        if (active > 0)
+            transport_poll(multi, 1000);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (slots[i].curl != NULL)
+            curl_easy_cleanup(slots[i].curl);
+    }
+    return failed;
+}
+
+char *autocomplete(const char *text, int state)
+{
+    /* Not the best code at all, but it requires few memory management */
+    if (strlen(text) < 1)
+        return NULL;
+    const char *available_commands[27] = { "/apikey", "/attach", "/cache", "/clear", "/compare", "/compress", "/context", "/debug",
+                                         "/endpoint", "/exit", "/export", "/hedge", "/help", "/import", "/model", "/parser",
+                                         "/pin", "/reset", "/search", "/showusage", "/stats", "/stream", "/system", "/temperature",
+                                         "/unpin", "/usage", "/version" };
+    unsigned short total_commands = 0;
+    size_t text_length = strlen(text);
+
+    unsigned short i = 0;
+    for (; i < 27; i++)
+    {
+        if (strncmp(available_commands[i], text, text_length) == 0)
+            total_commands++;
+    }
+    if (total_commands == 0)
+        printf("\a");
+    else if (total_commands == 1)
+    {
+        for (i = 0; i < 27; i++)
+            if (strncmp(available_commands[i], text, text_length) == 0)
+            {
+                rl_replace_line("", 0);
+                rl_redisplay();
+                rl_insert_text(available_commands[i]);
+                break;
+            }
+    }
+    else
+    {
+        printf("\n");
+        for (i = 0; i < 27; i++)
+            if (strncmp(available_commands[i], text, text_length) == 0)
+                printf("%s\n", available_commands[i]);
+        rl_on_new_line();
+        rl_redisplay();
+        printf("\a");
+    }
+
+    return NULL;
+}
+
+char **custom_completion(const char *text, int start, int end)
+{
+    rl_attempted_completion_over = 1;
+
+    return rl_completion_matches(text, autocomplete);
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* `p` in [0, 1] of `n` sorted samples, nearest rank */
+double percentile(const double *sorted, size_t n, double p)
+{
+    size_t rank;
+
+    if (n == 0)
+        return 0;
+    rank = (size_t)(p * n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+/* One in-flight request of a batch run; everything it allocates lives in its own arena */
+struct batch_slot
+{
+    CURL *curl;
+    struct arena arena;
+    struct conversation conv;
+    struct request_body body;
+    struct response resp;
+    struct curl_slist *headers;
+    struct endpoint *endpoint;
+    char *id; /* "id" of a JSONL request, echoed in its result */
+    uint64_t key[2];
+    size_t index;
+    double started;
+    double retry_at; /* When to send it again after a failure, 0 if not waiting */
+    unsigned int attempts;
+    bool busy;
+};
+
+struct batch_run
+{
+    const char *apikey;
+    const char *model;
+    float temperature;
+    bool ordered;
+    FILE *out;
+    char **window; /* Finished lines waiting for earlier ones, indexed by index % window_size */
+    size_t window_size;
+    size_t next_output;
+    double *latencies;
+    size_t latencies_size;
+    size_t finished;
+    size_t failed;
+    unsigned long total_tokens;
+    /* Fills `slot` with the next request: 1 if there is one, 0 at the end, -1 if it was rejected */
+    int (*next)(struct batch_run *run, struct batch_slot *slot, const char **model, float *temperature);
+    void *source;
+    bool plain;     /* Replies written as they are instead of as JSON lines... */
+    bool keep;      /* ...or kept in `results` */
+    char **results; /* By index, NULL for failed ones */
+    size_t results_size;
+    void (*progress)(struct batch_run *run, size_t active); /* Called after every reply, if not NULL */
+};
+
+/*
+    Fill `slot` from one input line. Plain lines are a single user prompt; lines starting
+    with '{' are JSON requests: {"messages": [...]} or {"prompt": "...", "system": "..."},
+    optionally with "model", "temperature" and an "id" echoed in the result.
+*/
+int batch_parse_line(struct batch_run *run, struct batch_slot *slot, const char *line, size_t len, const char **model, float *temperature)
+{
+    *model = run->model;
+    *temperature = run->temperature;
+    slot->id = NULL;
+
+    if (line[0] != '{')
+        return conversation_append(&slot->conv, ROLE_USER, line, len);
+
+    cJSON *root = cJSON_Parse(line);
+    if (!cJSON_IsObject(root))
+    {
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    cJSON *item = cJSON_GetObjectItemCaseSensitive(root, "model");
+    if (cJSON_IsString(item))
+        *model = arena_strdup(&slot->arena, item->valuestring);
+    item = cJSON_GetObjectItemCaseSensitive(root, "temperature");
+    if (cJSON_IsNumber(item))
+        *temperature = item->valuedouble;
+    item = cJSON_GetObjectItemCaseSensitive(root, "id");
+    if (cJSON_IsString(item))
+        slot->id = arena_strdup(&slot->arena, item->valuestring);
+    item = cJSON_GetObjectItemCaseSensitive(root, "system");
+    if (cJSON_IsString(item))
+        conversation_set_system(&slot->conv, item->valuestring);
+    item = cJSON_GetObjectItemCaseSensitive(root, "prompt");
+    if (cJSON_IsString(item))
+        conversation_append(&slot->conv, ROLE_USER, item->valuestring, strlen(item->valuestring));
+
+    cJSON *messages = cJSON_GetObjectItemCaseSensitive(root, "messages");
+    cJSON_ArrayForEach(item, messages)
+    {
+        cJSON *role = cJSON_GetObjectItemCaseSensitive(item, "role");
+        cJSON *content = cJSON_GetObjectItemCaseSensitive(item, "content");
+        if (!cJSON_IsString(role) || !cJSON_IsString(content))
+            continue;
+        if (strcmp(role->valuestring, "system") == 0)
+            conversation_set_system(&slot->conv, content->valuestring);
+        else
+            conversation_append(&slot->conv, strcmp(role->valuestring, "assistant") == 0 ? ROLE_ASSISTANT : ROLE_USER,
+                                content->valuestring, strlen(content->valuestring));
+    }
+
+    cJSON_Delete(root);
+    return slot->conv.count > 0 ? 0 : -1;
+}
+
+/* Write the result line of request `index`, holding it back until its predecessors are out if ordered */
+void batch_emit(struct batch_run *run, size_t index, const char *line)
+{
+    if (!run->ordered)
+    {
+        fputs(line, run->out);
+        fflush(run->out);
+        return;
+    }
+
+    if (index - run->next_output >= run->window_size)
+    {
+        size_t new_size = run->window_size ? run->window_size * 2 : 64, i;
+        while (index - run->next_output >= new_size)
+            new_size *= 2;
+        char **window = calloc(new_size, sizeof(char *));
+        if (window == NULL)
+        {
+            fprintf(stderr, "malloc() failed\n");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < run->window_size; i++)
+            if (run->window[i] != NULL)
+            {
+                size_t j = run->next_output;
+                while (j % run->window_size != i)
+                    j++;
+                window[j % new_size] = run->window[i];
+            }
+        free(run->window);
+        run->window = window;
+        run->window_size = new_size;
+    }
+
+    run->window[index % run->window_size] = strdup(line);
+    while (run->window[run->next_output % run->window_size] != NULL)
+    {
+        char **next = &run->window[run->next_output % run->window_size];
+        fputs(*next, run->out);
+        free(*next);
+        *next = NULL;
+        run->next_output++;
+    }
+    fflush(run->out);
+}
+
+/* Write the JSONL result of `slot`: its reply, or why there is none */
+void batch_result(struct batch_run *run, struct batch_slot *slot, const char *content, const char *error, double latency, bool cached)
+{
+    struct string line;
+    char number[192];
+
+    if (run->plain)
+    {
+        if (error != NULL)
+        {
+            fprintf(stderr, "%sError in part %lu: %s\n", run->progress != NULL ? "\n" : "", (unsigned long)slot->index + 1, error);
+            run->failed++;
+        }
+        else if (!cached && slot->resp.total_tokens > 0)
+            run->total_tokens += slot->resp.total_tokens;
+        if (!run->keep)
+            batch_emit(run, slot->index, content != NULL ? arena_concat(&slot->arena, content, "\n\n") : "");
+        else
+        {
+            if (slot->index >= run->results_size)
+            {
+                size_t new_size = run->results_size ? run->results_size * 2 : 64;
+                while (slot->index >= new_size)
+                    new_size *= 2;
+                run->results = realloc(run->results, new_size * sizeof(char *));
+                memset(run->results + run->results_size, 0, (new_size - run->results_size) * sizeof(char *));
+                run->results_size = new_size;
+            }
+            run->results[slot->index] = content != NULL ? strdup(content) : NULL;
+        }
+        run->latencies[run->finished++] = latency;
+        return;
+    }
+
+    init_string_arena(&line, &slot->arena);
+    snprintf(number, sizeof(number), "{\"index\": %lu", (unsigned long)slot->index);
+    append_string(&line, number, strlen(number));
+    if (slot->id != NULL)
+    {
+        append_string(&line, ", \"id\": \"", 9);
+        append_escaped(&line, slot->id);
+        append_string(&line, "\"", 1);
+    }
+    if (error != NULL)
+    {
+        append_string(&line, ", \"error\": \"", 12);
+        append_escaped(&line, error);
+        snprintf(number, sizeof(number), "\", \"latency_ms\": %.1f}\n", latency);
+        run->failed++;
+    }
+    else
+    {
+        append_string(&line, ", \"content\": \"", 14);
+        append_escaped(&line, content);
+        if (cached)
+            snprintf(number, sizeof(number), "\", \"cached\": true, \"latency_ms\": %.1f}\n", latency);
+        else
+            snprintf(number, sizeof(number), "\", \"prompt_tokens\": %ld, \"completion_tokens\": %ld, \"total_tokens\": %ld, \"latency_ms\": %.1f}\n",
+                     slot->resp.prompt_tokens, slot->resp.completion_tokens, slot->resp.total_tokens, latency);
+        if (!cached && slot->resp.total_tokens > 0)
+            run->total_tokens += slot->resp.total_tokens;
+    }
+    append_string(&line, number, strlen(number));
+    batch_emit(run, slot->index, line.ptr);
+
+    run->latencies[run->finished++] = latency;
+}
+
+/* Start (or restart) the transfer of the request prepared in `slot` */
+void batch_send(struct batch_run *run, CURLM *multi, struct batch_slot *slot)
+{
+    slot->body.segment = 0;
+    slot->body.offset = 0;
+    curl_easy_reset(slot->curl);
+    response_init(&slot->resp, &slot->arena, slot->curl, false, false);
+    slot->resp.quiet = true;
+    /* A retry goes to another endpoint if there is one */
+    slot->endpoint = pool_pick(slot->attempts > 0 ? slot->endpoint : NULL);
+    pool_begin(slot->endpoint);
+    slot->headers = transfer_setup(slot->curl, &slot->body, &slot->resp, run->apikey, slot->endpoint);
+    curl_easy_setopt(slot->curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(slot->curl, CURLOPT_PRIVATE, slot);
+    curl_multi_add_handle(multi, slot->curl);
+}
+
+/* Turn a finished transfer into its JSONL result; returns 1 if it failed and was scheduled to be sent again instead */
+int batch_complete(struct batch_run *run, struct batch_slot *slot, CURLcode code)
+{
+    long http_code = 0;
+    double latency = (now_seconds() - slot->started) * 1000, retry_after;
+    const char *error = NULL;
+    char *content = NULL;
+
+    transport_account(slot->curl);
+    endpoint_report(slot->endpoint, slot->curl, code, &slot->resp, true);
+    curl_easy_getinfo(slot->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (code != CURLE_OK)
+        error = arena_concat(&slot->arena, arena_concat(&slot->arena, curl_easy_strerror(code), " "), transfer_stage(slot->curl));
+    else if ((content = response_finish(&slot->resp, http_code)) == NULL)
+        error = slot->resp.failure != NULL ? slot->resp.failure : "Unknown error";
+    else
+        cache_store(cache.enabled, slot->key, content, strlen(content), slot->resp.total_tokens > 0 ? slot->resp.total_tokens : 0);
+    if (compression_refused(slot->curl, code, &slot->body, slot->endpoint))
+    {
+        metrics_phases(slot->curl, code == CURLE_OK ? &slot->resp : NULL);
+        slot->retry_at = now_seconds();
+        return 1;
+    }
+    metrics_record(slot->curl, code == CURLE_OK ? &slot->resp : NULL, content != NULL ? true : false);
+    usage_log(slot->body.model, slot->endpoint, code == CURLE_OK ? &slot->resp : NULL, now_seconds() - slot->resp.started,
+              content != NULL ? 0 : USAGE_FAILED);
+    if (content == NULL && slot->attempts < policy.retries && transfer_retryable(slot->curl, code, &slot->resp, &retry_after) &&
+        retry_after <= 60)
+    {
+        slot->retry_at = now_seconds() + backoff_delay(slot->attempts++, retry_after);
+        metrics.retries++;
+        return 1;
+    }
+    batch_result(run, slot, content, error, latency, false);
+    return 0;
+}
+
+void batch_run_init(struct batch_run *run, const char *apikey, const char *model)
+{
+    memset(run, 0, sizeof(*run));
+    run->apikey = apikey;
+    run->model = model;
+    run->temperature = 1.0F;
+    run->ordered = true;
+    run->out = stdout;
+    run->latencies_size = 1024;
+    run->latencies = malloc(run->latencies_size * sizeof(double));
+    if (run->latencies == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Source of batch_mode(): the next non-empty line of the input */
+struct batch_input
+{
+    FILE *in;
+    char *line;
+    size_t line_cap;
+};
+
+int batch_next_line(struct batch_run *run, struct batch_slot *slot, const char **model, float *temperature)
+{
+    struct batch_input *input = run->source;
+    ssize_t len;
+
+    do
+    {
+        if ((len = getline(&input->line, &input->line_cap, input->in)) < 0)
+            return 0;
+        while (len > 0 && (input->line[len - 1] == '\n' || input->line[len - 1] == '\r'))
+            input->line[--len] = '\0';
+    } while (len == 0);
+
+    if (batch_parse_line(run, slot, input->line, len, model, temperature) != 0)
+    {
+        char error_line[128];
+        snprintf(error_line, sizeof(error_line), "{\"index\": %lu, \"error\": \"Invalid request line\"}\n", (unsigned long)slot->index);
+        batch_emit(run, slot->index, error_line);
+        run->latencies[run->finished++] = 0;
+        run->failed++;
+        return -1;
+    }
+    return 1;
+}
+
+/*
+    Send the requests `run->next` provides, keeping up to `parallel` of them in flight over
+    one multi handle, until there are no more and all of them are finished.
+*/
+void batch_loop(struct batch_run *run, struct batch_slot *slots, unsigned int parallel, CURLM *multi)
+{
+    size_t next_index = 0, active = 0, i;
+    bool input_done = false;
+    int running = 0;
+
+    while (!input_done || active > 0)
+    {
+        /* Refill free slots from the input */
+        for (i = 0; i < parallel && !input_done; i++)
+        {
+            struct batch_slot *slot = &slots[i];
+
+            /* Lines answered right away (cached, invalid or too long) leave the slot free for the next one */
+            while (!slot->busy && !input_done)
+            {
+                const char *req_model;
+                float req_temperature;
+                int filled;
+
+                arena_reset(&slot->arena);
+                conversation_clear(&slot->conv);
+                slot->id = NULL;
+                slot->index = next_index;
+                if (run->finished + active + 1 > run->latencies_size)
+                {
+                    run->latencies_size *= 2;
+                    run->latencies = realloc(run->latencies, run->latencies_size * sizeof(double));
+                    if (run->latencies == NULL)
+                    {
+                        fprintf(stderr, "realloc() failed\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                if ((filled = run->next(run, slot, &req_model, &req_temperature)) == 0)
+                {
+                    input_done = true;
+                    break;
+                }
+                next_index++;
+                if (filled < 0)
+                    continue;
+
+                slot->started = now_seconds();
+                if (context_check(&slot->conv, req_model, false) != 0)
+                {
+                    batch_result(run, slot, NULL, "Request does not fit in the context of the model", 0, false);
+                    continue;
+                }
+                cache_key(req_model, req_temperature, &slot->conv, slot->key);
+                char *cached = cache_lookup(cache.enabled, &slot->arena, slot->key, NULL);
+                if (cached != NULL)
+                {
+                    usage_log(req_model, NULL, NULL, 0, USAGE_CACHED);
+                    batch_result(run, slot, cached, NULL, (now_seconds() - slot->started) * 1000, true);
+                    continue;
+                }
+
+                build_request(&slot->body, &slot->arena, req_model, req_temperature, &slot->conv, false);
+                slot->attempts = 0;
+                slot->retry_at = 0;
+                slot->busy = true;
+                batch_send(run, multi, slot);
+                active++;
+            }
+        }
+
+        /* Send again the failed requests whose backoff is over */
+        int timeout = 1000;
+        double now = now_seconds();
+        for (i = 0; i < parallel; i++)
+        {
+            if (slots[i].retry_at == 0)
+                continue;
+            if (slots[i].retry_at <= now)
+            {
+                slots[i].retry_at = 0;
+                batch_send(run, multi, &slots[i]);
+            }
+            else if ((slots[i].retry_at - now) * 1000 < timeout)
+                timeout = (slots[i].retry_at - now) * 1000 + 1;
+        }
+
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL)
+        {
+            struct batch_slot *slot;
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+            curl_multi_remove_handle(multi, slot->curl);
+            curl_slist_free_all(slot->headers);
+            if (batch_complete(run, slot, msg->data.result) != 0)
+                continue;
+            slot->busy = false;
+            active--;
+            if (run->progress != NULL)
+                run->progress(run, active);
+        }
+
+        if (running > 0 || active > 0)
+            curl_multi_poll(multi, NULL, 0, timeout, NULL);
+    }
+}
+
+struct batch_slot *batch_slots_new(unsigned int parallel)
+{
+    struct batch_slot *slots = calloc(parallel, sizeof(struct batch_slot));
+    unsigned int i;
+
+    if (slots == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < parallel; i++)
+    {
+        slots[i].curl = curl_easy_init();
+        conversation_init(&slots[i].conv);
+    }
+    return slots;
+}
+
+void batch_slots_free(struct batch_slot *slots, unsigned int parallel)
+{
+    unsigned int i;
+
+    for (i = 0; i < parallel; i++)
+    {
+        curl_easy_cleanup(slots[i].curl);
+        conversation_clear(&slots[i].conv);
+        free(slots[i].conv.messages);
+        arena_free(&slots[i].arena);
+    }
+    free(slots);
+}
+
+/*
+    Run every prompt of `path` ("-" for standard input), keeping up to `parallel` requests
+    in flight over one multi handle. Results are written as JSON lines on standard output.
+*/
+int batch_mode(const char *apikey, const char *model, const char *path, unsigned int parallel, bool ordered)
+{
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    struct batch_input input;
+    struct batch_run run;
+    struct batch_slot *slots;
+    CURLM *multi;
+    double started = now_seconds();
+
+    if (in == NULL)
+    {
+        fprintf(stderr, "Error: cannot open batch file '%s'.\n", path);
+        return 1;
+    }
+    if (transport_init() != 0 || (multi = transport_multi()) == NULL)
+        return 1;
+
+    batch_run_init(&run, apikey, model);
+    run.ordered = ordered;
+    run.next = batch_next_line;
+    input.in = in;
+    input.line = NULL;
+    input.line_cap = 0;
+    run.source = &input;
+    slots = batch_slots_new(parallel);
+    batch_loop(&run, slots, parallel, multi);
+
+    double elapsed = now_seconds() - started;
+    qsort(run.latencies, run.finished, sizeof(double), compare_doubles);
+    fprintf(stderr, "-- Batch: %lu requests (%lu failed) in %.2f s, %.1f requests/s, latency p50 %.0f ms, p99 %.0f ms, %lu tokens --\n",
+            (unsigned long)run.finished, (unsigned long)run.failed, elapsed, elapsed > 0 ? run.finished / elapsed : 0.0,
+            percentile(run.latencies, run.finished, 0.50), percentile(run.latencies, run.finished, 0.99), run.total_tokens);
+
+    batch_slots_free(slots, parallel);
+    free(run.latencies);
+    free(run.window);
+    free(input.line);
+    if (in != stdin)
+        fclose(in);
+
+    return run.failed > 0 ? 1 : 0;
+}
+
+/*
+    Map-reduce: the input is read in bounded memory and cut at line ends into parts of about
+    `budget` tokens, sent with the map instruction as system prompt over the batch machinery.
+    The replies are then merged, as many as fit in a request at a time, with the reduce
+    instruction until a single one is left.
+*/
+#define MAPREDUCE_CHUNK 3000
+#define MAPREDUCE_SEPARATOR "\n\n-----\n\n"
+
+struct mapreduce
+{
+    FILE *in;
+    const char *instruction;
+    size_t budget;    /* Tokens of input per request */
+    char *buffer;     /* Input read and not sent yet is buffer[start..end) */
+    size_t start;
+    size_t end;
+    size_t size;
+    bool eof;
+    unsigned long long bytes_read;
+    char **parts;     /* Reduce: replies of the previous step */
+    size_t part_count;
+    size_t next_part;
+    unsigned int step; /* 0 while mapping */
+    double started;
+};
+
+/* Read more input, if there is no whole line buffered */
+void mapreduce_fill(struct mapreduce *mr)
+{
+    size_t n;
+
+    while (!mr->eof && memchr(mr->buffer + mr->start, '\n', mr->end - mr->start) == NULL)
+    {
+        if (mr->start > 0)
+        {
+            memmove(mr->buffer, mr->buffer + mr->start, mr->end - mr->start);
+            mr->end -= mr->start;
+            mr->start = 0;
+        }
+        if (mr->end == mr->size)
+            return; /* A line longer than the buffer, it will be cut */
+        if ((n = fread(mr->buffer + mr->end, 1, mr->size - mr->end, mr->in)) == 0)
+            mr->eof = true;
+        mr->end += n;
+        mr->bytes_read += n;
+    }
+}
+
+/* Map source: the next lines of the input that fit in the budget */
+int mapreduce_next_chunk(struct batch_run *run, struct batch_slot *slot, const char **model, float *temperature)
+{
+    struct mapreduce *mr = run->source;
+    struct string chunk;
+    size_t tokens = 0;
+
+    init_string_arena(&chunk, &slot->arena);
+    for (;;)
+    {
+        const char *line, *nl;
+        size_t len, count;
+
+        mapreduce_fill(mr);
+        line = mr->buffer + mr->start;
+        if (mr->start == mr->end)
+            break;
+        nl = memchr(line, '\n', mr->end - mr->start);
+        len = nl != NULL ? (size_t)(nl - line) + 1 : mr->end - mr->start;
+        count = count_tokens(line, len);
+        if (count > mr->budget)
+        {
+            if (tokens > 0)
+                break; /* The long line goes alone in the next part */
+            /* A line too long for a request is cut, not in the middle of a UTF-8 character */
+            while (count > mr->budget && len > 1)
+            {
+                len = len * mr->budget / count * 9 / 10 + 1;
+                while (len > 1 && ((unsigned char)line[len] & 0xC0) == 0x80)
+                    len--;
+                count = count_tokens(line, len);
+            }
+        }
+        else if (tokens + count > mr->budget)
+            break;
+        append_string(&chunk, line, len);
+        tokens += count;
+        mr->start += len;
+    }
+    if (chunk.len == 0)
+        return 0;
+
+    *model = run->model;
+    *temperature = run->temperature;
+    conversation_set_system(&slot->conv, mr->instruction);
+    return conversation_append(&slot->conv, ROLE_USER, chunk.ptr, chunk.len) == 0 ? 1 : -1;
+}
+
+/* Reduce source: the next replies of the previous step that fit in the budget, two at least */
+int mapreduce_next_group(struct batch_run *run, struct batch_slot *slot, const char **model, float *temperature)
+{
+    struct mapreduce *mr = run->source;
+    struct string group;
+    size_t tokens = 0, taken = 0;
+
+    init_string_arena(&group, &slot->arena);
+    while (mr->next_part < mr->part_count)
+    {
+        const char *part = mr->parts[mr->next_part];
+        size_t count;
+
+        if (part == NULL)
+        {
+            mr->next_part++;
+            continue;
+        }
+        count = count_tokens(part, strlen(part));
+        if (taken >= 2 && tokens + count > mr->budget)
+            break;
+        if (taken > 0)
+            append_string(&group, MAPREDUCE_SEPARATOR, strlen(MAPREDUCE_SEPARATOR));
+        append_string(&group, part, strlen(part));
+        tokens += count;
+        taken++;
+        mr->next_part++;
+    }
+    if (taken == 0)
+        return 0;
+
+    *model = run->model;
+    *temperature = run->temperature;
+    conversation_set_system(&slot->conv, mr->instruction);
+    return conversation_append(&slot->conv, ROLE_USER, group.ptr, group.len) == 0 ? 1 : -1;
+}
+
+void mapreduce_progress(struct batch_run *run, size_t active)
+{
+    struct mapreduce *mr = run->source;
+    double elapsed = now_seconds() - mr->started;
+
+    if (mr->step == 0)
+        fprintf(stderr, "\r-- Map: %lu parts done, %lu in flight, %.1f MB read, %.2f MB/s, %lu tokens --", (unsigned long)run->finished,
+                (unsigned long)active, mr->bytes_read / 1048576.0, elapsed > 0 ? mr->bytes_read / 1048576.0 / elapsed : 0.0,
+                run->total_tokens);
+    else
+        fprintf(stderr, "\r-- Reduce step %u: %lu of %lu parts merged, %lu in flight, %lu tokens --", mr->step,
+                (unsigned long)mr->next_part, (unsigned long)mr->part_count, (unsigned long)active, run->total_tokens);
+}
+
+/*
+    Run `map` over every part of `path` ("-" for standard input) and, if `reduce` is not NULL,
+    merge the replies with it; the replies (or the merged one) are written on standard output.
+*/
+int mapreduce_mode(const char *apikey, const char *model, const char *map, const char *reduce, const char *path,
+                   unsigned int parallel, size_t chunk_tokens)
+{
+    FILE *in = path == NULL || strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    struct mapreduce mr;
+    struct batch_run run;
+    struct batch_slot *slots;
+    size_t limit = context_budget(model), overhead, failed, i;
+    unsigned long tokens_used;
+    CURLM *multi;
+
+    if (in == NULL)
+    {
+        fprintf(stderr, "Error: cannot open '%s'.\n", path);
+        return 1;
+    }
+    if (transport_init() != 0 || (multi = transport_multi()) == NULL)
+        return 1;
+
+    /* Room for the instruction and the message framing */
+    overhead = count_tokens(map, strlen(map)) + 16;
+    if (reduce != NULL && count_tokens(reduce, strlen(reduce)) + 16 > overhead)
+        overhead = count_tokens(reduce, strlen(reduce)) + 16;
+    if (chunk_tokens == 0)
+        chunk_tokens = MAPREDUCE_CHUNK;
+    if (chunk_tokens + overhead > limit)
+        chunk_tokens = limit > overhead * 2 ? limit - overhead : limit / 2;
+
+    memset(&mr, 0, sizeof(mr));
+    mr.in = in;
+    mr.instruction = map;
+    mr.budget = chunk_tokens;
+    /* A token is rarely longer than 16 bytes, so a part always fits */
+    mr.size = chunk_tokens * 16 < 65536 ? 65536 : chunk_tokens * 16;
+    mr.started = now_seconds();
+    if ((mr.buffer = malloc(mr.size)) == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        return 1;
+    }
+
+    batch_run_init(&run, apikey, model);
+    run.next = mapreduce_next_chunk;
+    run.source = &mr;
+    run.plain = true;
+    run.keep = reduce != NULL ? true : false;
+    if (isatty(STDERR_FILENO) && (reduce != NULL || !isatty(STDOUT_FILENO)))
+        run.progress = mapreduce_progress;
+    slots = batch_slots_new(parallel);
+    batch_loop(&run, slots, parallel, multi);
+    if (run.progress != NULL)
+        fprintf(stderr, "\r%79s\r", "");
+    fprintf(stderr, "-- Map: %lu parts (%lu failed) of %.1f MB in %.2f s, %.2f MB/s, %lu tokens --\n", (unsigned long)run.finished,
+            (unsigned long)run.failed, mr.bytes_read / 1048576.0, now_seconds() - mr.started,
+            now_seconds() > mr.started ? mr.bytes_read / 1048576.0 / (now_seconds() - mr.started) : 0.0, run.total_tokens);
+    failed = run.failed;
+    tokens_used = run.total_tokens;
+
+    mr.instruction = reduce;
+    while (reduce != NULL)
+    {
+        mr.parts = run.results;
+        mr.part_count = run.finished;
+        mr.next_part = 0;
+        mr.step++;
+        run.results = NULL;
+        run.results_size = 0;
+        run.finished = 0;
+        run.failed = 0;
+        run.total_tokens = 0;
+        run.next = mapreduce_next_group;
+        batch_loop(&run, slots, parallel, multi);
+        if (run.progress != NULL)
+            fprintf(stderr, "\r%79s\r", "");
+        fprintf(stderr, "-- Reduce step %u: %lu parts merged into %lu (%lu failed), %lu tokens --\n", mr.step,
+                (unsigned long)mr.part_count, (unsigned long)run.finished, (unsigned long)run.failed, run.total_tokens);
+        failed += run.failed;
+        tokens_used += run.total_tokens;
+        for (i = 0; i < mr.part_count; i++)
+            free(mr.parts[i]);
+        free(mr.parts);
+        if (run.finished <= 1)
+        {
+            if (run.finished == 1 && run.results[0] != NULL)
+                printf("%s\n", run.results[0]);
+            else if (failed++ == 0)
+                fprintf(stderr, "Error: there was nothing to reduce.\n");
+            for (i = 0; i < run.finished; i++)
+                free(run.results[i]);
+            free(run.results);
+            break;
+        }
+    }
+    fprintf(stderr, "-- Map-reduce: %.2f s in total, %lu tokens --\n", now_seconds() - mr.started, tokens_used);
+
+    batch_slots_free(slots, parallel);
+    free(run.latencies);
+    free(run.window);
+    free(mr.buffer);
+    if (in != stdin)
+        fclose(in);
+
+    return failed > 0 ? 1 : 0;
+}
+
+/*
+    Daemon mode: a resident process listening on a Unix socket keeps the configuration, the cURL
+    caches and the open HTTP/2 connections, so one-shot invocations only forward their prompt.
+    A request is the line "CGPT1 <cache> <model> <length>\n" followed by <length> bytes of prompt.
+    The answer is a series of frames (a type byte, a 4-byte length and the payload): DAEMON_OUT
+    text for standard output, DAEMON_ERR text for standard error, and DAEMON_EXIT with the status.
+*/
+#define DAEMON_MAX_CLIENTS 64
+#define DAEMON_MAX_REQUEST (64UL * 1024 * 1024)
+#define DAEMON_OUT 'O'
+#define DAEMON_ERR 'E'
+#define DAEMON_EXIT 'X'
+
+struct daemon_client
+{
+    int fd; /* -1 for a free slot */
+    CURL *curl;
+    struct arena arena;
+    struct string request;
+    size_t header_len; /* 0 until the request line is complete */
+    size_t expected;   /* Size of the whole request */
+    char model[256];
+    bool use_cache;
+    struct conversation conv;
+    struct request_body body;
+    struct response resp;
+    struct curl_slist *headers;
+    struct endpoint *endpoint;
+    uint64_t key[2];
+    double retry_at; /* When to send it again after a failure, 0 if not waiting */
+    unsigned int attempts;
+    bool busy; /* Transfer running */
+    bool gone; /* Could not be written to, drop it */
+};
+
+volatile sig_atomic_t daemon_stop = 0;
+
+void daemon_signal(int sig_num)
+{
+    daemon_stop = 1;
+}
+
+/* Send all of `data`, waiting for room if `fd` is non-blocking */
+int send_all(int fd, const char *data, size_t len)
+{
+    size_t sent = 0;
+
+    while (sent < len)
+    {
+        ssize_t n = send(fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n > 0)
+            sent += n;
+        else if (n < 0 && errno == EAGAIN)
+        {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, 5000) <= 0)
+                return -1;
+        }
+        else if (n < 0 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+int read_all(int fd, char *data, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len)
+    {
+        ssize_t n = read(fd, data + got, len - got);
+        if (n > 0)
+            got += n;
+        else if (n == 0 || errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+int daemon_send(int fd, char type, const char *data, size_t len)
+{
+    char header[5];
+    uint32_t len32 = len;
+
+    header[0] = type;
+    memcpy(header + 1, &len32, 4);
+    if (send_all(fd, header, sizeof(header)) != 0 || send_all(fd, data, len) != 0)
+        return -1;
+    return 0;
+}
+
+/* Connected socket to the daemon listening on `path`, or -1 if there is none */
+int daemon_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void daemon_sink(struct response *resp, const char *text, size_t len)
+{
+    struct daemon_client *c = resp->sink_data;
+
+    if (!c->gone && daemon_send(c->fd, DAEMON_OUT, text, len) != 0)
+        c->gone = true;
+}
+
+void daemon_close(CURLM *multi, struct daemon_client *c)
+{
+    if (c->busy)
+    {
+        curl_multi_remove_handle(multi, c->curl);
+        curl_slist_free_all(c->headers);
+        endpoint_report(c->endpoint, c->curl, CURLE_OK, &c->resp, false);
+        c->busy = false;
+    }
+    close(c->fd);
+    c->fd = -1;
+    c->gone = false;
+    c->retry_at = 0;
+    conversation_clear(&c->conv);
+    arena_reset(&c->arena);
+}
+
+/* Report the outcome of the request of `c` and hang up */
+void daemon_finish(CURLM *multi, struct daemon_client *c, int status, const char *error)
+{
+    char code = status;
+
+    if (!c->gone && error != NULL)
+    {
+        daemon_send(c->fd, DAEMON_ERR, error, strlen(error));
+        daemon_send(c->fd, DAEMON_ERR, "\n", 1);
+    }
+    if (!c->gone)
+        daemon_send(c->fd, DAEMON_EXIT, &code, 1);
+    daemon_close(multi, c);
+}
+
+/* Start (or restart) the transfer of the request of `c` */
+void daemon_send_request(CURLM *multi, struct daemon_client *c, const char *apikey)
+{
+    c->body.segment = 0;
+    c->body.offset = 0;
+    curl_easy_reset(c->curl);
+    response_init(&c->resp, &c->arena, c->curl, true, true);
+    c->resp.sink = daemon_sink;
+    c->resp.sink_data = c;
+    c->resp.quiet = true;
+    c->endpoint = pool_pick(c->attempts > 0 ? c->endpoint : NULL);
+    pool_begin(c->endpoint);
+    c->headers = transfer_setup(c->curl, &c->body, &c->resp, apikey, c->endpoint);
+    curl_easy_setopt(c->curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(c->curl, CURLOPT_PRIVATE, c);
+    c->busy = true;
+    curl_multi_add_handle(multi, c->curl);
+}
+
+void daemon_start(CURLM *multi, struct daemon_client *c, const char *apikey)
+{
+    conversation_append(&c->conv, ROLE_USER, c->request.ptr + c->header_len, c->expected - c->header_len);
+    if (context_check(&c->conv, c->model, false) != 0)
+    {
+        daemon_finish(multi, c, 1, "Error: the request does not fit in the context of the model.");
+        return;
+    }
+
+    cache_key(c->model, 1.0F, &c->conv, c->key);
+    char *cached = cache_lookup(c->use_cache, &c->arena, c->key, NULL);
+    if (cached != NULL)
+    {
+        usage_log(c->model, NULL, NULL, 0, USAGE_CACHED);
+        if (daemon_send(c->fd, DAEMON_OUT, cached, strlen(cached)) != 0 || daemon_send(c->fd, DAEMON_OUT, "\n", 1) != 0)
+            c->gone = true;
+        daemon_finish(multi, c, 0, NULL);
+        return;
+    }
+
+    build_request(&c->body, &c->arena, c->model, 1.0F, &c->conv, true);
+    c->attempts = 0;
+    daemon_send_request(multi, c, apikey);
+}
+
+void daemon_complete(CURLM *multi, struct daemon_client *c, CURLcode code)
+{
+    long http_code = 0;
+    double retry_after;
+    const char *error = NULL;
+    char *content = NULL;
+
+    transport_account(c->curl);
+    endpoint_report(c->endpoint, c->curl, code, &c->resp, true);
+    curl_easy_getinfo(c->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (code != CURLE_OK)
+        error = transfer_error(&c->arena, c->curl, code, &c->resp);
+    else if ((content = response_finish(&c->resp, http_code)) == NULL && c->resp.failed)
+        error = arena_concat(&c->arena, "API error: ", c->resp.failure);
+    else if (content == NULL)
+        error = arena_concat(&c->arena, arena_concat(&c->arena, c->resp.failure, " API response:\n"), c->resp.raw.ptr);
+    else
+        cache_store(c->use_cache, c->key, content, strlen(content), c->resp.total_tokens > 0 ? c->resp.total_tokens : 0);
+    if (compression_refused(c->curl, code, &c->body, c->endpoint))
+    {
+        metrics_phases(c->curl, code == CURLE_OK ? &c->resp : NULL);
+        c->retry_at = now_seconds();
+        return;
+    }
+    metrics_record(c->curl, code == CURLE_OK ? &c->resp : NULL, content != NULL ? true : false);
+    usage_log(c->model, c->endpoint, code == CURLE_OK ? &c->resp : NULL, now_seconds() - c->resp.started, content != NULL ? 0 : USAGE_FAILED);
+    if (content == NULL && c->attempts < policy.retries && transfer_retryable(c->curl, code, &c->resp, &retry_after) && retry_after <= 60)
+    {
+        char notice[64];
+        retry_after = backoff_delay(c->attempts++, retry_after);
+        c->retry_at = now_seconds() + retry_after;
+        metrics.retries++;
+        snprintf(notice, sizeof(notice), " Retrying in %.1f s...\n", retry_after);
+        if (code == CURLE_OK)
+            error = transfer_error(&c->arena, c->curl, code, &c->resp);
+        if (daemon_send(c->fd, DAEMON_ERR, error, strlen(error)) != 0 || daemon_send(c->fd, DAEMON_ERR, notice, strlen(notice)) != 0)
+            c->gone = true;
+        return;
+    }
+    daemon_finish(multi, c, content != NULL ? 0 : 1, error);
+}
+
+/* Read what client `c` sent, starting its request once it is complete */
+void daemon_read(CURLM *multi, struct daemon_client *c, const char *apikey)
+{
+    char buffer[65536];
+    ssize_t n = read(c->fd, buffer, sizeof(buffer));
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0 || c->busy || c->retry_at > 0)
+    {
+        /* The client went away (or broke the protocol), cancel whatever it asked for */
+        daemon_close(multi, c);
+        return;
+    }
+    append_string(&c->request, buffer, n);
+
+    if (c->header_len == 0)
+    {
+        char *eol = memchr(c->request.ptr, '\n', c->request.len);
+        unsigned long length;
+        int use_cache;
+        if (eol == NULL)
+        {
+            if (c->request.len > 1024)
+                daemon_finish(multi, c, 1, "Error: invalid request.");
+            return;
+        }
+        *eol = '\0';
+        if (sscanf(c->request.ptr, "CGPT1 %d %255s %lu", &use_cache, c->model, &length) != 3 || length > DAEMON_MAX_REQUEST)
+        {
+            daemon_finish(multi, c, 1, "Error: invalid request.");
+            return;
+        }
+        c->use_cache = use_cache ? true : false;
+        c->header_len = eol + 1 - c->request.ptr;
+        c->expected = c->header_len + length;
+    }
+    if (c->request.len >= c->expected)
+        daemon_start(multi, c, apikey);
+}
+
+int daemon_mode(const char *apikey, const char *socket_path)
+{
+    struct sockaddr_un addr;
+    struct daemon_client *clients, *owners[DAEMON_MAX_CLIENTS + 1];
+    struct curl_waitfd extra[DAEMON_MAX_CLIENTS + 1];
+    int listener, fd, running;
+    unsigned int count, i;
+    mode_t mask;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: socket path '%s' is too long.\n", socket_path);
+        return 1;
+    }
+    /* A socket left behind by a daemon that died can be replaced, one that answers cannot */
+    if ((fd = daemon_connect(socket_path)) != -1)
+    {
+        close(fd);
+        fprintf(stderr, "Error: a daemon is already listening on '%s'.\n", socket_path);
+        return 1;
+    }
+    unlink(socket_path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mask = umask(077);
+    if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 64) != 0)
+    {
+        umask(mask);
+        fprintf(stderr, "Error: cannot listen on '%s': %s.\n", socket_path, strerror(errno));
+        return 1;
+    }
+    umask(mask);
+    fcntl(listener, F_SETFL, O_NONBLOCK);
+
+    if (transport_init() != 0)
+        return 1;
+    CURLM *multi = transport_multi();
+    clients = calloc(DAEMON_MAX_CLIENTS, sizeof(struct daemon_client));
+    if (multi == NULL || clients == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        return 1;
+    }
+    for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    {
+        clients[i].fd = -1;
+        clients[i].curl = curl_easy_init();
+        conversation_init(&clients[i].conv);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, daemon_signal);
+    signal(SIGTERM, daemon_signal);
+    printf("Listening on %s.\n", socket_path);
+    fflush(stdout);
+
+    while (!daemon_stop)
+    {
+        extra[0].fd = listener;
+        extra[0].events = CURL_WAIT_POLLIN;
+        extra[0].revents = 0;
+        count = 1;
+        for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        {
+            if (clients[i].fd == -1)
+                continue;
+            extra[count].fd = clients[i].fd;
+            extra[count].events = CURL_WAIT_POLLIN;
+            extra[count].revents = 0;
+            owners[count++] = &clients[i];
+        }
+        /* Send again the failed requests whose backoff is over */
+        int timeout = 1000;
+        double now = now_seconds();
+        for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        {
+            if (clients[i].fd == -1 || clients[i].retry_at == 0)
+                continue;
+            if (clients[i].retry_at <= now)
+            {
+                clients[i].retry_at = 0;
+                daemon_send_request(multi, &clients[i], apikey);
+            }
+            else if ((clients[i].retry_at - now) * 1000 < timeout)
+                timeout = (clients[i].retry_at - now) * 1000 + 1;
+        }
+        curl_multi_poll(multi, extra, count, timeout, NULL);
+
+        for (i = 1; i < count; i++)
+        {
+            if (extra[i].revents != 0 && owners[i]->fd != -1)
+                daemon_read(multi, owners[i], apikey);
+        }
+        while (extra[0].revents != 0 && (fd = accept(listener, NULL, NULL)) != -1)
+        {
+            for (i = 0; i < DAEMON_MAX_CLIENTS && clients[i].fd != -1; i++)
+                ;
+            if (i == DAEMON_MAX_CLIENTS)
+            {
+                const char *busy = "Error: the daemon is busy.\n";
+                char code = 1;
+                daemon_send(fd, DAEMON_ERR, busy, strlen(busy));
+                daemon_send(fd, DAEMON_EXIT, &code, 1);
+                close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            clients[i].fd = fd;
+            clients[i].header_len = 0;
+            clients[i].expected = 0;
+            init_string_arena(&clients[i].request, &clients[i].arena);
+        }
+
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL)
+        {
+            struct daemon_client *c;
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&c);
+            curl_multi_remove_handle(multi, c->curl);
+            curl_slist_free_all(c->headers);
+            c->busy = false;
+            daemon_complete(multi, c, msg->data.result);
+        }
+
+        for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+        {
+            if (clients[i].fd != -1 && clients[i].gone)
+                daemon_close(multi, &clients[i]);
+        }
+    }
+
+    for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+    {
+        if (clients[i].fd != -1)
+            daemon_close(multi, &clients[i]);
+        curl_easy_cleanup(clients[i].curl);
+        free(clients[i].conv.messages);
+        arena_free(&clients[i].arena);
+    }
+    free(clients);
+    close(listener);
+    unlink(socket_path);
+    printf("Daemon stopped.\n");
+    return 0;
+}
+
+/* Run a one-shot prompt through the daemon; returns the exit status, or -1 if no daemon is running */
+int daemon_forward(const char *socket_path, const char *model, const char *prompt, size_t len, bool use_cache)
+{
+    char header[300], frame[5], buffer[65536];
+    uint32_t remaining;
+    int fd = daemon_connect(socket_path);
+
+    if (fd == -1)
+        return -1;
+    snprintf(header, sizeof(header), "CGPT1 %d %s %lu\n", use_cache ? 1 : 0, model, (unsigned long)len);
+    if (send_all(fd, header, strlen(header)) != 0 || send_all(fd, prompt, len) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    while (read_all(fd, frame, sizeof(frame)) == 0)
+    {
+        memcpy(&remaining, frame + 1, 4);
+        while (remaining > 0)
+        {
+            size_t n = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+            if (read_all(fd, buffer, n) != 0)
+                break;
+            if (frame[0] == DAEMON_EXIT)
+            {
+                close(fd);
+                return buffer[0];
+            }
+            fwrite(buffer, 1, n, frame[0] == DAEMON_ERR ? stderr : stdout);
+            fflush(frame[0] == DAEMON_ERR ? stderr : stdout);
+            remaining -= n;
+        }
+    }
+    close(fd);
+    fprintf(stderr, "Error: the daemon closed the connection.\n");
+    return 1;
+}
+
+/*
+    Conversation shell. Input goes through readline's callback interface, so it is also read
+    while a request runs (when standard input is a terminal): commands that do not touch the
+    conversation run right away, and prompts and the rest of commands wait for the answer.
+*/
+#define SHELL_QUEUE_MAX 64
+
+struct shell_line
+{
+    char *text;
+    bool echo; /* Typed while busy, so it was not shown */
+};
+
+struct shell
+{
+    char *apikey;
+    char *orig_apikey;
+    struct endpoint_pool orig_pool;
+    bool orig_compress;
+    char *def_model;
+    char *model;
+    float temperature;
+    struct conversation conv;
+    bool show_usage, stream, debug, auto_budget;
+    size_t budget;
+    bool interactive; /* Standard input is a terminal */
+    bool busy;        /* A request is running */
+    bool eof;
+    struct shell_line queue[SHELL_QUEUE_MAX];
+    unsigned int head, queued;
+    bool asking;  /* The next line answers shell_ask()... */
+    char *reply;  /* ...and goes here instead of the queue */
+    char *hits[INDEX_HITS]; /* Sessions of the last /search results, for /import <n> */
+    unsigned int hit_count;
+};
+
+struct shell *shell = NULL;
+
+int shell_execute(struct shell *sh, char *line);
+
+/* Handle Ctrl+C presses in shell mode (else will quit the program) */
+void ctrlCHandler(int sig_num)
+{
+    interrupted = 1;
+    if (transport.multi != NULL)
+        curl_multi_wakeup(transport.multi);
+}
+
+/* Readline's display while busy: what is typed is kept but not shown, it would mix with the answer */
+void shell_redisplay_none(void)
+{
+}
+
+/* Enter key while busy, accepting the line without moving the cursor */
+int shell_accept(int count, int key)
+{
+    RL_SETSTATE(RL_STATE_DONE);
+    rl_done = 1;
+    return 0;
+}
+
+void shell_display(bool visible, const char *prompt)
+{
+    if (!visible)
+    {
+        rl_redisplay_function = shell_redisplay_none;
+        return;
+    }
+    rl_redisplay_function = rl_redisplay;
+    rl_set_prompt(prompt);
+    rl_forced_update_display();
+}
+
+void shell_busy(struct shell *sh, bool busy)
+{
+    sh->busy = busy;
+    if (!sh->interactive || sh->eof)
+        return;
+    transport.input_fd = busy ? fileno(stdin) : -1;
+    rl_bind_key('\r', busy ? shell_accept : rl_newline);
+    rl_bind_key('\n', busy ? shell_accept : rl_newline);
+}
+
+/* Commands that do not touch the conversation, run as soon as they are typed */
+bool shell_runs_now(const char *line)
+{
+    const char *commands[] = { "/help", "/stats", "/showusage", "/stream", "/debug", "/parser", "/temperature",
+                               "/apikey", "/hedge", "/compress", "/cache", "/search", "/usage", "/version" };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        if (contains_str_before_space(line, commands[i], NULL))
+            return true;
+    }
+    return false;
+}
+
+/* Called by readline with every line typed, NULL at the end of the input */
+void shell_line_handler(char *line)
+{
+    struct shell *sh = shell;
+    struct shell_line *entry;
+
+    shell_display(false, NULL);
+    if (line == NULL)
+    {
+        sh->eof = true;
+        transport.input_fd = -1;
+        return;
+    }
+    if (sh->asking)
+    {
+        sh->reply = line;
+        return;
+    }
+    if (line[0] != '\0')
+        add_history(line);
+    if (sh->busy && shell_runs_now(line))
+    {
+        printf("\n%s> %s\n", sh->model, line);
+        shell_execute(sh, line);
+        free(line);
+        return;
+    }
+    if (sh->busy && strcmp(line, "/exit") == 0)
+    {
+        interrupted = 1;
+        while (sh->queued > 0)
+        {
+            free(sh->queue[sh->head].text);
+            sh->head = (sh->head + 1) % SHELL_QUEUE_MAX;
+            sh->queued--;
+        }
+    }
+    if (sh->queued == SHELL_QUEUE_MAX)
+    {
+        fprintf(stderr, "\nError: too many lines waiting, '%s' was dropped.\n", line);
+        free(line);
+        return;
+    }
+    entry = &sh->queue[(sh->head + sh->queued++) % SHELL_QUEUE_MAX];
+    entry->text = line;
+    entry->echo = sh->busy;
+}
+
+/* Wait until there is a line to run (or an answer, if asking), showing `prompt` meanwhile; -1 on errors */
+int shell_wait(struct shell *sh, const char *prompt)
+{
+    struct pollfd input;
+    double shown = now_seconds();
+    int ready;
+
+    interrupted = 0;
+    if (!(sh->asking ? sh->reply != NULL : sh->queued > 0) && !sh->eof)
+        shell_display(true, prompt);
+    while (!(sh->asking ? sh->reply != NULL : sh->queued > 0) && !sh->eof)
+    {
+        /* Keep the connection warm while the user types */
+        if (sh->interactive)
+            ready = transport_idle(fileno(stdin), shown);
+        else
+        {
+            input.fd = fileno(stdin);
+            input.events = POLLIN;
+            input.revents = 0;
+            ready = poll(&input, 1, -1);
+            if (ready < 0 && errno == EINTR)
+                ready = 0;
+        }
+        if (ready < 0)
+        {
+            perror("poll");
+            return -1;
+        }
+        if (interrupted)
+        {
+            interrupted = 0;
+            rl_callback_sigcleanup();
+            printf("\n");
+            rl_replace_line("", 0);
+            /* Ctrl+C leaves a question unanswered */
+            if (sh->asking)
+                break;
+            rl_on_new_line();
+            rl_redisplay();
+        }
+        else if (ready > 0)
+            rl_callback_read_char();
+    }
+    return 0;
+}
+
+/* Wait for the next line to run, showing `prompt` if there is none queued; NULL at the end of the input */
+char *shell_read(struct shell *sh, const char *prompt)
+{
+    struct shell_line *entry;
+
+    if (shell_wait(sh, prompt) != 0)
+        return NULL;
+    if (sh->queued == 0)
+        return NULL;
+    entry = &sh->queue[sh->head];
+    sh->head = (sh->head + 1) % SHELL_QUEUE_MAX;
+    sh->queued--;
+    if (entry->echo)
+        printf("%s%s\n", prompt, entry->text);
+    return entry->text;
+}
+
+/* Ask `question` and wait for the answer, leaving the lines already typed queued; NULL if there is none */
+char *shell_ask(struct shell *sh, const char *question)
+{
+    char *reply;
+
+    sh->asking = true;
+    sh->reply = NULL;
+    shell_wait(sh, question);
+    sh->asking = false;
+    reply = sh->reply;
+    sh->reply = NULL;
+    return reply;
+}
+
+/* Run one shell line; returns 1 if the shell has to exit */
+int shell_execute(struct shell *sh, char *line)
+{
+    if (line[0] == '/')
+    {
+        char *remaining_data = NULL;
+        if (contains_str_before_space(line, "/help", &remaining_data))
+        {
+            printf("Commands starting with / are shell commands, else they are sent to the model.\n\n");
+            printf("Available shell commands:\n");
+            printf("  /system <prompt>        - Change the \"system\" prompt, run /system with no prompt to clear.\n");
+            printf("  /model <model>          - Change the model used, run /model with no model to reset.\n");
+            printf("  /apikey <key>           - Change or set the API key used, run /apikey with no key to reset.\n");
+            printf("  /showusage <true|false> - Show used tokens during conversation. Run with no value to reset.\n");
+            printf("  /temperature <value>    - Change model's temperature. <value> must be or be between 0.0 and 2.0. Run with no value to reset.\n");
+            printf("  /stream <true|false>    - Print the answer while it is being generated. Run with no value to reset.\n");
+            printf("  /debug <true|false>     - Show memory allocated by every request. Run with no value to reset.\n");
+            printf("  /parser <fast|cjson>    - Choose how API responses are parsed. Run with no value to reset.\n");
+            printf("  /cache <true|false|clear> - Answer repeated requests from the local cache. Run with no value to show its statistics.\n");
+            printf("  /context <tokens|auto|off> - Set how many tokens of history are sent, leaving the oldest messages out. Run with no value to show what is sent.\n");
+            printf("  /compare <models> <prompt> - Send <prompt> to several comma separated models at once and pick the answer to keep.\n");
+            printf("  /stats                  - Show how long the phases of the requests took (p50, p90 and p99).\n");
+            printf("  /usage <day|model|endpoint> - Show the tokens and requests of every session, by day (default), model or endpoint.\n");
+            printf("  /hedge <true|false>     - Send a second copy of requests slower than usual to start answering. Run with no value to reset.\n");
+            printf("  /compress <true|false>  - Compress requests with gzip (the whole conversation is sent every time). Run with no value to reset.\n");
+            printf("  /pin <n>                - Always send message <n> (as numbered by /context), run /pin with no number to pin the last one.\n");
+            printf("  /unpin <n>              - Stop pinning message <n>, run /unpin with no number to unpin every message.\n");
+            printf("  /reset                  - Reset the conversation.\n");
+            printf("  /attach <file>          - Send the text file <file> with the next prompt (and the following ones), without pasting it.\n");
+            printf("  /import <file>          - Import conversation from <file>, or from the session of result <n> of the last /search.\n");
+            printf("  /export <file>          - Export current conversation to <file>, adding it to the search index.\n");
+            printf("  /search <words>         - Search the exported conversations for the messages that best match <words>.\n");
+            printf("  /endpoint <URL>         - (EXPERT ONLY) Change the API endpoint used, run /endpoint with no URL to reset.\n");
+            printf("  /endpoint add <URL> [<key>] - (EXPERT ONLY) Add an endpoint (with its own API key) to the pool requests are spread over.\n");
+            printf("  /endpoint remove <URL>  - Remove an endpoint from the pool.\n");
+            printf("  /endpoint list          - Show the endpoints of the pool and how they are answering.\n");
+            printf("  /clear                  - Clear terminal screen.\n");
+            printf("  /help                   - Show this help message.\n");
+            printf("  /version                - Show application version.\n");
+            printf("  /exit                   - Exit the shell.\n");
+        }
+        else if (contains_str_before_space(line, "/system", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                conversation_set_system(&sh->conv, NULL);
+                printf("System prompt successfully cleared.\n");
+                return 0;
+            }
+            conversation_set_system(&sh->conv, remaining_data);
+            printf("System prompt successfully set/changed.\n");
+        }
+        else if (contains_str_before_space(line, "/model", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                sh->model = sh->def_model;
+                printf("Model successfully reset (set to %s).\n", sh->model);
+                return 0;
+            }
+            sh->model = arena_strdup(&session_arena, remaining_data);
+            printf("Model successfully set/changed.\n");
+        }
+        else if (contains_str_before_space(line, "/apikey", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                sh->apikey = sh->orig_apikey;
+                transport.rewarm = true;
+                printf("API key successfully reset.\n");
+                return 0;
+            }
+            sh->apikey = arena_strdup(&session_arena, remaining_data);
+            transport.rewarm = true;
+            printf("API key successfully set/changed.\n");
+        }
+        else if (contains_str_before_space(line, "/endpoint", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                pool = sh->orig_pool;
+                transport.rewarm = true;
+                printf("API endpoint successfully reset.\n");
+                return 0;
+            }
+            if (strcmp(remaining_data, "list") == 0)
+                pool_print();
+            else if (strncmp(remaining_data, "add ", 4) == 0)
+            {
+                if (pool_add_line(arena_strdup(&session_arena, remaining_data + 4)) == 0)
+                {
+                    transport.rewarm = true;
+                    printf("Endpoint successfully added to the pool.\n");
+                }
+            }
+            else if (strncmp(remaining_data, "remove ", 7) == 0)
+            {
+                if (pool_remove(remaining_data + 7) == 0)
+                {
+                    transport.rewarm = true;
+                    printf("Endpoint successfully removed from the pool.\n");
+                }
+            }
+            else
+            {
+                pool.count = 0;
+                pool_add_line(arena_strdup(&session_arena, remaining_data));
+                transport.rewarm = true;
+                printf("API endpoint successfully set/changed.\n");
+            }
+        }
+        else if (contains_str_before_space(line, "/showusage", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                sh->show_usage = true;
+                printf("Show usage successfully reset (set to %s).\n", sh->show_usage ? "true" : "false");
+                return 0;
+            }
+            if (strcmp(remaining_data, "false") == 0 || strcmp(remaining_data, "0") == 0)
+            {
+                sh->show_usage = false;
+                printf("Show usage set to false.\n");
+            }
+            else if (strcmp(remaining_data, "true") == 0 || strcmp(remaining_data, "1") == 0)
+            {
+                sh->show_usage = true;
+                printf("Show usage set to true.\n");
+            }
+            else
+                printf("Show usage value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/stream", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                sh->stream = true;
+                printf("Streaming successfully reset (set to %s).\n", sh->stream ? "true" : "false");
+                return 0;
+            }
+            if (strcmp(remaining_data, "false") == 0 || strcmp(remaining_data, "0") == 0)
+            {
+                sh->stream = false;
+                printf("Streaming set to false.\n");
+            }
+            else if (strcmp(remaining_data, "true") == 0 || strcmp(remaining_data, "1") == 0)
+            {
+                sh->stream = true;
+                printf("Streaming set to true.\n");
+            }
+            else
+                printf("Streaming value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/hedge", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                policy.hedge = false;
+                printf("Hedging successfully reset (set to %s).\n", policy.hedge ? "true" : "false");
+                return 0;
+            }
+            if (strcmp(remaining_data, "false") == 0 || strcmp(remaining_data, "0") == 0)
+            {
+                policy.hedge = false;
+                printf("Hedging set to false.\n");
+            }
+            else if (strcmp(remaining_data, "true") == 0 || strcmp(remaining_data, "1") == 0)
+            {
+                policy.hedge = true;
+                printf("Hedging set to true.\n");
+            }
+            else
+                printf("Hedging value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/compress", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                compress_requests = sh->orig_compress;
+                printf("Compression successfully reset (set to %s).\n", compress_requests ? "true" : "false");
+                return 0;
+            }
+            if (strcmp(remaining_data, "false") == 0 || strcmp(remaining_data, "0") == 0)
+            {
+                compress_requests = false;
+                printf("Compression set to false.\n");
+            }
+            else if (strcmp(remaining_data, "true") == 0 || strcmp(remaining_data, "1") == 0)
+            {
+                compress_requests = true;
+                printf("Compression set to true.\n");
+            }
+            else
+                printf("Compression value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/debug", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                sh->debug = false;
+                printf("Debug successfully reset (set to %s).\n", sh->debug ? "true" : "false");
+                return 0;
+            }
+            if (strcmp(remaining_data, "false") == 0 || strcmp(remaining_data, "0") == 0)
+            {
+                sh->debug = false;
+                printf("Debug set to false.\n");
+            }
+            else if (strcmp(remaining_data, "true") == 0 || strcmp(remaining_data, "1") == 0)
+            {
+                sh->debug = true;
+                printf("Debug set to true.\n");
+            }
+            else
+                printf("Debug value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/parser", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                cjson_parser = false;
+                printf("Parser successfully reset (set to fast).\n");
+                return 0;
+            }
+            if (strcmp(remaining_data, "fast") == 0)
+            {
+                cjson_parser = false;
+                printf("Parser set to fast.\n");
+            }
+            else if (strcmp(remaining_data, "cjson") == 0)
+            {
+                cjson_parser = true;
+                printf("Parser set to cjson.\n");
+            }
+            else
+                printf("Parser value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/cache", &remaining_data))
+        {
+            if (remaining_data == NULL)
+                cache_print_stats();
+            else if (strcmp(remaining_data, "false") == 0 || strcmp(remaining_data, "0") == 0)
+            {
+                cache.enabled = false;
+                printf("Cache set to false.\n");
+            }
+            else if (strcmp(remaining_data, "true") == 0 || strcmp(remaining_data, "1") == 0)
+            {
+                cache.enabled = true;
+                printf("Cache set to true.\n");
+            }
+            else if (strcmp(remaining_data, "clear") == 0)
+            {
+                cache_clear();
+                printf("Cache successfully cleared.\n");
+            }
+            else
+                printf("Cache value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/stats", &remaining_data))
+            metrics_print();
+        else if (contains_str_before_space(line, "/usage", &remaining_data))
+        {
+            int grouping = usage_grouping(remaining_data);
+            if (grouping >= 0)
+                usage_report(grouping);
+        }
+        else if (contains_str_before_space(line, "/search", &remaining_data))
+        {
+            int found;
+            if (remaining_data == NULL)
+            {
+                printf("Usage: /search <words>\n");
+                return 0;
+            }
+            while (sh->hit_count > 0)
+                free(sh->hits[--sh->hit_count]);
+            if ((found = index_search(remaining_data, INDEX_HITS, sh->hits)) > 0)
+            {
+                sh->hit_count = found;
+                printf("Run /import <number> to continue one of these conversations.\n");
+            }
+        }
+        else if (contains_str_before_space(line, "/compare", &remaining_data))
+        {
+            const char *models[COMPARE_MAX];
+            struct compare_slot slots[COMPARE_MAX];
+            unsigned int count, i, choice = 0;
+            char *text = remaining_data != NULL ? strchr(remaining_data, ' ') : NULL;
+            if (text == NULL)
+            {
+                printf("Usage: /compare <model1,model2,...> <prompt>\n");
+                return 0;
+            }
+            if (sh->apikey == NULL)
+            {
+                fprintf(stderr, "No API key provided. Please specify it with the /apikey shell command, or re-run the program with the '--setup' flag to configure it permanently.\n");
+                return 0;
+            }
+            *text++ = '\0';
+            if ((count = compare_models(remaining_data, models)) == 0)
+                return 0;
+            size_t prev_count = sh->conv.count;
+            if (conversation_append(&sh->conv, ROLE_USER, text, strlen(text)) != 0)
+                return 0;
+            conversation_fit(&sh->conv, sh->auto_budget ? context_budget(sh->model) : sh->budget);
+            for (i = 0; i < count; i++)
+                slots[i].model = models[i];
+            shell_busy(sh, true);
+            unsigned int failed = compare_perform(slots, count, &sh->conv, sh->temperature, sh->apikey);
+            shell_busy(sh, false);
+            if (failed < count)
+            {
+                char *answer = shell_ask(sh, "Keep which answer in the conversation? [number, Enter for none] ");
+                if (answer != NULL)
+                {
+                    choice = atoi(answer);
+                    free(answer);
+                }
+            }
+            if (choice >= 1 && choice <= count && slots[choice - 1].content != NULL)
+            {
+                conversation_append(&sh->conv, ROLE_ASSISTANT, slots[choice - 1].content, strlen(slots[choice - 1].content));
+                conversation_fit(&sh->conv, sh->auto_budget ? context_budget(sh->model) : sh->budget);
+                printf("Answer of %s kept in the conversation.\n", slots[choice - 1].model);
+            }
+            else
+            {
+                conversation_truncate(&sh->conv, prev_count);
+                printf("No answer kept, the prompt was left out of the conversation.\n");
+            }
+        }
+        else if (contains_str_before_space(line, "/context", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                conversation_fit(&sh->conv, sh->auto_budget ? context_budget(sh->model) : sh->budget);
+                conversation_print_context(&sh->conv, sh->model, sh->auto_budget ? context_budget(sh->model) : sh->budget);
+            }
+            else if (strcmp(remaining_data, "auto") == 0)
+            {
+                sh->auto_budget = true;
+                printf("Context budget set to auto (%lu tokens for %s).\n", (unsigned long)context_budget(sh->model), sh->model);
+            }
+            else if (strcmp(remaining_data, "off") == 0 || strcmp(remaining_data, "0") == 0)
+            {
+                sh->auto_budget = false;
+                sh->budget = 0;
+                printf("Context budget disabled, the whole conversation will be sent.\n");
+            }
+            else if (atol(remaining_data) > 0)
+            {
+                sh->auto_budget = false;
+                sh->budget = atol(remaining_data);
+                printf("Context budget set to %lu tokens.\n", (unsigned long)sh->budget);
+            }
+            else
+                printf("Context budget value not recognized.\n");
+        }
+        else if (contains_str_before_space(line, "/pin", &remaining_data) ||
+                 contains_str_before_space(line, "/unpin", &remaining_data))
+        {
+            bool pin = line[1] == 'p' ? true : false;
+            size_t index = remaining_data != NULL ? strtoul(remaining_data, NULL, 10) : 0;
+            if (remaining_data == NULL && !pin)
+            {
+                for (index = 0; index < sh->conv.count; index++)
+                    sh->conv.messages[index].pinned = false;
+                printf("Every message successfully unpinned.\n");
+                return 0;
+            }
+            if (remaining_data == NULL)
+                index = sh->conv.count;
+            if (index < 1 || index > sh->conv.count)
+            {
+                printf("No message %s. Run /context to see the message numbers.\n", remaining_data != NULL ? remaining_data : "to pin");
+                return 0;
+            }
+            sh->conv.messages[index - 1].pinned = pin;
+            printf("Message %lu successfully %s.\n", (unsigned long)index, pin ? "pinned" : "unpinned");
+        }
+        else if (contains_str_before_space(line, "/temperature", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                sh->temperature = 1.0F;
+                printf("Temperature successfully reset (set to %.1f).\n", sh->temperature);
+                return 0;
+            }
+            if (0.0F <= atof(remaining_data) && atof(remaining_data) <= 2.0F)
+            {
+                sh->temperature = atof(remaining_data);
+                printf("Temperature set to %.1f.\n", sh->temperature);
+            }
+            else
+                printf("Temperature invalid. Must be greater or equal to 0 and less or equal to 2.\n");
+        }
+        else if (contains_str_before_space(line, "/reset", &remaining_data))
+        {
+            conversation_clear(&sh->conv);
+            printf("Conversation successfully reset.\n");
+        }
+        else if (contains_str_before_space(line, "/version", &remaining_data))
+            printf("%s\n", APP_VERSION);
+        else if (contains_str_before_space(line, "/clear", &remaining_data))
+        {
+            rl_clear_display(0, 0);
+            printf("\r");
+            rl_replace_line("", 0);
+            rl_redisplay();
+        }
+        else if (contains_str_before_space(line, "/export", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                printf("No destination file provided. Aborting.\n");
+                return 0;
+            }
+            if (session_save(remaining_data, &sh->conv, sh->model, sh->temperature) != 0)
+                printf("Error while writing the file. Aborting.\n");
+            else if (index_session(remaining_data, &sh->conv) != 0)
+                fprintf(stderr, "Warning: the conversation could not be added to the search index.\n");
+        }
+        else if (contains_str_before_space(line, "/attach", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                printf("Usage: /attach <file>\n");
+                return 0;
+            }
+            if (conversation_attach_files(&sh->conv, &remaining_data, 1) != 0)
+                return 0;
+            size_t attached = message_tokens(&sh->conv, sh->conv.count - 1);
+            bool fits = model_context_limit(sh->model) == 0 || attached <= context_budget(sh->model) ? true : false;
+            printf("File attached (%.1f KB, %s%lu tokens)%s\n", sh->conv.messages[sh->conv.count - 1].len / 1024.0, tokenizer_exact() ? "" : "~",
+                   (unsigned long)(attached - TOKENS_PER_MESSAGE), fits ? ", it will be sent with the next prompt." : ".");
+            if (!fits)
+                fprintf(stderr, "Warning: it does not fit in the context of %s, it will be left out of the requests.\n", sh->model);
+        }
+        else if (contains_str_before_space(line, "/import", &remaining_data))
+        {
+            if (remaining_data == NULL)
+            {
+                printf("No source file provided. Aborting.\n");
+                return 0;
+            }
+            /* A number picks a result of the last search, unless there is such a file */
+            if (atoi(remaining_data) >= 1 && (unsigned int)atoi(remaining_data) <= sh->hit_count && access(remaining_data, F_OK) != 0)
+                remaining_data = arena_strdup(&turn_arena, sh->hits[atoi(remaining_data) - 1]);
+            int loaded = session_load(remaining_data, &sh->conv, &sh->model, &sh->temperature);
+            if (loaded == 0)
+                return 0;
+            FILE *fp = loaded == 1 ? fopen(remaining_data, "r") : NULL;
+            if (fp == NULL)
+            {
+                printf("Error while opening file for reading. Aborting.\n");
+                return 0;
+            }
+            struct string output;
+            char buffer[65536];
+            size_t n;
+            init_string_arena(&output, &turn_arena);
+            while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+                append_string(&output, buffer, n);
+            conversation_clear(&sh->conv);
+            char *ptr1, *token = strtok_r(output.ptr, "\r\n", &ptr1);
+            while (token != NULL)
+            {
+                char* remdata = NULL;
+                if (contains_str_before_space(token, "MODEL", &remdata))
+                {
+                    if (remdata != NULL)
+                        sh->model = arena_strdup(&session_arena, remdata);
+                }
+                else if (contains_str_before_space(token, "TEMP", &remdata))
+                {
+                    if (remdata != NULL)
+                        sh->temperature = atof(remdata);
+                }
+                else if (contains_str_before_space(token, "SYS", &remdata))
+                {
+                    if (remdata != NULL && conversation_import_messages(&sh->conv, remdata, true) != 0)
+                        fprintf(stderr, "Could not parse the system prompt of the imported conversation.\n");
+                }
+                else if (contains_str_before_space(token, "CONV", &remdata))
+                {
+                    if (remdata != NULL && conversation_import_messages(&sh->conv, remdata, false) != 0)
+                        fprintf(stderr, "Could not parse the imported conversation.\n");
+                }
+                else if (contains_str_before_space(token, "PIN", &remdata))
+                {
+                    char *ptr2, *number = remdata != NULL ? strtok_r(remdata, " ", &ptr2) : NULL;
+                    for (; number != NULL; number = strtok_r(NULL, " ", &ptr2))
+                    {
+                        size_t index = strtoul(number, NULL, 10);
+                        if (index >= 1 && index <= sh->conv.count)
+                            sh->conv.messages[index - 1].pinned = true;
+                    }
+                }
+                token = strtok_r(NULL, "\r\n", &ptr1);
+            }
+            fclose(fp);
+        }
+        else if (contains_str_before_space(line, "/exit", &remaining_data))
+            return 1;
+        else
+        {
+            fprintf(stderr, "Unknown command. Type /help for command usage.\n");
+        }
+    }
+    else if ((line[0] != '\0' || line == NULL) && sh->apikey != NULL)
+    {
+        size_t prev_count = sh->conv.count;
+        if (conversation_append(&sh->conv, ROLE_USER, line, strlen(line)) != 0)
+            return 0;
+        conversation_fit(&sh->conv, sh->auto_budget ? context_budget(sh->model) : sh->budget);
+        if (context_check(&sh->conv, sh->model, true) != 0)
+        {
+            fprintf(stderr, "Use /reset to start a new conversation, or /model to pick a model with a larger context.\n");
+            conversation_truncate(&sh->conv, prev_count);
+            return 0;
+        }
+
+        uint64_t key[2];
+        unsigned int tokens_before = tokens;
+        bool stream = sh->stream;
+        cache_key(sh->model, sh->temperature, &sh->conv, key);
+        char *result = cache_lookup(cache.enabled, &turn_arena, key, NULL);
+        bool cached = result != NULL ? true : false;
+        if (cached)
+        {
+            usage_log(sh->model, NULL, NULL, 0, USAGE_CACHED);
+            printf("%s\n", result);
+        }
+        else
+        {
+            struct request_body body;
+            build_request(&body, &turn_arena, sh->model, sh->temperature, &sh->conv, stream);
+            shell_busy(sh, true);
+            result = chatgpt_curl_perform(&body, sh->apikey, stream);
+            shell_busy(sh, false);
+            if (result != NULL)
+                cache_store(cache.enabled, key, result, strlen(result), tokens - tokens_before);
+        }
+        if (result == NULL)
+        {
+            conversation_truncate(&sh->conv, prev_count);
+            return 0;
+        }
+        if (!stream && !cached)
+            printf("%s\n", result);
+        conversation_append(&sh->conv, ROLE_ASSISTANT, result, strlen(result));
+        conversation_fit(&sh->conv, sh->auto_budget ? context_budget(sh->model) : sh->budget);
+        if (sh->show_usage)
+        {
+            size_t limit = model_context_limit(sh->model);
+            char context[64];
+            if (limit != 0)
+                snprintf(context, sizeof(context), "context %s%lu/%lu tokens", tokenizer_exact() ? "" : "~",
+                         (unsigned long)conversation_tokens(&sh->conv), (unsigned long)limit);
+            else
+                snprintf(context, sizeof(context), "context %s%lu tokens", tokenizer_exact() ? "" : "~",
+                         (unsigned long)conversation_tokens(&sh->conv));
+            if (cached)
+                printf("\n-- Used %d tokens (in total), %s, answered from cache --\n", tokens, context);
+            else if (compress_requests && transport.last_sent < transport.last_length)
+                printf("\n-- Used %d tokens (in total), %s, %s connection, request %.1f KB gzipped to %.1f KB --\n", tokens, context,
+                       transport.last_reused ? "reused" : "new", transport.last_length / 1024.0, transport.last_sent / 1024.0);
+            else if (compress_requests)
+                printf("\n-- Used %d tokens (in total), %s, %s connection, request %.1f KB uncompressed --\n", tokens, context,
+                       transport.last_reused ? "reused" : "new", transport.last_length / 1024.0);
+            else
+                printf("\n-- Used %d tokens (in total), %s, %s connection --\n", tokens, context, transport.last_reused ? "reused" : "new");
+        }
+        if (sh->debug)
+            printf("-- Turn arena: %lu bytes allocated (peak %lu), session arena: %lu bytes --\n",
+                   (unsigned long)turn_arena.allocated, (unsigned long)turn_arena.peak, (unsigned long)session_arena.allocated);
+    }
+    else if (sh->apikey == NULL)
+    {
+        fprintf(stderr, "No API key provided. Please specify it with the /apikey shell command, or re-run the program with the '--setup' flag to configure it permanently.\n");
+    }
+    else
+    {
+        fprintf(stderr, "No message or command provided.\n");
+    }
+    return 0;
+}
+
+/*
+    Crash journal of the interactive shell: what changes in the conversation after every line is
+    appended to ~/.chatgpt-client-journal as session records (see session_save()), each with a
+    CRC32 to leave out the last one if the write was cut. The shell only copies the records to a
+    queue; a writer thread writes everything queued while its last fdatasync() ran in one go. When
+    the conversation is replaced, or the journal holds more than twice what it describes, a
+    checkpoint with the whole state is written to a new file and renamed over it. The journal
+    is removed when the shell exits, so there is only one to recover after a crash or a kill.
+*/
+#define JOURNAL_MAGIC "CGPTJNL1"
+#define JOURNAL_COMPACT (1024 * 1024) /* Journals smaller than this are not compacted */
+
+struct journal_record
+{
+    struct session_record record; /* 'P'in records hold the number of the message, pinned or not by the flags */
+    uint32_t check;               /* CRC32 of `record` and the content */
+};
+
+struct journal
+{
+    char *path;
+    int fd;          /* -1 when not journaling */
+    int dir_fd;      /* To make renames durable */
+    off_t offset;    /* End of the journal, owned by the writer */
+    char *queued;    /* Records waiting for the writer... */
+    size_t queued_len;
+    size_t queued_capacity;
+    bool checkpoint; /* ...which start a new journal */
+    bool stop;
+    bool failed;
+    size_t count;    /* Messages the journal holds... */
+    unsigned long generation; /* ...and the generation of the conversation they belong to */
+    bool *pinned;
+    size_t pinned_capacity;
+    char *model;
+    char *system;
+    float temperature;
+    uint64_t size;   /* Bytes queued since the last checkpoint */
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct journal journal = { NULL, -1, -1, 0, NULL, 0, 0, false, false, false, 0, 0, NULL, 0, NULL, NULL, 0, 0 };
+
+/* Room for `len` more bytes at the end of the queue; the caller holds journal.lock */
+char *journal_reserve(size_t len)
+{
+    char *queued;
+
+    if (journal.queued_len + len > journal.queued_capacity)
+    {
+        size_t capacity = journal.queued_capacity ? journal.queued_capacity : 4096;
+        while (journal.queued_len + len > capacity)
+            capacity *= 2;
+        if ((queued = realloc(journal.queued, capacity)) == NULL)
+            return NULL;
+        journal.queued = queued;
+        journal.queued_capacity = capacity;
+    }
+    queued = journal.queued + journal.queued_len;
+    journal.queued_len += len;
+    journal.size += len;
+    return queued;
+}
+
+int journal_queue(char type, uint8_t flags, const char *data, size_t len)
+{
+    struct journal_record r;
+    char *p = journal_reserve(sizeof(r) + len);
+
+    if (p == NULL)
+        return -1;
+    memset(&r, 0, sizeof(r));
+    r.record.type = type;
+    r.record.flags = flags;
+    r.record.len = len;
+    r.check = crc32(crc32(0L, (const Bytef *)&r.record, sizeof(r.record)), (const Bytef *)data, len);
+    memcpy(p, &r, sizeof(r));
+    memcpy(p + sizeof(r), data, len);
+    return 0;
+}
+
+int journal_queue_message(const struct conversation *conv, size_t i)
+{
+    const struct message *msg = &conv->messages[i];
+    char number[24];
+    uint8_t flags = msg->pinned ? SESSION_PINNED : 0;
+
+    /* Messages already in the journal can only have been pinned or unpinned */
+    if (i < journal.count)
+    {
+        sprintf(number, "%lu", (unsigned long)i);
+        return journal_queue('P', flags, number, strlen(number));
+    }
+    if (msg->attachment != NULL)
+    {
+        const struct attachment *a = msg->attachment;
+        char *ref = arena_alloc(&turn_arena, strlen(a->path) + 34);
+        sprintf(ref, "%016llx%016llx %s", (unsigned long long)a->hash[0], (unsigned long long)a->hash[1], a->path);
+        return journal_queue('F', flags, ref, strlen(ref));
+    }
+    return journal_queue(msg->role == ROLE_ASSISTANT ? 'A' : 'U', flags, msg->content, msg->len);
+}
+
+/* Replace the journal with the queued checkpoint; runs in the writer thread */
+int journal_replace(const char *data, size_t len)
+{
+    char *tmp_path = malloc(strlen(journal.path) + 5);
+    int fd;
+
+    if (tmp_path == NULL)
+        return -1;
+    sprintf(tmp_path, "%s.tmp", journal.path);
+    if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+    {
+        free(tmp_path);
+        return -1;
+    }
+    /* Hold the lock on the new file before anyone can open it */
+    if (flock(fd, LOCK_EX) != 0 || write_all_at(fd, data, len, 0) != 0 || fdatasync(fd) != 0 ||
+        rename(tmp_path, journal.path) != 0)
+    {
+        close(fd);
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+    if (journal.dir_fd != -1)
+        fsync(journal.dir_fd);
+    close(journal.fd);
+    journal.fd = fd;
+    journal.offset = len;
+    return 0;
+}
+
+void *journal_writer(void *unused)
+{
+    char *writing = NULL;
+    size_t writing_capacity = 0, len;
+    bool checkpoint;
+    int failed;
+
+    pthread_mutex_lock(&journal.lock);
+    for (;;)
+    {
+        while (journal.queued_len == 0 && !journal.stop)
+            pthread_cond_wait(&journal.wake, &journal.lock);
+        if (journal.queued_len == 0)
+            break;
+
+        /* Take everything queued, leaving the shell an empty buffer to go on */
+        char *swap = journal.queued;
+        size_t swap_capacity = journal.queued_capacity;
+        journal.queued = writing;
+        journal.queued_capacity = writing_capacity;
+        writing = swap;
+        writing_capacity = swap_capacity;
+        len = journal.queued_len;
+        journal.queued_len = 0;
+        checkpoint = journal.checkpoint;
+        journal.checkpoint = false;
+        pthread_mutex_unlock(&journal.lock);
+
+        if (checkpoint)
+            failed = journal_replace(writing, len);
+        else if ((failed = write_all_at(journal.fd, writing, len, journal.offset)) == 0)
+        {
+            journal.offset += len;
+            failed = fdatasync(journal.fd);
+        }
+
+        pthread_mutex_lock(&journal.lock);
+        if (failed != 0)
+            journal.failed = true;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    free(writing);
+    return NULL;
+}
+
+bool journal_same(const char *a, const char *b)
+{
+    return a == NULL || b == NULL ? a == b : strcmp(a, b) == 0;
+}
+
+/* Remember the state of `sh` as the one the journal describes */
+int journal_track(struct shell *sh)
+{
+    size_t i;
+
+    if (sh->conv.count > journal.pinned_capacity)
+    {
+        size_t capacity = journal.pinned_capacity ? journal.pinned_capacity : 64;
+        bool *pinned;
+        while (capacity < sh->conv.count)
+            capacity *= 2;
+        if ((pinned = realloc(journal.pinned, capacity * sizeof(bool))) == NULL)
+            return -1;
+        journal.pinned = pinned;
+        journal.pinned_capacity = capacity;
+    }
+    for (i = 0; i < sh->conv.count; i++)
+        journal.pinned[i] = sh->conv.messages[i].pinned;
+    journal.count = sh->conv.count;
+    journal.generation = sh->conv.generation;
+    if (!journal_same(journal.model, sh->model))
+    {
+        free(journal.model);
+        journal.model = strdup(sh->model);
+    }
+    if (!journal_same(journal.system, sh->conv.system))
+    {
+        free(journal.system);
+        journal.system = sh->conv.system != NULL ? strdup(sh->conv.system) : NULL;
+    }
+    journal.temperature = sh->temperature;
+    return 0;
+}
+
+/* Stop journaling, after writing what is queued; `discard` removes the journal */
+void journal_close(bool discard)
+{
+    if (journal.fd == -1)
+        return;
+    pthread_mutex_lock(&journal.lock);
+    journal.stop = true;
+    pthread_cond_signal(&journal.wake);
+    pthread_mutex_unlock(&journal.lock);
+    pthread_join(journal.writer, NULL);
+    if (discard)
+        remove(journal.path);
+    close(journal.fd);
+    journal.fd = -1;
+    if (journal.dir_fd != -1)
+        close(journal.dir_fd);
+    journal.dir_fd = -1;
+    free(journal.queued);
+    free(journal.pinned);
+    free(journal.model);
+    free(journal.system);
+    journal.queued = NULL;
+    journal.pinned = NULL;
+    journal.model = NULL;
+    journal.system = NULL;
+    journal.queued_len = journal.queued_capacity = journal.pinned_capacity = 0;
+    pthread_mutex_destroy(&journal.lock);
+    pthread_cond_destroy(&journal.wake);
+}
+
+/* Queue the changes of `sh` since the last call, or a checkpoint if they cannot be told apart */
+void journal_sync(struct shell *sh)
+{
+    struct conversation *conv = &sh->conv;
+    uint64_t live = 0;
+    char f_temp[32];
+    size_t i;
+    int failed = 0;
+
+    if (journal.fd == -1)
+        return;
+    for (i = 0; i < conv->count; i++)
+        live += sizeof(struct journal_record) + (conv->messages[i].attachment != NULL ? 0 : conv->messages[i].len);
+
+    pthread_mutex_lock(&journal.lock);
+    if (journal.failed)
+    {
+        pthread_mutex_unlock(&journal.lock);
+        fprintf(stderr, "Warning: the conversation journal cannot be written, it will not be recovered after a crash.\n");
+        journal_close(true);
+        return;
+    }
+    snprintf(f_temp, sizeof(f_temp), "%.1f", sh->temperature);
+    if (conv->count < journal.count || conv->generation != journal.generation ||
+        (journal.size > JOURNAL_COMPACT && journal.size > 2 * live))
+    {
+        /* Whatever was still queued is superseded by the checkpoint */
+        char *magic;
+        journal.queued_len = 0;
+        journal.size = 0;
+        journal.count = 0;
+        journal.checkpoint = true;
+        if ((magic = journal_reserve(8)) != NULL)
+            memcpy(magic, JOURNAL_MAGIC, 8);
+        failed |= magic == NULL;
+        failed |= journal_queue('M', 0, sh->model, strlen(sh->model));
+        failed |= journal_queue('T', 0, f_temp, strlen(f_temp));
+        if (conv->system != NULL)
+            failed |= journal_queue('S', 0, conv->system, strlen(conv->system));
+    }
+    else
+    {
+        if (!journal_same(journal.model, sh->model))
+            failed |= journal_queue('M', 0, sh->model, strlen(sh->model));
+        if (journal.temperature != sh->temperature)
+            failed |= journal_queue('T', 0, f_temp, strlen(f_temp));
+        if (!journal_same(journal.system, conv->system))
+            failed |= journal_queue('S', 0, conv->system != NULL ? conv->system : "", conv->system != NULL ? strlen(conv->system) : 0);
+        for (i = 0; i < journal.count; i++)
+        {
+            if (conv->messages[i].pinned != journal.pinned[i])
+                failed |= journal_queue_message(conv, i);
+        }
+    }
+    for (i = journal.count; i < conv->count; i++)
+        failed |= journal_queue_message(conv, i);
+    if (failed != 0 || journal_track(sh) != 0)
+        journal.failed = true;
+    else if (journal.queued_len > 0)
+        pthread_cond_signal(&journal.wake);
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/* Apply a record of the journal to `sh` */
+int journal_replay(struct shell *sh, const struct session_record *record, const char *data)
+{
+    char *text = arena_strndup(&turn_arena, data, record->len);
+    bool pinned = (record->flags & SESSION_PINNED) ? true : false;
+    size_t i;
+
+    switch (record->type)
+    {
+    case 'M':
+        sh->model = arena_strdup(&session_arena, text);
+        break;
+    case 'T':
+        sh->temperature = atof(text);
+        break;
+    case 'S':
+        conversation_set_system(&sh->conv, record->len > 0 ? text : NULL);
+        break;
+    case 'U':
+    case 'A':
+        if (conversation_append(&sh->conv, record->type == 'A' ? ROLE_ASSISTANT : ROLE_USER, data, record->len) != 0)
+            return -1;
+        sh->conv.messages[sh->conv.count - 1].pinned = pinned;
+        break;
+    case 'F':
+        if (session_load_attachment(&sh->conv, text) != 0)
+            return -1;
+        sh->conv.messages[sh->conv.count - 1].pinned = pinned;
+        break;
+    case 'P':
+        if ((i = strtoul(text, NULL, 10)) < sh->conv.count)
+            sh->conv.messages[i].pinned = pinned;
+        break;
+    }
+    return 0;
+}
+
+/*
+    Start journaling `sh`, recovering into it first the conversation of a shell that did not exit.
+    Returns how many messages were recovered, -1 if the conversation cannot be journaled.
+*/
+int journal_open(struct shell *sh)
+{
+    struct journal_record r;
+    struct stat st, path_st;
+    size_t offset = 0;
+    char *map = MAP_FAILED, *slash;
+    int fd;
+
+    for (;;)
+    {
+        if ((fd = open(journal.path, O_RDWR | O_CREAT, 0600)) == -1)
+            return -1;
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+        {
+            close(fd);
+            fprintf(stderr, "Warning: another shell is journaling its conversation, this one will not be recovered after a crash.\n");
+            return -1;
+        }
+        if (fstat(fd, &st) != 0 || stat(journal.path, &path_st) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        /* Unless a checkpoint replaced the file before it was locked */
+        if (st.st_ino == path_st.st_ino && st.st_dev == path_st.st_dev)
+            break;
+        close(fd);
+    }
+
+    if (st.st_size >= 8)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED && memcmp(map, JOURNAL_MAGIC, 8) == 0)
+    {
+        offset = 8;
+        while (offset + sizeof(r) <= (size_t)st.st_size)
+        {
+            memcpy(&r, map + offset, sizeof(r));
+            if (r.record.len > st.st_size - offset - sizeof(r) ||
+                crc32(crc32(0L, (const Bytef *)&r.record, sizeof(r.record)), (const Bytef *)map + offset + sizeof(r), r.record.len) != r.check ||
+                journal_replay(sh, &r.record, map + offset + sizeof(r)) != 0)
                 break;
-            }
+            offset += sizeof(r) + r.record.len;
+        }
     }
-    else
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    /* Appends go after the last whole record, leaving out one a crash cut */
+    if ((offset == 0 && pwrite(fd, JOURNAL_MAGIC, 8, 0) != 8) || ftruncate(fd, offset > 0 ? offset : 8) != 0)
     {
-        printf("\n");
-        for (i = 0; i < 13; i++)
-            if (strncmp(available_commands[i], text, text_length) == 0)
-                printf("%s\n", available_commands[i]);
-        rl_on_new_line();
-        rl_redisplay();
-        printf("\a");
+        close(fd);
+        return -1;
     }
 
-    return NULL;
+    journal.fd = fd;
+    journal.offset = offset > 0 ? offset : 8;
+    journal.size = journal.offset;
+    journal.failed = false;
+    journal.stop = false;
+    slash = strrchr(journal.path, '/');
+    if (slash != NULL)
+    {
+        char *dir = arena_strndup(&turn_arena, journal.path, slash - journal.path + 1);
+        journal.dir_fd = open(dir, O_RDONLY);
+    }
+    pthread_mutex_init(&journal.lock, NULL);
+    pthread_cond_init(&journal.wake, NULL);
+    if (journal_track(sh) != 0 || pthread_create(&journal.writer, NULL, journal_writer, NULL) != 0)
+    {
+        fprintf(stderr, "Warning: the conversation journal cannot be started, it will not be recovered after a crash.\n");
+        pthread_mutex_destroy(&journal.lock);
+        pthread_cond_destroy(&journal.wake);
+        if (journal.dir_fd != -1)
+            close(journal.dir_fd);
+        journal.dir_fd = -1;
+        close(fd);
+        journal.fd = -1;
+        return -1;
+    }
+    return sh->conv.count;
 }
 
-char **custom_completion(const char *text, int start, int end)
+int shell_mode(char *apikey, char *def_model)
 {
-    rl_attempted_completion_over = 1;
+    struct shell sh;
+    char *line;
+    int done = 0;
 
-    return rl_completion_matches(text, autocomplete);
-}
-
-/* Handle Ctrl+C presses in shell mode (else will quit the program) */
-void ctrlCHandler(int sig_num)
-{
-    signal(SIGINT, ctrlCHandler);
-    printf("\n");
-    rl_on_new_line();
-    rl_replace_line("", 0);
-    rl_redisplay();
-}
+    memset(&sh, 0, sizeof(sh));
+    sh.apikey = apikey;
+    sh.orig_apikey = apikey;
+    sh.orig_pool = pool;
+    sh.orig_compress = compress_requests;
+    sh.def_model = def_model;
+    sh.model = def_model;
+    sh.temperature = 1.0F;
+    conversation_init(&sh.conv);
+    sh.show_usage = true;
+    sh.stream = true;
+    sh.auto_budget = true;
+    sh.interactive = isatty(fileno(stdin)) ? true : false;
+    shell = &sh;
 
-int shell_mode(char *apikey, char *def_model)
-{
     signal(SIGINT, ctrlCHandler);
-    char *orig_apikey = NULL, *endpoint = "https://api.openai.com/v1/chat/completions";
-    if (apikey != NULL)
+    printf("ChatGPT conversation shell. Type /help for command usage.\n\n");
+    if (sh.interactive && journal.path != NULL)
     {
-        orig_apikey = apikey;
+        int recovered = journal_open(&sh);
+        if (recovered > 0)
+            printf("Recovered the conversation of a shell that did not exit (%d messages). Run /reset to start a new one.\n\n", recovered);
     }
-    printf("ChatGPT conversation shell. Type /help for command usage.\n\n");
-    char *prompt_1 = "{\"model\": \"";
-    char *model = def_model;
-    char *prompt_2 = "\", \"temperature\": ";
-    float temperature = 1.0F;
-    char *prompt_3 = ", \"messages\": [";
-    char *prompt_system = "";
-    char *conversation = "";
-    char *prompt_4 = "]}";
-
-    bool show_usage = true;
+    rl_attempted_completion_function = custom_completion;
+    rl_variable_bind("bell-style", "none");
+    rl_catch_signals = 0;
+    shell_display(false, NULL);
+    rl_callback_handler_install("", shell_line_handler);
+    transport.input = rl_callback_read_char;
 
-    while (true)
+    while (!done)
     {
-        char *read_result;
-
-        rl_attempted_completion_function = custom_completion;
-        rl_variable_bind("bell-style", "none");
-
-        while ((read_result = readline(concat(model, "> "))) != NULL)
+        arena_reset(&turn_arena);
+        if ((line = shell_read(&sh, arena_concat(&turn_arena, sh.model, "> "))) == NULL)
         {
-            if (strlen(read_result) > 0)
-                add_history(read_result);
-
-            size_t len = strlen(read_result);
-            if (len > 0 && read_result[len - 1] == '\n')
-                read_result[len - 1] = '\0';
-
-            if (read_result[0] == '/')
-            {
-                char *remaining_data = NULL;
-                if (contains_str_before_space(read_result, "/help", &remaining_data))
-                {
-                    printf("Commands starting with / are shell commands, else they are sent to the model.\n\n");
-                    printf("Available shell commands:\n");
-                    printf("  /system <prompt>        - Change the \"system\" prompt, run /system with no prompt to clear.\n");
-                    printf("  /model <model>          - Change the model used, run /model with no model to reset.\n");
-                    printf("  /apikey <key>           - Change or set the API key used, run /apikey with no key to reset.\n");
-                    printf("  /showusage <true|false> - Show used tokens during conversation. Run with no value to reset.\n");
-                    printf("  /temperature <value>    - Change model's temperature. <value> must be or be between 0.0 and 2.0. Run with no value to reset.\n");
-                    printf("  /reset                  - Reset the conversation.\n");
-                    printf("  /import <file>          - Import conversation from <file>.\n");
-                    printf("  /export <file>          - Export current conversation to <file>.\n");
-                    printf("  /endpoint <URL>         - (EXPERT ONLY) Change the API endpoint used, run /endpoint with no URL to reset.\n");
-                    printf("  /clear                  - Clear terminal screen.\n");
-                    printf("  /help                   - Show this help message.\n");
-                    printf("  /version                - Show application version.\n");
-                    printf("  /exit                   - Exit the shell.\n");
-                }
-                else if (contains_str_before_space(read_result, "/system", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        prompt_system = "";
-                        printf("System prompt successfully cleared.\n");
-                        continue;
-                    }
-                    prompt_system = concat("{\"role\": \"system\", \"content\": \"", escape_string(remaining_data));
-                    prompt_system = concat(prompt_system, "\"},");
-                    printf("System prompt successfully set/changed.\n");
-                }
-                else if (contains_str_before_space(read_result, "/model", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        model = def_model;
-                        printf("Model successfully reset (set to %s).\n", model);
-                        continue;
-                    }
-                    model = remaining_data;
-                    printf("Model successfully set/changed.\n");
-                }
-                else if (contains_str_before_space(read_result, "/apikey", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        apikey = orig_apikey;
-                        printf("API key successfully reset.\n");
-                        continue;
-                    }
-                    apikey = remaining_data;
-                    printf("API key successfully set/changed.\n");
-                }
-                else if (contains_str_before_space(read_result, "/endpoint", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        endpoint = "https://api.openai.com/v1/chat/completions";
-                        printf("API endpoint successfully reset.\n");
-                        continue;
-                    }
-                    endpoint = remaining_data;
-                    printf("API endpoint successfully set/changed.\n");
-                }
-                else if (contains_str_before_space(read_result, "/showusage", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        show_usage = true;
-                        printf("Show usage successfully reset (set to %s).\n", show_usage ? "true" : "false");
-                        continue;
-                    }
-                    if (strcmp(remaining_data, "false") == 0 || strcmp(remaining_data, "0") == 0)
-                    {
-                        show_usage = false;
-                        printf("Show usage set to false.\n");
-                    }
-                    else if (strcmp(remaining_data, "true") == 0 || strcmp(remaining_data, "1") == 0)
-                    {
-                        show_usage = true;
-                        printf("Show usage set to true.\n");
-                    }
-                    else
-                        printf("Show usage value not recognized.\n");
-                }
-                else if (contains_str_before_space(read_result, "/temperature", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        temperature = 1.0F;
-                        printf("Temperature successfully reset (set to %.1f).\n", temperature);
-                        continue;
-                    }
-                    if (0.0F <= atof(remaining_data) && atof(remaining_data) <= 2.0F)
-                    {
-                        temperature = atof(remaining_data);
-                        printf("Temperature set to %.1f.\n", temperature);
-                    }
-                    else
-                        printf("Temperature invalid. Must be greater or equal to 0 and less or equal to 2.\n");
-                }
-                else if (contains_str_before_space(read_result, "/reset", &remaining_data))
-                {
-                    conversation = "";
-                    prompt_system = "";
-                    printf("Conversation successfully reset.\n");
-                }
-                else if (contains_str_before_space(read_result, "/version", &remaining_data))
-                    printf("%s\n", APP_VERSION);
-                else if (contains_str_before_space(read_result, "/clear", &remaining_data))
-                {
-                    rl_clear_display(0, 0);
-                    printf("\r");
-                    rl_replace_line("", 0);
-                    rl_redisplay();
-                }
-                else if (contains_str_before_space(read_result, "/export", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        printf("No destination file provided. Aborting.\n");
-                        continue;
-                    }
-                    FILE *fp = fopen(remaining_data, "w");
-                    if (fp == NULL)
-                    {
-                        printf("Error while opening file for writing. Aborting.\n");
-                        continue;
-                    }
-                    fprintf(fp, "MODEL %s\nTEMP %.1f\nSYS %s\nCONV %s\n", model, temperature, prompt_system, conversation);
-                    fclose(fp);
-                }
-                else if (contains_str_before_space(read_result, "/import", &remaining_data))
-                {
-                    if (remaining_data == NULL)
-                    {
-                        printf("No source file provided. Aborting.\n");
-                        continue;
-                    }
-                    FILE *fp = fopen(remaining_data, "r");
-                    if (fp == NULL)
-                    {
-                        printf("Error while opening file for reading. Aborting.\n");
-                        continue;
-                    }
-                    char* output = "";
-                    int f;
-                    while ((f = fgetc(fp)) != EOF)
-                    {
-                        if (f != '\r')
-                        {
-                            char str[2];
-                            str[0] = f;
-                            str[1] = '\0';
-                            output = concat(output, str);
-                        }
-                    }
-                    char *ptr1, *token = strtok_r(output, "\n", &ptr1);
-                    while (token != NULL)
-                    {
-                        char* remdata = NULL;
-                        if (contains_str_before_space(token, "MODEL", &remdata))
-                        {
-                            if (remdata != NULL)
-                                model = remdata;
-                        }
-                        else if (contains_str_before_space(token, "TEMP", &remdata))
-                        {
-                            if (remdata != NULL)
-                                temperature = atof(remdata);
-                        }
-                        else if (contains_str_before_space(token, "SYS", &remdata))
-                        {
-                            if (remdata != NULL)
-                                prompt_system = remdata;
-                        }
-                        else if (contains_str_before_space(token, "CONV", &remdata))
-                        {
-                            if (remdata != NULL)
-                                conversation = remdata;
-                        }
-                        token = strtok_r(NULL, "\n", &ptr1);
-                    }
-                    fclose(fp);
-                }
-                else if (contains_str_before_space(read_result, "/exit", &remaining_data))
-                {
-                    printf("Bye!\n");
-                    return 0;
-                }
-                else
-                {
-                    fprintf(stderr, "Unknown command. Type /help for command usage.\n");
-                }
-            }
-            else if ((read_result[0] != '\0' || read_result == NULL) && apikey != NULL)
-            {
-                char *prev_conversation = "";
-                prev_conversation = concat(prev_conversation, conversation);
-                if (strcmp(conversation, "") != 0)
-                    conversation = concat(conversation, ",");
-                conversation = concat(conversation, "{\"role\": \"user\", \"content\": \"");
-                conversation = concat(conversation, escape_string(read_result));
-                conversation = concat(conversation, "\"}");
-
-                char *data = (char *)malloc(strlen(prompt_1) + 1);
-                strcpy(data, prompt_1);
-                data = concat(data, model);
-                data = concat(data, prompt_2);
-                int f_temp_length = snprintf(NULL, 0, "%.1f", temperature) + 1;
-                char *f_temp = malloc(f_temp_length);
-                snprintf(f_temp, f_temp_length, "%.1f", temperature);
-                data = concat(data, f_temp);
-                free(f_temp);
-                data = concat(data, prompt_3);
-                if (strcmp(prompt_system, "") != 0)
-                    data = concat(data, prompt_system);
-                data = concat(data, conversation);
-                data = concat(data, prompt_4);
-                char *result = chatgpt_curl_perform(data, apikey, endpoint);
-                free(data);
-                if (result == NULL)
-                {
-                    conversation = prev_conversation;
-                    continue;
-                }
-                printf("%s\n", result);
-                if (show_usage)
-                    printf("\n-- Used %d tokens (in total) --\n", tokens);
-                conversation = concat(conversation, ",{\"role\": \"assistant\", \"content\": \"");
-                conversation = concat(conversation, escape_string(result));
-                conversation = concat(conversation, "\"}");
-                free(result);
-            }
-            else if (apikey == NULL)
-            {
-                fprintf(stderr, "No API key provided. Please specify it with the /apikey shell command, or re-run the program with the '--setup' flag to configure it permanently.\n");
-            }
-            else
-            {
-                fprintf(stderr, "No message or command provided.\n");
-            }
+            printf("\n");
+            break;
         }
+        done = shell_execute(&sh, line);
+        free(line);
+        journal_sync(&sh);
+    }
+    journal_close(true);
 
-        free(read_result);
+    rl_callback_handler_remove();
+    transport.input = NULL;
+    while (sh.queued > 0)
+    {
+        free(sh.queue[sh.head].text);
+        sh.head = (sh.head + 1) % SHELL_QUEUE_MAX;
+        sh.queued--;
     }
+    while (sh.hit_count > 0)
+        free(sh.hits[--sh.hit_count]);
+    conversation_clear(&sh.conv);
+    free(sh.conv.messages);
+    arena_free(&turn_arena);
+    arena_free(&session_arena);
+    printf("Bye!\n");
     return 0;
 }
 
+/* Read one line from standard input into arena `a`, without the trailing newline */
+char *read_stdin_line(struct arena *a)
+{
+    struct string line;
+    int c;
+
+    init_string_arena(&line, a);
+    while ((c = getchar()) != EOF && c != '\n')
+    {
+        char ch = c;
+        append_string(&line, &ch, 1);
+    }
+    return line.ptr;
+}
+
 int setup(char *configdir, char *apikey, char *model)
 {
     printf("Simple ChatGPT command-line utility for Unix-based systems.\n");
@@ -658,14 +7935,8 @@ int setup(char *configdir, char *apikey, char *model)
         while (true)
         {
             printf("> ");
-            char *selection = "", c = '\n';
-            while ((c = getchar()) != EOF && c != '\n')
-            {
-                char str[2];
-                str[0] = c;
-                str[1] = '\0';
-                selection = concat(selection, str);
-            }
+            arena_reset(&turn_arena);
+            char *selection = read_stdin_line(&turn_arena);
             if (strcmp(selection, "1") == 0)
             {
                 printf("Please enter your OpenAI API key in the prompt below.\n");
@@ -673,15 +7944,7 @@ int setup(char *configdir, char *apikey, char *model)
                 printf("You might be billed for the usage you make within this application.\n");
                 printf("To unset this value, please enter '(none)'.\n");
                 printf("To return to the previous menu, press enter.\n[1]> ");
-                char *apistr = "";
-                c = '\n';
-                while ((c = getchar()) != EOF && c != '\n')
-                {
-                    char str[2];
-                    str[0] = c;
-                    str[1] = '\0';
-                    apistr = concat(apistr, str);
-                }
+                char *apistr = read_stdin_line(&session_arena);
                 if (strcmp(apistr, "(none)") == 0)
                     apikey = NULL;
                 else if (strlen(apistr) != 0)
@@ -694,15 +7957,7 @@ int setup(char *configdir, char *apikey, char *model)
                 printf("Check your available models: https://platform.openai.com/playground?mode=chat\n");
                 printf("To unset this value, please enter '(none)'.\n");
                 printf("To return to the previous menu, press enter.\n[2]> ");
-                char *modelstr = "";
-                c = '\n';
-                while ((c = getchar()) != EOF && c != '\n')
-                {
-                    char str[2];
-                    str[0] = c;
-                    str[1] = '\0';
-                    modelstr = concat(modelstr, str);
-                }
+                char *modelstr = read_stdin_line(&session_arena);
                 if (strcmp(modelstr, "(none)") == 0)
                     model = NULL;
                 else if (strlen(modelstr) != 0)
@@ -744,13 +7999,167 @@ int setup(char *configdir, char *apikey, char *model)
     return 0;
 }
 
+/*
+    Throughput of JSON escaping and unescaping with every kernel this CPU runs, over the file
+    `arg`, or over `arg` MB (64 if NULL) of log lines with quotes, escapes, colors and UTF-8.
+*/
+int json_benchmark(const char *arg)
+{
+    const char *lines[] = { "2023-12-08 10:42:17.123 INFO  worker[42]: request \"GET /v1/models\" took 12 ms\tstatus=200\n",
+                            "2023-12-08 10:42:17.131 \x1b[33mWARN\x1b[0m  cache: path C:\\Users\\lumito\\AppData is not writable\n",
+                            "2023-12-08 10:42:17.140 DEBUG parser: \"café\" -> 'caf\\u00e9' (ünïcödé, 日本語, emoji 😀)\n",
+                            "    at com.example.Service.handle(Service.java:118) ~[app.jar:1.4.2]\r\n" };
+    const char *names[] = { "scalar", "sse2", "avx2" }, *prefix = "{\"choices\": [{\"message\": {\"content\": \"";
+    size_t (*kernels[3])(const char *, size_t, bool);
+    size_t size = 64UL * 1024 * 1024, len = 0, escaped_len = 0, unescaped_len = 0, rounds, r, consumed;
+    char *input, *escaped, *reference = NULL, *unescaped = NULL;
+    unsigned int count = 0, k, i = 0;
+    FILE *fp = NULL;
+    struct stat st;
+    struct string document, content, error;
+    struct json_extract x;
+
+    kernels[count++] = json_scan_scalar;
+#ifdef JSON_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels[count++] = json_scan_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        kernels[count++] = json_scan_avx2;
+#endif
+
+    if (arg != NULL && strspn(arg, "0123456789") == strlen(arg) && atoi(arg) > 0)
+        size = (size_t)atoi(arg) * 1024 * 1024;
+    else if (arg != NULL)
+    {
+        if ((fp = fopen(arg, "rb")) == NULL || fstat(fileno(fp), &st) != 0 || st.st_size == 0)
+        {
+            fprintf(stderr, "Error: cannot read '%s'.\n", arg);
+            return 1;
+        }
+        size = st.st_size;
+    }
+    input = malloc(size);
+    escaped = malloc(size * 6);
+    if (input == NULL || escaped == NULL)
+    {
+        fprintf(stderr, "malloc() failed\n");
+        return 1;
+    }
+    if (fp != NULL)
+    {
+        len = fread(input, 1, size, fp);
+        fclose(fp);
+        printf("JSON escaping of '%s' (%.1f MB):\n", arg, len / 1048576.0);
+    }
+    else
+    {
+        while (len < size)
+        {
+            size_t n = strlen(lines[i % 4]);
+            if (n > size - len)
+                n = size - len;
+            memcpy(input + len, lines[i++ % 4], n);
+            len += n;
+        }
+        printf("JSON escaping of %lu MB of log lines:\n", (unsigned long)(size / 1048576));
+    }
+
+    for (k = 0; k < count; k++)
+    {
+        double started, escape_time, unescape_time;
+
+        json_scan = kernels[k];
+        started = now_seconds();
+        for (rounds = 0; rounds == 0 || now_seconds() - started < 0.5; rounds++)
+            escaped_len = json_escape(escaped, size * 6, input, len, &consumed);
+        escape_time = (now_seconds() - started) / rounds;
+        if (reference == NULL)
+            reference = arena_strndup(&session_arena, escaped, escaped_len);
+        else if (memcmp(reference, escaped, escaped_len) != 0)
+        {
+            fprintf(stderr, "Error: the %s kernel escapes differently than the scalar one.\n", names[k]);
+            return 1;
+        }
+
+        init_string(&document);
+        append_string(&document, prefix, strlen(prefix));
+        append_string(&document, escaped, escaped_len);
+        append_string(&document, "\"}}]}", 5);
+        /* Reuse the output buffer, page faults would be measured otherwise */
+        init_string(&content);
+        init_string(&error);
+        started = now_seconds();
+        for (r = 0; r == 0 || now_seconds() - started < 0.5; r++)
+        {
+            content.len = 0;
+            json_extract_init(&x, &content, &error);
+            json_extract_feed(&x, document.ptr, document.len);
+        }
+        unescape_time = (now_seconds() - started) / r;
+        /* Only bytes that were not valid UTF-8 may differ from the input */
+        if (unescaped == NULL)
+        {
+            unescaped = arena_strndup(&session_arena, content.ptr, content.len);
+            unescaped_len = content.len;
+        }
+        if (unescaped_len != content.len || memcmp(unescaped, content.ptr, content.len) != 0 ||
+            (fp == NULL && (content.len != len || memcmp(content.ptr, input, len) != 0)))
+        {
+            fprintf(stderr, "Error: the %s kernel does not unescape what it escaped.\n", names[k]);
+            return 1;
+        }
+        free_string(&content);
+        free_string(&error);
+        free_string(&document);
+
+        printf("  %-6s  escape %6.2f GB/s, unescape %6.2f GB/s\n", names[k], len / escape_time / 1e9, escaped_len / unescape_time / 1e9);
+    }
+
+    free(input);
+    free(escaped);
+    return 0;
+}
+
 int help(char *prog_name)
 {
     printf("Simple ChatGPT command-line utility for Unix-based systems.\n");
     printf("Application version: %s\n\n", APP_VERSION);
-    printf("Usage: %s [ <prompt> | --setup | --help ]\n\n", prog_name);
+    printf("Usage: %s [ --cache | --no-cache ] [ --no-daemon ] [ --metrics-json <file> ] [ --attach <file> ]... [ <prompt> | --batch <file|-> [batch options] | --map <instruction> [map options] [<file>] | --compare <models> <prompt> | --search <words> | --index <file>... | --daemon | --cache-stats | --usage-report [day|model|endpoint] | --count-tokens [<text>] | --setup | --help ]\n\n", prog_name);
     printf("Options:\n");
     printf(" <prompt>: The prompt (question) to send to ChatGPT.\n");
+    printf("  --batch: Send every line of <file> (or standard input with '-') as a separate prompt and\n");
+    printf("           print the results as JSON lines. Lines starting with '{' are JSON requests with\n");
+    printf("           \"prompt\" or \"messages\", and optionally \"system\", \"model\", \"temperature\" and \"id\".\n");
+    printf("           Batch options: --parallel <n> (requests in flight, default 8),\n");
+    printf("                          --order <input|completion> (output order, default input),\n");
+    printf("                          --endpoint <URL> (API endpoint to use, repeat it to spread the requests over several).\n");
+    printf("  --map: Cut <file> (or the standard input) into parts that fit in a request, send every part with\n");
+    printf("           <instruction> (several at the same time) and print the answers in order.\n");
+    printf("           Map options: --reduce <instruction> (merge the answers with it into a single one),\n");
+    printf("                        --parallel <n> (requests in flight, default 8),\n");
+    printf("                        --chunk-tokens <n> (tokens of input per request, default %d).\n", MAPREDUCE_CHUNK);
+    printf("  --compare: Send <prompt> to several models at once (for example, '--compare gpt-4,gpt-3.5-turbo <prompt>')\n");
+    printf("           and print every answer as it arrives, with how long it took and the tokens it used.\n");
+    printf("  --daemon: Stay running in the background of a terminal (for example, '%s --daemon &'), keeping\n", prog_name);
+    printf("           connections to the API open. <prompt> invocations are then forwarded to it through\n");
+    printf("           ~/.chatgpt-client.sock, skipping the connection setup.\n");
+    printf("  --no-daemon: Send <prompt> from this process even if a daemon is running.\n");
+    printf("  --metrics-json: Write how long the phases of the requests took (p50, p90 and p99) to <file>.\n");
+    printf("  --attach: Send the text file <file> with <prompt> (or --compare), without copying it in memory. It can be repeated.\n");
+    printf("  --cache: Answer repeated requests from the local response cache (also 'cache=true' in the\n");
+    printf("           configuration file, with 'cache_ttl=<seconds>' and 'cache_size=<MB>').\n");
+    printf("  --no-cache: Do not use the response cache, even if it is enabled in the configuration file.\n");
+    printf("  --cache-stats: Show the response cache statistics.\n");
+    printf("  --usage-report: Show the tokens, requests and latency of every request made, by day (default), model or\n");
+    printf("           endpoint. They are recorded in ~/.chatgpt-client-usage.\n");
+    printf("  --search: Show the messages of the exported conversations that best match <words>.\n");
+    printf("  --index: Add the conversations exported to <file> <file>... to the search index (/export adds them by itself).\n");
+    printf("  --count-tokens: Print how many tokens <text> (or the standard input) takes, without sending it.\n");
+    printf("           Exact counts need a cl100k_base.tiktoken vocabulary at ~/.chatgpt-client-cl100k_base.tiktoken\n");
+    printf("           (or at the path given by 'tokenizer=<file>' in the configuration file).\n");
+    printf("  --bench-json: Measure how fast JSON strings are escaped and unescaped, over <MB> MB of log lines (64 by\n");
+    printf("           default) or over the contents of <file>.\n");
     printf("  --setup: Run client configuration wizard. Must be run once before using the client.\n");
     printf("   --help: Show this help message.\n\n");
     printf("If no arguments are specified, the program will enter in conversation (shell) mode.\n\n");
@@ -765,14 +8174,16 @@ int help(char *prog_name)
 
 int main(int argc, char **argv)
 {
-    char *homedir, *configdir, *apikey = NULL, *config = "";
+    char *homedir, *configdir, *apikey = NULL;
 
     if ((homedir = getenv("HOME")) == NULL)
     {
         homedir = getpwuid(getuid())->pw_dir;
     }
 
-    configdir = strcat(homedir, "/.chatgpt-client");
+    configdir = arena_concat(&session_arena, homedir, "/.chatgpt-client");
+    if (argc > 1 && strcmp(argv[1], "--bench-json") == 0)
+        return json_benchmark(argc > 2 ? argv[2] : NULL);
 
     FILE *fp = fopen(configdir, "r");
     if (fp == NULL)
@@ -791,55 +8202,97 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    int f;
-    while ((f = fgetc(fp)) != EOF)
-    {
-        if (f != '\r')
-        {
-            char str[2];
-            str[0] = f;
-            str[1] = '\0';
-            config = concat(config, str);
-        }
-    }
+    struct string config;
+    char buffer[4096];
+    size_t n;
+    init_string_arena(&config, &session_arena);
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        append_string(&config, buffer, n);
+    fclose(fp);
 
-    char *ptr1, *ptr2, *model = NULL;
-    char *token = strtok_r(config, "\n", &ptr1);
+    char *ptr1, *model = NULL;
+    char *token = strtok_r(config.ptr, "\r\n", &ptr1);
     while (token != NULL)
     {
-        if (strchr(token, '=') != NULL)
+        char *value = strchr(token, '=');
+        if (value != NULL)
         {
-            char *token2 = strtok_r(token, "=", &ptr2);
-            unsigned short mode = 0;
-            while (token2 != NULL)
-            {
-                if (mode == 1)
-                {
-                    apikey = strdup(token2);
-                    mode = 0;
-                }
-                else if (mode == 2)
-                {
-                    model = strdup(token2);
-                    mode = 0;
-                }
-                else if (!mode)
-                {
-                    if (strcmp(token2, "apikey") == 0)
-                        mode = 1;
-                    else if (strcmp(token2, "model") == 0)
-                        mode = 2;
-                }
-                token2 = strtok_r(NULL, "=", &ptr2);
-            }
+            *value++ = '\0';
+            if (strcmp(token, "apikey") == 0)
+                apikey = value;
+            else if (strcmp(token, "model") == 0)
+                model = value;
+            else if (strcmp(token, "parser") == 0)
+                cjson_parser = strcmp(value, "cjson") == 0 ? true : false;
+            else if (strcmp(token, "compress") == 0)
+                compress_requests = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0) ? true : false;
+            else if (strcmp(token, "cache") == 0)
+                cache.enabled = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0) ? true : false;
+            else if (strcmp(token, "cache_ttl") == 0)
+                cache.ttl = atol(value);
+            else if (strcmp(token, "cache_size") == 0)
+                cache.max_size = strtoul(value, NULL, 10) * 1024 * 1024;
+            else if (strcmp(token, "tokenizer") == 0)
+                tokenizer.path = value;
+            else if (strcmp(token, "endpoint") == 0)
+                pool_add_line(value);
+            else if (strcmp(token, "connect_timeout") == 0)
+                policy.connect_timeout = atof(value);
+            else if (strcmp(token, "first_byte_timeout") == 0)
+                policy.first_byte_timeout = atof(value);
+            else if (strcmp(token, "stall_timeout") == 0)
+                policy.stall_timeout = atof(value);
+            else if (strcmp(token, "timeout") == 0)
+                policy.total_timeout = atol(value);
+            else if (strcmp(token, "retries") == 0)
+                policy.retries = strtoul(value, NULL, 10);
+            else if (strcmp(token, "hedge") == 0)
+                policy.hedge = (strcmp(value, "true") == 0 || strcmp(value, "1") == 0) ? true : false;
         }
-        token = strtok_r(NULL, "\n", &ptr1);
+        token = strtok_r(NULL, "\r\n", &ptr1);
     }
 
-    bool useapi = false;
+    size_t i, attach_count = 0;
+    bool useapi = false, use_daemon = true;
+    char **attach_paths = arena_alloc(&session_arena, argc * sizeof(char *));
+    char *socket_path = arena_concat(&session_arena, configdir, ".sock");
     if (apikey != NULL)
         useapi = true;
 
+    cache.dir = arena_concat(&session_arena, configdir, "-cache");
+    search_index.dir = arena_concat(&session_arena, configdir, "-index");
+    ledger.path = arena_concat(&session_arena, configdir, "-usage");
+    ledger.names_path = arena_concat(&session_arena, configdir, "-usage-names");
+    journal.path = arena_concat(&session_arena, configdir, "-journal");
+    if (tokenizer.path == NULL)
+        tokenizer.path = arena_concat(&session_arena, configdir, "-cl100k_base.tiktoken");
+    if (pool.count == 0)
+        pool_add(DEFAULT_ENDPOINT, NULL);
+    /* Leading options that apply to every mode; drop them so argv[1] is the mode or the prompt */
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cache") == 0)
+            cache.enabled = true;
+        else if (strcmp(argv[i], "--no-cache") == 0)
+            cache.enabled = false;
+        else if (strcmp(argv[i], "--no-daemon") == 0)
+            use_daemon = false;
+        else if (strcmp(argv[i], "--metrics-json") == 0 && i + 1 < argc)
+            metrics.json_path = argv[++i];
+        else if (strcmp(argv[i], "--attach") == 0 && i + 1 < argc)
+            attach_paths[attach_count++] = argv[++i];
+        else
+            break;
+    }
+    argv[i - 1] = argv[0];
+    argv += i - 1;
+    argc -= i - 1;
+    if (attach_count > 0 && (argc < 2 || (strncmp(argv[1], "--", 2) == 0 && strcmp(argv[1], "--compare") != 0)))
+    {
+        fprintf(stderr, "Error: --attach goes with a prompt or --compare (in the shell, use /attach).\n");
+        return 1;
+    }
+
     if (model == NULL)
     {
         if (argc > 1)
@@ -856,7 +8309,7 @@ int main(int argc, char **argv)
         }
     }
     else if (argc < 2)
-        return shell_mode(useapi ? apikey : NULL, model);
+        return metrics_finish(shell_mode(useapi ? apikey : NULL, model));
     else if (argc > 1)
         if (strcmp(argv[1], "--help") == 0)
             return help(argv[0]);
@@ -868,34 +8321,229 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    char *prompt = "";
-
-    size_t i = 0;
-    for (; i < argc; i++)
+    if (strcmp(argv[1], "--cache-stats") == 0)
     {
-        prompt = concat(prompt, argv[i]);
-        if (argc > i + 1)
-            prompt = concat(prompt, " ");
+        cache_print_stats();
+        return 0;
+    }
+    if (strcmp(argv[1], "--usage-report") == 0)
+    {
+        int grouping = usage_grouping(argc > 2 ? argv[2] : NULL);
+        if (grouping < 0)
+            return 1;
+        return usage_report(grouping) != 0 ? 1 : 0;
+    }
+    if (strcmp(argv[1], "--search") == 0)
+    {
+        struct string query;
+        char *paths[INDEX_HITS];
+        int found;
+        init_string_arena(&query, &turn_arena);
+        for (i = 2; i < argc; i++)
+        {
+            append_string(&query, argv[i], strlen(argv[i]));
+            if (argc > i + 1)
+                append_string(&query, " ", 1);
+        }
+        if ((found = index_search(query.ptr, INDEX_HITS, paths)) < 0)
+            return 1;
+        while (found > 0)
+            free(paths[--found]);
+        return 0;
+    }
+    if (strcmp(argv[1], "--index") == 0)
+    {
+        unsigned int indexed = 0;
+        for (i = 2; i < argc; i++)
+        {
+            struct conversation conv;
+            char *session_model = model;
+            float temperature = 1.0F;
+            int loaded;
+            conversation_init(&conv);
+            arena_reset(&turn_arena);
+            if ((loaded = session_load(argv[i], &conv, &session_model, &temperature)) == 1)
+                fprintf(stderr, "%s: saved in the old format, /import and /export it again to index it.\n", argv[i]);
+            else if (loaded != 0)
+                fprintf(stderr, "%s: cannot be read.\n", argv[i]);
+            else if (index_session(argv[i], &conv) != 0)
+                fprintf(stderr, "%s: could not be added to the search index.\n", argv[i]);
+            else
+                indexed++;
+            conversation_clear(&conv);
+            free(conv.messages);
+        }
+        printf("%u of %lu sessions added to the search index.\n", indexed, (unsigned long)(argc - 2));
+        return indexed == argc - 2 ? 0 : 1;
+    }
+    if (strcmp(argv[1], "--daemon") == 0)
+        return daemon_mode(apikey, socket_path);
+    if (strcmp(argv[1], "--count-tokens") == 0)
+    {
+        struct string text;
+        init_string_arena(&text, &turn_arena);
+        for (i = 2; i < argc; i++)
+        {
+            append_string(&text, argv[i], strlen(argv[i]));
+            if (argc > i + 1)
+                append_string(&text, " ", 1);
+        }
+        if (argc == 2)
+        {
+            while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+                append_string(&text, buffer, n);
+        }
+        printf("%s%lu\n", tokenizer_exact() ? "" : "~", (unsigned long)count_tokens(text.ptr, text.len));
+        return 0;
+    }
+    if (strcmp(argv[1], "--batch") == 0)
+    {
+        unsigned int parallel = 8;
+        bool ordered = true;
+        bool own_endpoints = false;
+        if (argc < 3)
+        {
+            fprintf(stderr, "Error: --batch needs a file name, or '-' for standard input.\n");
+            return 1;
+        }
+        for (i = 3; i + 1 < argc; i += 2)
+        {
+            if (strcmp(argv[i], "--parallel") == 0 && atoi(argv[i + 1]) > 0)
+                parallel = atoi(argv[i + 1]);
+            else if (strcmp(argv[i], "--order") == 0 && strcmp(argv[i + 1], "completion") == 0)
+                ordered = false;
+            else if (strcmp(argv[i], "--order") == 0 && strcmp(argv[i + 1], "input") == 0)
+                ordered = true;
+            else if (strcmp(argv[i], "--endpoint") == 0)
+            {
+                /* Endpoints given here replace the configured ones */
+                if (!own_endpoints)
+                    pool.count = 0;
+                own_endpoints = true;
+                if (pool_add_line(argv[i + 1]) != 0)
+                    return 1;
+            }
+            else
+            {
+                fprintf(stderr, "Error: unknown batch option '%s'.\n", argv[i]);
+                return 1;
+            }
+        }
+        if (i < argc)
+        {
+            fprintf(stderr, "Error: batch option '%s' needs a value.\n", argv[i]);
+            return 1;
+        }
+        return metrics_finish(batch_mode(apikey, model, argv[2], parallel, ordered));
+    }
+    if (strcmp(argv[1], "--map") == 0)
+    {
+        const char *reduce = NULL, *path = NULL;
+        unsigned int parallel = 8;
+        size_t chunk_tokens = 0;
+        if (argc < 3)
+        {
+            fprintf(stderr, "Error: --map needs an instruction.\n");
+            return 1;
+        }
+        for (i = 3; i < argc; i++)
+        {
+            if (strcmp(argv[i], "--reduce") == 0 && i + 1 < argc)
+                reduce = argv[++i];
+            else if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+                parallel = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--chunk-tokens") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+                chunk_tokens = atoi(argv[++i]);
+            else if (path == NULL && (argv[i][0] != '-' || strcmp(argv[i], "-") == 0))
+                path = argv[i];
+            else
+            {
+                fprintf(stderr, "Error: unknown or incomplete map-reduce option '%s'.\n", argv[i]);
+                return 1;
+            }
+        }
+        return metrics_finish(mapreduce_mode(apikey, model, argv[2], reduce, path, parallel, chunk_tokens));
+    }
+    if (strcmp(argv[1], "--compare") == 0)
+    {
+        const char *models[COMPARE_MAX];
+        struct compare_slot slots[COMPARE_MAX];
+        struct conversation conv;
+        struct string text;
+        unsigned int count;
+        if (argc < 4)
+        {
+            fprintf(stderr, "Error: --compare needs a comma separated list of models and a prompt.\n");
+            return 1;
+        }
+        if ((count = compare_models(argv[2], models)) == 0)
+            return 1;
+        init_string_arena(&text, &turn_arena);
+        for (i = 3; i < argc; i++)
+        {
+            append_string(&text, argv[i], strlen(argv[i]));
+            if (argc > i + 1)
+                append_string(&text, " ", 1);
+        }
+        conversation_init(&conv);
+        if (conversation_attach_files(&conv, attach_paths, attach_count) != 0)
+            return 1;
+        conversation_append(&conv, ROLE_USER, text.ptr, text.len);
+        for (i = 0; i < count; i++)
+            slots[i].model = models[i];
+        unsigned int failed = compare_perform(slots, count, &conv, 1.0F, apikey);
+        conversation_clear(&conv);
+        free(conv.messages);
+        return metrics_finish(failed > 0 ? 1 : 0);
     }
 
-    char *data = "{\"model\": \"";
-
-    data = concat(data, model);
-    data = concat(data, "\", \"messages\": [{\"role\": \"user\", \"content\": \"");
-    data = concat(data, prompt);
-    data = concat(data, "\"}]}");
+    struct string prompt;
+    init_string_arena(&prompt, &turn_arena);
 
-    char *res = chatgpt_curl_perform(data, apikey, "https://api.openai.com/v1/chat/completions");
+    for (i = 1; i < argc; i++)
+    {
+        append_string(&prompt, argv[i], strlen(argv[i]));
+        if (argc > i + 1)
+            append_string(&prompt, " ", 1);
+    }
 
-    free(data);
-    free(apikey);
-    free(model);
+    /* The daemon keeps its own metrics, run here when they are wanted; it only takes prompts */
+    if (use_daemon && metrics.json_path == NULL && attach_count == 0)
+    {
+        int status = daemon_forward(socket_path, model, prompt.ptr, prompt.len, cache.enabled);
+        if (status >= 0)
+            return status;
+    }
 
-    if (res == NULL)
+    struct conversation conv;
+    conversation_init(&conv);
+    if (conversation_attach_files(&conv, attach_paths, attach_count) != 0)
+        return 1;
+    conversation_append(&conv, ROLE_USER, prompt.ptr, prompt.len);
+    if (context_check(&conv, model, true) != 0)
         return 1;
+    uint64_t key[2];
+    cache_key(model, 1.0F, &conv, key);
+    char *res = cache_lookup(cache.enabled, &turn_arena, key, NULL);
+    if (res != NULL)
+    {
+        usage_log(model, NULL, NULL, 0, USAGE_CACHED);
+        printf("%s\n", res);
+    }
+    else
+    {
+        unsigned int tokens_before = tokens;
+        struct request_body body;
+        build_request(&body, &turn_arena, model, 1.0F, &conv, true);
+        res = chatgpt_curl_perform(&body, apikey, true);
+        if (res != NULL)
+            cache_store(cache.enabled, key, res, strlen(res), tokens - tokens_before);
+    }
 
-    printf("%s\n", res);
+    conversation_clear(&conv);
+    free(conv.messages);
+    arena_free(&turn_arena);
+    arena_free(&session_arena);
 
-    free(res);
-    return 0;
+    return metrics_finish(res == NULL ? 1 : 0);
 }